@@ -0,0 +1,66 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <chrono>
+
+
+struct ChatRecord
+{
+	std::chrono::system_clock::time_point timestamp;
+	std::string sender;
+	std::string payload;
+};
+
+
+//Fixed-capacity ring of chat records. Once full, every Add() overwrites the
+//oldest record in place, reusing its string storage, so a long-running session
+//stays at constant memory and constant cost per message.
+//Index 0 is always the oldest record still held.
+class ChatHistory
+{
+public:
+	explicit ChatHistory(const size_t capacity = 10000)
+		: capacity_(capacity ? capacity : 1)
+		, oldest_(0)
+		, total_added_(0)
+	{}
+
+	size_t Capacity() const { return capacity_; }
+	size_t Size() const { return records_.size(); }
+	bool Empty() const { return records_.empty(); }
+
+	//Number of records ever added, including those since evicted
+	size_t TotalAdded() const { return total_added_; }
+
+	const ChatRecord& operator[](const size_t i) const
+	{
+		return records_[(oldest_ + i) % records_.size()];
+	}
+
+	void Add(const std::chrono::system_clock::time_point timestamp, const std::string& sender, const char* const payload, const size_t length)
+	{
+		total_added_++;
+		if (records_.size() < capacity_)
+		{
+			records_.push_back(ChatRecord{ timestamp, sender, std::string(payload, length) });
+			return;
+		}
+
+		auto& record = records_[oldest_];
+		record.timestamp = timestamp;
+		record.sender.assign(sender);
+		record.payload.assign(payload, length);
+		oldest_ = (oldest_ + 1) % capacity_;
+	}
+
+	void Add(const std::chrono::system_clock::time_point timestamp, const std::string& sender, const std::string& payload)
+	{
+		Add(timestamp, sender, payload.data(), payload.size());
+	}
+
+private:
+	const size_t capacity_;
+	std::vector<ChatRecord> records_;
+	size_t oldest_;
+	size_t total_added_;
+};
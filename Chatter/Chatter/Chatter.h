@@ -1,10 +1,26 @@
 #pragma once
 #include "transport.h"
+#include "reactor.h"
+#include "spsc_queue.h"
+#include "ChatHistory.h"
+#include "codec.h"
+#include "reliability.h"
+#include "metrics.h"
+#include "latency.h"
+#include "impairment.h"
+#include "timer_wheel.h"
 #include <memory>
 #include <thread>
 #include <chrono>
 #include "Tokeniser.h"
 #include <iostream>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <random>
+#include <algorithm>
 
 #ifdef GetMessage
 #undef GetMessage
@@ -26,10 +42,85 @@ void ExtractIpAndPort(const string& endpoint, string& ip, unsigned short& port)
 }
 
 
+uint32_t RandomSenderId()
+{
+	random_device device;
+	return device();
+}
+
+
+//Encodes message without copying it: parts gets each frame's header and body
+//as consecutive spans, for the kernel to gather. Returns the number of frames.
+size_t GatherFrames(MessageEncoder& encoder, const string& message, vector<IoSpan>& parts)
+{
+	const size_t frames = encoder.EncodeGather(message.data(), message.size());
+	parts.clear();
+	for (size_t i = 0; i < frames; ++i)
+	{
+		const auto& frame = encoder.Gathered(i);
+		parts.push_back(IoSpan{ frame.header, frame.header_size });
+		parts.push_back(IoSpan{ frame.body, frame.body_size });
+	}
+	return frames;
+}
+
+
+//How often a receive thread drops reassemblies that timed out
+milliseconds SweepInterval(const milliseconds reassembly_timeout)
+{
+	return max(milliseconds(1), reassembly_timeout / 4);
+}
+
+
+string EndpointToString(const sockaddr_in& endpoint)
+{
+	char ip[INET_ADDRSTRLEN] = { 0 };
+	inet_ntop(AF_INET, &endpoint.sin_addr, ip, sizeof ip);
+	return string(ip) + ':' + to_string(ntohs(endpoint.sin_port));
+}
+
+
+//One metrics dump, a few lines at Info level
+void LogMetrics(const string& channel, const ChannelMetrics::Snapshot& metrics)
+{
+	const auto us = [](const LatencyHistogram::Duration d) { return static_cast<unsigned long>(d.count() / 1000); };
+	CHATTER_INFO("metrics %s", channel);
+	CHATTER_INFO("  tx %lu messages %lu bytes, rx %lu messages %lu bytes"
+		, static_cast<unsigned long>(metrics.tx_messages), static_cast<unsigned long>(metrics.tx_bytes)
+		, static_cast<unsigned long>(metrics.rx_messages), static_cast<unsigned long>(metrics.rx_bytes));
+	CHATTER_INFO("  drops %lu, truncations %lu, send errors %lu, queue depth %lu"
+		, static_cast<unsigned long>(metrics.drops), static_cast<unsigned long>(metrics.truncations)
+		, static_cast<unsigned long>(metrics.send_errors), static_cast<unsigned long>(metrics.queue_depth));
+	CHATTER_INFO("  send us p50 %lu p99 %lu p99.9 %lu max %lu"
+		, us(metrics.send.p50), us(metrics.send.p99), us(metrics.send.p999), us(metrics.send.max));
+	CHATTER_INFO("  delivery us p50 %lu p99 %lu p99.9 %lu max %lu"
+		, us(metrics.delivery.p50), us(metrics.delivery.p99), us(metrics.delivery.p999), us(metrics.delivery.max));
+}
+
+
+void LogLatency(const string& peer, const LatencyTracker::Stats& latency)
+{
+	const auto us = [](const LatencyHistogram::Duration d) { return static_cast<unsigned long>(d.count() / 1000); };
+	CHATTER_INFO("latency %s: %lu probes, %lu echoes", peer
+		, static_cast<unsigned long>(latency.probes_sent), static_cast<unsigned long>(latency.echoes_received));
+	CHATTER_INFO("  rtt us p50 %lu p99 %lu p99.9 %lu max %lu"
+		, us(latency.round_trip.p50), us(latency.round_trip.p99), us(latency.round_trip.p999), us(latency.round_trip.max));
+	CHATTER_INFO("  one-way us p50 %lu p99 %lu p99.9 %lu max %lu"
+		, us(latency.one_way.p50), us(latency.one_way.p99), us(latency.one_way.p999), us(latency.one_way.max));
+}
+
+
 
 struct ChannelCallbackHandler
 {
 	virtual void OnMessageReceived(const string& message) = 0;
+
+	//Zero-copy delivery straight from the receive buffer. Handlers that only
+	//want text can rely on the default, which copies into a string.
+	virtual void OnBufferReceived(const sockaddr_in& sender, const BufferRef& message)
+	{
+		OnMessageReceived(message.ToString());
+	}
 };
 
 
@@ -57,50 +148,315 @@ struct ChatterView
 	virtual std::string GetMessage() const = 0;
 	virtual size_t GetMessageLength() const = 0;
 	virtual void SetMessage(const std::string& message) = 0;
-	virtual void AppendToChatHistory(const std::string& message) = 0;
+	//Records were added to the presenter's History(); repaint when convenient
+	virtual void ChatHistoryChanged() = 0;
+};
+
+
+
+//Decides when a view should repaint: at most once per frame interval, but
+//never leaving a change unpainted for longer than max_latency.
+class FrameThrottle
+{
+public:
+	using Clock = steady_clock;
+
+	FrameThrottle(const milliseconds frame_interval = milliseconds(1000 / 30)
+		, const milliseconds max_latency = milliseconds(100))
+		: frame_interval_(frame_interval)
+		, max_latency_(max_latency)
+		, last_flush_()
+		, first_pending_()
+		, pending_(false)
+	{}
+
+	void SetFrameInterval(const milliseconds interval) { frame_interval_ = interval; }
+	void SetMaxLatency(const milliseconds latency) { max_latency_ = latency; }
+	bool Pending() const { return pending_; }
+
+	void Notify(const Clock::time_point now = Clock::now())
+	{
+		if (!pending_)
+			first_pending_ = now;
+		pending_ = true;
+	}
+
+	bool FlushDue(const Clock::time_point now = Clock::now()) const
+	{
+		return pending_ &&
+			(now - last_flush_ >= frame_interval_ || now - first_pending_ >= max_latency_);
+	}
+
+	void Flushed(const Clock::time_point now = Clock::now())
+	{
+		pending_ = false;
+		last_flush_ = now;
+	}
+
+private:
+	milliseconds frame_interval_;
+	milliseconds max_latency_;
+	Clock::time_point last_flush_;
+	Clock::time_point first_pending_;
+	bool pending_;
 };
 
 
 
+//One bound UDP socket shared by any number of peers. Outgoing messages are fanned
+//out to every peer with a single sendmmsg; incoming datagrams are matched to a
+//peer by their source address, and datagrams from unknown sources are dropped.
+//Every message travels in a frame (see frame.h) carrying our sender id and a
+//sequence number, so loss, reordering and duplicates can be counted. Messages
+//that do not fit in one MTU-sized datagram are fragmented and reassembled.
+//EnableReliableDelivery() adds acknowledgements, retransmission and in-order
+//delivery per peer (see reliability.h); both ends must enable it. Reliable mode
+//also paces and backs off on loss by itself, otherwise SetSendRateLimit() caps
+//the rate SendMessage() may send at.
+//SetReceiveShards() spreads receiving over several SO_REUSEPORT sockets on the
+//same port, each drained by its own (optionally pinned) thread. The kernel
+//hashes each sender to one socket, so a sender's datagrams are still handled
+//in order by one thread; callbacks from different shards are serialised.
 class UdpChatChannel : public ChatChannel
 {
 public:
 	UdpChatChannel(const string& my_endpoint, const string& peer_endpoint)
+		: UdpChatChannel(my_endpoint, vector<string>{ peer_endpoint })
+	{}
+
+
+	UdpChatChannel(const string& my_endpoint, const vector<string>& peer_endpoints)
 		: my_ip_("")
 		, my_port_(0u)
-		, peer_ip_("")
-		, peer_port_(0u)
-		, send_socket_(nullptr)
-		, recv_socket_(nullptr)
-		, worker_(nullptr)
-		, received_message_count_(0lu)
-		, stopWorker_(false)
+		, encoder_(RandomSenderId())
+		, reliable_(false)
+		, pacer_generation_(0)
+		, socket_options_(DefaultSocketOptions())
+		, shard_count_(1)
+		, pin_shards_(true)
+		, reassembly_timeout_(seconds(5))
+		, metrics_dump_(0)
+		, probe_interval_(0)
+		, unknown_sender_count_(0lu)
 	{
 		ExtractIpAndPort(my_endpoint, my_ip_, my_port_);
-		ExtractIpAndPort(peer_endpoint, peer_ip_, peer_port_);
+		for (const auto& endpoint : peer_endpoints)
+			AddPeer(endpoint);
 	}
 
 
 	~UdpChatChannel()
 	{
-		stopWorker_ = true;
-		if (worker_)
-			worker_->join();
-		cout << "Channel destroyed." << endl;
+		for (auto& shard : shards_)
+			shard->reactor->Stop();
+		for (auto& shard : shards_)
+		{
+			if (shard->worker)
+				shard->worker->join();
+		}
+
+		//Reliable receivers may still hold frames from the shards' pools
+		peers_.clear();
+		CHATTER_INFO("Channel destroyed.");
 	}
 
 
 	string GetMyIpAddress() const { return my_ip_; }
 	unsigned short GetMyPort() const { return my_port_; }
-	string GetPeerIpAddress() const { return peer_ip_; }
-	unsigned short GetPeerPort() const { return peer_port_; }
-	size_t ReceivedMessageCount() const { return received_message_count_; }
+	string GetPeerIpAddress() const { lock_guard<mutex> lock(peers_mutex_); return peers_.empty() ? "" : peers_[0].ip; }
+	unsigned short GetPeerPort() const { lock_guard<mutex> lock(peers_mutex_); return peers_.empty() ? 0u : peers_[0].port; }
+	size_t PeerCount() const { lock_guard<mutex> lock(peers_mutex_); return peers_.size(); }
+	size_t ReceivedMessageCount() const { return static_cast<size_t>(metrics_.Get(ChannelMetrics::RxMessages)); }
+	size_t UnknownSenderCount() const { return unknown_sender_count_; }
+	ChannelMetrics::Snapshot Metrics() const { return metrics_.Take(); }
+	uint32_t SenderId() const { return encoder_.SenderId(); }
+	size_t ReceiveShardCount() const { return shards_.size(); }
+
+
+	//Summed over the receive shards
+	FrameReceiver::Stats FrameStats() const
+	{
+		FrameReceiver::Stats total = {};
+		for (const auto& shard : shards_)
+		{
+			const auto stats = shard->decoder.FrameStats();
+			total.frames += stats.frames;
+			total.malformed += stats.malformed;
+			total.truncated += stats.truncated;
+			total.duplicates += stats.duplicates;
+			total.reordered += stats.reordered;
+			total.lost += stats.lost;
+		}
+		return total;
+	}
+
+
+	Reassembler::Stats ReassemblyStats() const
+	{
+		Reassembler::Stats total = {};
+		for (const auto& shard : shards_)
+		{
+			const auto stats = shard->decoder.ReassemblyStats();
+			total.completed += stats.completed;
+			total.expired += stats.expired;
+			total.rejected += stats.rejected;
+			total.in_progress += stats.in_progress;
+			total.bytes_held += stats.bytes_held;
+		}
+		return total;
+	}
+
+
+	BufferPool::Stats PoolStats() const
+	{
+		BufferPool::Stats total = {};
+		for (const auto& shard : shards_)
+		{
+			const auto stats = shard->socket->PoolStats();
+			total.hits += stats.hits;
+			total.misses += stats.misses;
+			total.in_use += stats.in_use;
+			total.high_water += stats.high_water;
+		}
+		return total;
+	}
+
+
+	//Messages delivered by each receive shard, to see how the kernel spreads senders
+	vector<size_t> ShardReceivedMessageCounts() const
+	{
+		vector<size_t> counts;
+		for (const auto& shard : shards_)
+			counts.push_back(shard->received);
+		return counts;
+	}
+
+
+	size_t PeerReceivedMessageCount(const string& peer_endpoint) const
+	{
+		lock_guard<mutex> lock(peers_mutex_);
+		const auto it = peer_index_.find(PeerKey(ToAddress(peer_endpoint)));
+		return it == peer_index_.end() ? 0 : peers_[it->second].received_message_count;
+	}
+
+
+	//Window, RTT and retransmission counters of the reliable link to one peer
+	ReliableLink::Stats ReliabilityStats(const string& peer_endpoint) const
+	{
+		lock_guard<mutex> lock(peers_mutex_);
+		const auto it = peer_index_.find(PeerKey(ToAddress(peer_endpoint)));
+		return it == peer_index_.end() || !peers_[it->second].link ? ReliableLink::Stats{} : peers_[it->second].link->GetStats();
+	}
+
+
+	//Must be called before Initialise()
+	void EnableReliableDelivery(const ReliableOptions& options = ReliableOptions())
+	{
+		lock_guard<mutex> lock(peers_mutex_);
+		reliable_ = true;
+		reliable_options_ = options;
+		for (auto& peer : peers_)
+			peer.link = make_unique<ReliableLink>(encoder_.SenderId(), reliable_options_);
+	}
+
+
+	bool ReliableDelivery() const { return reliable_; }
+
+
+	//Must be called before Initialise()
+	void SetSocketOptions(const SocketOptions& options) { socket_options_ = options; }
+
+	//As applied by the kernel, once initialised
+	SocketOptions EffectiveSocketOptions() const { return shards_.empty() ? socket_options_ : shards_[0]->socket->EffectiveOptions(); }
+
+
+	//Must be called before Initialise(). Logs Metrics() at Info level every
+	//interval from the first shard's reactor; 0 turns it off.
+	void SetMetricsDump(const milliseconds interval) { metrics_dump_ = interval; }
+
+
+	//Must be called before Initialise(). Sends every peer a latency probe each
+	//interval, see latency.h; 0 turns it off. Probes from peers are answered
+	//either way.
+	void EnableLatencyProbes(const milliseconds interval) { probe_interval_ = interval; }
+
+
+	//Round trip and one-way delay percentiles from the probes exchanged with one peer
+	LatencyTracker::Stats PeerLatency(const string& peer_endpoint) const
+	{
+		lock_guard<mutex> lock(peers_mutex_);
+		const auto it = peer_index_.find(PeerKey(ToAddress(peer_endpoint)));
+		return it == peer_index_.end() || !peers_[it->second].latency ? LatencyTracker::Stats{} : peers_[it->second].latency->GetStats();
+	}
+
+
+	//Must be called before Initialise(). Messages still missing fragments this
+	//long after the first arrived are dropped.
+	void SetReassemblyTimeout(const milliseconds timeout) { reassembly_timeout_ = timeout; }
+
+
+	//Must be called before Initialise(). 0 uses one shard per core.
+	void SetReceiveShards(const size_t count, const bool pin_threads = true)
+	{
+		shard_count_ = count;
+		pin_shards_ = pin_threads;
+	}
+
+
+	//Unreliable mode has no loss feedback to adapt to, so this fixed limit is what
+	//keeps a scripted sender from flooding its peers: SendMessage() blocks the
+	//caller while over it. Counts payload bytes to all peers; 0 lifts the limit.
+	//Blocked callers wake to go by the new limit.
+	void SetSendRateLimit(const double bytes_per_second, const double burst_bytes)
+	{
+		{
+			lock_guard<mutex> lock(pacer_mutex_);
+			pacer_.SetRate(bytes_per_second, burst_bytes);
+			pacer_generation_++;
+		}
+		pacer_changed_.notify_all();
+	}
+
+
+	bool AddPeer(const string& peer_endpoint)
+	{
+		Peer peer = { "", 0u, sockaddr_in{}, 0lu, nullptr, nullptr };
+		ExtractIpAndPort(peer_endpoint, peer.ip, peer.port);
+		peer.address = ToAddress(peer_endpoint);
+
+		lock_guard<mutex> lock(peers_mutex_);
+		if (!peer_index_.emplace(PeerKey(peer.address), peers_.size()).second)
+			return false;
+		if (reliable_)
+			peer.link = make_unique<ReliableLink>(encoder_.SenderId(), reliable_options_);
+		peers_.push_back(move(peer));
+		return true;
+	}
+
+
+	bool RemovePeer(const string& peer_endpoint)
+	{
+		lock_guard<mutex> lock(peers_mutex_);
+		const auto it = peer_index_.find(PeerKey(ToAddress(peer_endpoint)));
+		if (it == peer_index_.end())
+			return false;
+
+		peers_.erase(peers_.begin() + it->second);
+		peer_index_.clear();
+		for (size_t i = 0; i < peers_.size(); ++i)
+			peer_index_.emplace(PeerKey(peers_[i].address), i);
+		return true;
+	}
 
 
 	string ToString() const override
 	{
-		return my_ip_ + ':' + to_string(my_port_)
-			+ " <---> " + peer_ip_ + ':' + to_string(peer_port_);
+		string peers;
+		lock_guard<mutex> lock(peers_mutex_);
+		for (const auto& peer : peers_)
+			peers += (peers.empty() ? "" : ", ") + peer.ip + ':' + to_string(peer.port);
+
+		return my_ip_ + ':' + to_string(my_port_) + " <---> " + peers;
 	}
 
 
@@ -108,126 +464,1155 @@ public:
 	{
 		if (IsOpen())
 		{
-			cout << "Error: Already running!" << endl;
+			CHATTER_ERROR("Error: Already running!");
 			return false;
 		}
 
-		send_socket_ = make_unique<UdpSocket>(peer_port_, peer_ip_.c_str());
-		recv_socket_ = make_unique<UdpSocket>(my_port_, my_ip_.c_str());
+		const size_t count = shard_count_ ? shard_count_ : max(1u, thread::hardware_concurrency());
+		SocketOptions options = socket_options_;
+		options.reuse_port |= count > 1;
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			//With an ephemeral port the first shard picks it and the others join in
+			const unsigned short port = i ? ntohs(shards_[0]->socket->LocalEndpoint().sin_port) : my_port_;
+			shards_.push_back(make_unique<Shard>(reassembly_timeout_));
+			auto& shard = *shards_.back();
+			//Coalesced datagrams need room for up to 64KB
+			shard.socket = options.gro
+				? make_unique<UdpSocket>(port, my_ip_.c_str(), options, 64, 64 << 10)
+				: make_unique<UdpSocket>(port, my_ip_.c_str(), options);
+			shard.reactor = make_unique<Reactor>();
+
+			//A port in use stays in use; the caller decides whether to try again
+			if (!shard.socket->Bind()
+				|| !shard.reactor->Watch(shard.socket->EventHandle(), [this, &shard] { OnReadable(shard); })
+				|| !shard.reactor->Every(SweepInterval(reassembly_timeout_), [&shard] { shard.decoder.ExpireFragments(); }))
+				return AbandonInitialise();
+		}
+
+		//Retransmission timers are checked at this granularity
+		if (reliable_ && !shards_[0]->reactor->Every(milliseconds(5), [this] { OnTick(); }))
+			return AbandonInitialise();
+		if (metrics_dump_.count() && !shards_[0]->reactor->Every(metrics_dump_, [this] { DumpMetrics(); }))
+			return AbandonInitialise();
+		if (probe_interval_.count() && !shards_[0]->reactor->Every(probe_interval_, [this] { OnProbeTick(); }))
+			return AbandonInitialise();
 
-		while (!recv_socket_->Bind())
-			this_thread::sleep_for(500ms);
+		for (size_t i = 0; i < count; ++i)
+		{
+			shards_[i]->worker = make_unique<thread>(&Reactor::Run, shards_[i]->reactor.get());
+			if (count > 1 && pin_shards_)
+				PinThreadToCore(*shards_[i]->worker, i);
+		}
 
-		worker_ = make_unique<thread>(&UdpChatChannel::ReceiveLoop, this);
-		cout << "Channel initialised." << endl;
+		CHATTER_INFO("Channel initialised.");
 		return true;
 	}
 
 
 	bool IsOpen() const override
 	{
-		return send_socket_ && recv_socket_ &&
-			send_socket_->IsOpen() && recv_socket_->IsOpen() && worker_;
+		return !shards_.empty() && shards_[0]->socket->IsOpen() && shards_[0]->worker;
 	}
 
 
 	void SendMessage(const std::string& message) override
 	{
-		send_socket_->SendTo(peer_ip_.c_str(), message);
+		if (!reliable_)
+		{
+			const size_t bytes = message.size() * PeerCount();
+			//Waits unlocked, so other senders and SetSendRateLimit() go on meanwhile
+			unique_lock<mutex> lock(pacer_mutex_);
+			while (!pacer_.TryConsume(bytes))
+			{
+				const uint64_t generation = pacer_generation_;
+				pacer_changed_.wait_for(lock, pacer_.Delay(), [&] { return pacer_generation_ != generation; });
+			}
+		}
+
+		const auto start = steady_clock::now();
+		lock_guard<mutex> lock(peers_mutex_);
+		metrics_.Add(ChannelMetrics::TxMessages);
+		metrics_.Add(ChannelMetrics::TxBytes, message.size() * peers_.size());
+
+		if (reliable_)
+		{
+			for (auto& peer : peers_)
+				peer.link->Queue(message.data(), message.size());
+			FlushLinks(ReliableLink::Clock::now());
+		}
+		else
+		{
+			SendFrames(message);
+		}
+		metrics_.SendLatency().Record(steady_clock::now() - start);
 	}
 
 
+	//The shards' reactors own the sockets, so messages delivered while no
+	//callback handler is set are kept for this instead, up to UnclaimedLimit.
+	//Never blocks; returns false when none are waiting.
 	bool ReceiveMessage(std::string& message) override
 	{
-		auto request = recv_socket_->RecvFrom<string>(150);
-		//auto& req_ip = request.first; 
-		if (request.second.size())
+		lock_guard<mutex> lock(unclaimed_mutex_);
+		if (unclaimed_.empty())
+			return false;
+		message.swap(unclaimed_.front());
+		unclaimed_.pop_front();
+		return true;
+	}
+
+
+private:
+	struct Peer
+	{
+		string ip;
+		unsigned short port;
+		sockaddr_in address;
+		size_t received_message_count;
+		unique_ptr<ReliableLink> link;	//reliable mode only
+		unique_ptr<LatencyTracker> latency;	//from the first probe either way
+	};
+
+	//One receive socket with its own thread and decoding state
+	struct Shard
+	{
+		explicit Shard(const milliseconds reassembly_timeout) : decoder(reassembly_timeout), received(0) {}
+
+		unique_ptr<UdpSocket> socket;
+		unique_ptr<Reactor> reactor;
+		unique_ptr<thread> worker;
+		DatagramBatch batch;
+		MessageDecoder decoder;
+		BufferRef message;
+		vector<Datagram> ordered;
+		atomic<size_t> received;
+	};
+
+	static constexpr const size_t UnclaimedLimit = 4096;
+
+	//Outgoing datagrams all leave through the first shard's socket
+	UdpSocket& SendSocket() { return *shards_[0]->socket; }
+
+
+	//Undoes a failed Initialise() before any worker has started, so it can be retried
+	bool AbandonInitialise()
+	{
+		shards_.clear();
+		return false;
+	}
+
+
+	//Unreliable mode, caller holds peers_mutex_
+	void SendFrames(const string& message)
+	{
+		const size_t frames = GatherFrames(encoder_, message, parts_);
+
+		//Every frame but the last is the same size, so the kernel can cut them up
+		auto& socket = SendSocket();
+		if (frames > 1 && socket.SegmentOffload())
 		{
-			message = request.second;
-			return true;
+			const auto& first = encoder_.Gathered(0);
+			for (const auto& peer : peers_)
+				metrics_.Add(ChannelMetrics::SendErrors
+					, frames - socket.SendSegmented(peer.address, parts_.data(), parts_.size(), first.header_size + first.body_size));
+			return;
 		}
-		return false;
+
+		gathered_.clear();
+		for (size_t i = 0; i < frames; ++i)
+			for (const auto& peer : peers_)
+				gathered_.push_back(GatherDatagram{ peer.address, &parts_[2 * i], 2 });
+
+		metrics_.Add(ChannelMetrics::SendErrors, gathered_.size() - socket.SendBatch(gathered_.data(), gathered_.size()));
+	}
+
+	static sockaddr_in ToAddress(const string& endpoint)
+	{
+		string ip;
+		unsigned short port = 0u;
+		ExtractIpAndPort(endpoint, ip, port);
+
+		sockaddr_in address = { 0 };
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = inet_addr(ip.c_str());
+		address.sin_port = htons(port);
+		return address;
 	}
 
+	//Kernel default receive buffers (~200KB) overflow under bursts from many peers
+	static SocketOptions DefaultSocketOptions()
+	{
+		SocketOptions options;
+		options.receive_buffer = 4 << 20;
+		options.send_buffer = 1 << 20;
+		return options;
+	}
 
-private:
-	void ReceiveLoop()
+	static uint64_t PeerKey(const sockaddr_in& address)
+	{
+		return (static_cast<uint64_t>(address.sin_addr.s_addr) << 16) | address.sin_port;
+	}
+
+
+	//Called on the reactor thread whenever the socket becomes readable;
+	//drains every pending datagram before going back to sleep.
+	void OnReadable(Shard& shard)
 	{
-		string buffer;
-		while (!stopWorker_)
+		while (shard.socket->RecvBatch(shard.batch))
 		{
-			if (ReceiveMessage(buffer))
+			const auto now = ReliableLink::Clock::now();
+			for (const auto& datagram : shard.batch)
 			{
-				received_message_count_++;
+				bool reliable_frame = false;
+				{
+					lock_guard<mutex> lock(peers_mutex_);
+					const auto it = peer_index_.find(PeerKey(datagram.remote));
+					if (it == peer_index_.end())
+					{
+						unknown_sender_count_++;
+						metrics_.Add(ChannelMetrics::Drops);
+						continue;
+					}
 
-				if (callbackHandler_)
-					callbackHandler_->OnMessageReceived(buffer);
+					auto& peer = peers_[it->second];
+					if (!datagram.truncated && IsProbeFrame(datagram.data, datagram.size))
+					{
+						OnProbe(peer, datagram);
+						continue;
+					}
+
+					FrameHeader header;
+					const char* payload = nullptr;
+					if (peer.link && !datagram.truncated
+						&& DecodeFrame(datagram.data, datagram.size, header, payload)
+						&& (header.flags & (FrameFlagReliable | FrameFlagAck)))
+					{
+						reliable_frame = true;
+						shard.ordered.clear();
+						peer.link->OnFrame(header, payload, datagram, shard.ordered, now);
+					}
+				}
+
+				if (!reliable_frame)
+				{
+					Deliver(shard, datagram, now);
+					continue;
+				}
+
+				for (const auto& ordered : shard.ordered)
+					Deliver(shard, ordered, now);
+				shard.ordered.clear();
 			}
 
-			this_thread::sleep_for(1ms);
+			if (reliable_)
+			{
+				lock_guard<mutex> lock(peers_mutex_);
+				FlushLinks(now);
+			}
 		}
 	}
 
 
+	void Deliver(Shard& shard, const Datagram& datagram, const ReliableLink::Clock::time_point received)
+	{
+		if (datagram.truncated)
+			metrics_.Add(ChannelMetrics::Truncations);
 
-private:
-	string my_ip_;
-	unsigned short my_port_;
-	string peer_ip_;
-	unsigned short peer_port_;
-	unique_ptr<UdpSocket> send_socket_;
-	unique_ptr<UdpSocket> recv_socket_;
-	unique_ptr<thread> worker_;
-	size_t received_message_count_;
-	bool stopWorker_;
-};
+		//Fragments short of a whole message are not refused, just held
+		FrameHeader header = {};
+		if (!shard.decoder.Decode(datagram.data, datagram.size, datagram.truncated, datagram.buffer, shard.message, header))
+		{
+			if (!(header.flags & FrameFlagFragment))
+				metrics_.Add(ChannelMetrics::Drops);
+			return;
+		}
+
+		shard.received++;
+		{
+			lock_guard<mutex> lock(peers_mutex_);
+			const auto it = peer_index_.find(PeerKey(datagram.remote));
+			if (it != peer_index_.end())
+				peers_[it->second].received_message_count++;
+		}
 
+		if (callbackHandler_)
+		{
+			lock_guard<mutex> lock(callback_mutex_);
+			callbackHandler_->OnBufferReceived(datagram.remote, shard.message);
+		}
+		else
+		{
+			lock_guard<mutex> lock(unclaimed_mutex_);
+			if (unclaimed_.size() < UnclaimedLimit)
+				unclaimed_.emplace_back(shard.message.data(), shard.message.size());
+			else
+				metrics_.Add(ChannelMetrics::Drops);
+		}
+		metrics_.Add(ChannelMetrics::RxBytes, shard.message.size());
+		metrics_.Add(ChannelMetrics::RxMessages);
+		metrics_.DeliveryLatency().Record(ReliableLink::Clock::now() - received);
+		shard.message = BufferRef();
+	}
 
 
-class ChatterPresenter : public ChannelCallbackHandler
-{
-public:
-	ChatterPresenter(ChatChannel& channel)
-		: channel_(channel)
-		, view_(nullptr)
+	//Answers probes and records echoes. Caller holds peers_mutex_.
+	void OnProbe(Peer& peer, const Datagram& datagram)
 	{
-		channel_.SetCallbackHandler(this);
+		FrameHeader header;
+		const char* payload = nullptr;
+		Probe probe, echo;
+		if (!DecodeFrame(datagram.data, datagram.size, header, payload) || !DecodeProbe(payload, header.payload_length, probe))
+		{
+			metrics_.Add(ChannelMetrics::Drops);
+			return;
+		}
+
+		if (!peer.latency)
+			peer.latency = make_unique<LatencyTracker>();
+		if (peer.latency->OnProbe(probe, ProbeClock(), echo))
+			SendProbe(peer.address, echo);
 	}
 
-	void SetView(ChatterView* view)
+
+	void SendProbe(const sockaddr_in& address, const Probe& probe)
 	{
-		view_ = view;
+		char frame[ProbeFrameSize];
+		EncodeProbe(probe, encoder_.SenderId(), frame);
+		const IoSpan span = { frame, sizeof frame };
+		if (SendSocket().SendTo(address, &span, 1) == SOCKET_ERROR)
+			metrics_.Add(ChannelMetrics::SendErrors);
 	}
 
-	void OnSendCommand()
+
+	//Reactor timer with latency probes enabled
+	void OnProbeTick()
 	{
-		string msg = view_->GetMessage();
-		msg += '\n';
-		view_->AppendToChatHistory(msg);
-		channel_.SendMessage(msg);
-		view_->SetMessage("");
+		lock_guard<mutex> lock(peers_mutex_);
+		for (auto& peer : peers_)
+		{
+			if (!peer.latency)
+				peer.latency = make_unique<LatencyTracker>();
+			SendProbe(peer.address, peer.latency->NextProbe(ProbeClock()));
+		}
 	}
 
-	bool CanSend() const
+
+	void DumpMetrics()
 	{
-		return view_->GetMessageLength() > 0;
+		LogMetrics(ToString(), Metrics());
+
+		lock_guard<mutex> lock(peers_mutex_);
+		for (const auto& peer : peers_)
+		{
+			if (peer.latency)
+				LogLatency(peer.ip + ':' + to_string(peer.port), peer.latency->GetStats());
+		}
 	}
 
-	void Initialise()
+
+	//Reactor timer in reliable mode
+	void OnTick()
 	{
-		channel_.Initialise();
-		view_->Show();
-		view_->SetStatus(channel_.ToString());
+		lock_guard<mutex> lock(peers_mutex_);
+		FlushLinks(ReliableLink::Clock::now());
 	}
 
-	void OnMessageReceived(const string& message) override
+
+	//Sends pending acks, due retransmissions and whatever the send windows have
+	//room for, to all peers in one batch. Caller holds peers_mutex_.
+	void FlushLinks(const ReliableLink::Clock::time_point now)
 	{
-		view_->AppendToChatHistory(message + "\n");
+		outgoing_.clear();
+		size_t depth = 0;
+		for (auto& peer : peers_)
+		{
+			const auto& address = peer.address;
+			if (const string* ack = peer.link->TakeAck())
+				outgoing_.push_back(Datagram{ address, ack->data(), ack->size(), false });
+			peer.link->Poll(now, [this, &address](const string& frame)
+			{
+				outgoing_.push_back(Datagram{ address, frame.data(), frame.size(), false });
+			});
+			const auto stats = peer.link->GetStats().send;
+			depth += stats.queued + stats.in_flight;
+		}
+
+		metrics_.Set(ChannelMetrics::QueueDepth, depth);
+		metrics_.Add(ChannelMetrics::SendErrors, outgoing_.size() - SendSocket().SendBatch(outgoing_.data(), outgoing_.size()));
 	}
 
 
+
 private:
+	string my_ip_;
+	unsigned short my_port_;
+	mutable mutex peers_mutex_;
+	vector<Peer> peers_;
+	unordered_map<uint64_t, size_t> peer_index_;
+	vector<Datagram> outgoing_;
+	vector<IoSpan> parts_;
+	vector<GatherDatagram> gathered_;
+	MessageEncoder encoder_;
+	bool reliable_;
+	ReliableOptions reliable_options_;
+	mutex pacer_mutex_;
+	condition_variable pacer_changed_;
+	uint64_t pacer_generation_;		//bumped by SetSendRateLimit()
+	TokenBucket pacer_;
+	SocketOptions socket_options_;
+	size_t shard_count_;
+	bool pin_shards_;
+	milliseconds reassembly_timeout_;
+	vector<unique_ptr<Shard>> shards_;
+	mutex callback_mutex_;
+	mutex unclaimed_mutex_;
+	deque<string> unclaimed_;	//delivered with no callback handler, for ReceiveMessage()
+	milliseconds metrics_dump_;
+	milliseconds probe_interval_;
+	ChannelMetrics metrics_;
+	atomic<size_t> unknown_sender_count_;
+};
+
+
+
+//Group chat over IP multicast: each message is sent once to the group address,
+//regardless of how many members have joined. Listens on group:port through
+//its own socket and sends from a second, ephemeral one. Messages are framed
+//the same way as on UdpChatChannel, and the sender id in every frame picks
+//out our own looped-back messages so they can be skipped.
+class MulticastChatChannel : public ChatChannel
+{
+public:
+	MulticastChatChannel(const string& group_endpoint, const string& interface_ip = "0.0.0.0", const int ttl = 1)
+		: group_ip_("")
+		, group_port_(0u)
+		, interface_ip_(interface_ip)
+		, ttl_(ttl)
+		, encoder_(RandomSenderId())
+		, send_socket_(nullptr)
+		, recv_socket_(nullptr)
+		, reactor_(nullptr)
+		, worker_(nullptr)
+	{
+		ExtractIpAndPort(group_endpoint, group_ip_, group_port_);
+	}
+
+
+	~MulticastChatChannel()
+	{
+		if (reactor_)
+			reactor_->Stop();
+		if (worker_)
+			worker_->join();
+		CHATTER_INFO("Channel destroyed.");
+	}
+
+
+	string GetGroupIpAddress() const { return group_ip_; }
+	unsigned short GetGroupPort() const { return group_port_; }
+	size_t ReceivedMessageCount() const { return static_cast<size_t>(metrics_.Get(ChannelMetrics::RxMessages)); }
+	uint32_t SenderId() const { return encoder_.SenderId(); }
+	ChannelMetrics::Snapshot Metrics() const { return metrics_.Take(); }
+	FrameReceiver::Stats FrameStats() const { return decoder_.FrameStats(); }
+	Reassembler::Stats ReassemblyStats() const { return decoder_.ReassemblyStats(); }
+
+
+	string ToString() const override
+	{
+		return interface_ip_ + " <---> " + group_ip_ + ':' + to_string(group_port_) + " (multicast)";
+	}
+
+
+	bool Initialise() override
+	{
+		if (IsOpen())
+		{
+			CHATTER_ERROR("Error: Already running!");
+			return false;
+		}
+
+		const char* const iface = interface_ip_ == "0.0.0.0" ? nullptr : interface_ip_.c_str();
+
+		//Windows refuses to bind to a multicast address, elsewhere binding to it
+		//keeps unrelated unicast traffic for the same port out of our socket
+#ifdef WIN32
+		recv_socket_ = make_unique<UdpSocket>(group_port_);
+#else
+		recv_socket_ = make_unique<UdpSocket>(group_port_, group_ip_.c_str());
+#endif
+		if (!recv_socket_->SetReuseAddress(true)
+			|| !recv_socket_->Bind()
+			|| !recv_socket_->JoinMulticastGroup(group_ip_.c_str(), iface))
+			return false;
+
+		send_socket_ = make_unique<UdpSocket>(0, iface);
+		if (!send_socket_->Bind()
+			|| !send_socket_->SetMulticastInterface(iface)
+			|| !send_socket_->SetMulticastLoopback(true)
+			|| !send_socket_->SetMulticastTtl(ttl_))
+			return false;
+
+		group_.sin_family = AF_INET;
+		group_.sin_addr.s_addr = inet_addr(group_ip_.c_str());
+		group_.sin_port = htons(group_port_);
+
+		reactor_ = make_unique<Reactor>();
+		if (!reactor_->Watch(recv_socket_->EventHandle(), [this] { OnReadable(); })
+			|| !reactor_->Every(SweepInterval(decoder_.ReassemblyTimeout()), [this] { decoder_.ExpireFragments(); }))
+			return false;
+
+		worker_ = make_unique<thread>(&Reactor::Run, reactor_.get());
+		CHATTER_INFO("Channel initialised.");
+		return true;
+	}
+
+
+	bool IsOpen() const override
+	{
+		return send_socket_ && recv_socket_ &&
+			send_socket_->IsOpen() && recv_socket_->IsOpen() && worker_;
+	}
+
+
+	void SendMessage(const std::string& message) override
+	{
+		const auto start = steady_clock::now();
+		const size_t frames = GatherFrames(encoder_, message, parts_);
+
+		gathered_.clear();
+		for (size_t i = 0; i < frames; ++i)
+			gathered_.push_back(GatherDatagram{ group_, &parts_[2 * i], 2 });
+
+		metrics_.Add(ChannelMetrics::SendErrors, frames - send_socket_->SendBatch(gathered_.data(), gathered_.size()));
+		metrics_.Add(ChannelMetrics::TxMessages);
+		metrics_.Add(ChannelMetrics::TxBytes, message.size());
+		metrics_.SendLatency().Record(steady_clock::now() - start);
+	}
+
+
+	//The reactor owns the receive socket, so messages delivered while no
+	//callback handler is set are kept for this instead, up to UnclaimedLimit.
+	//Never blocks; returns false when none are waiting.
+	bool ReceiveMessage(std::string& message) override
+	{
+		lock_guard<mutex> lock(unclaimed_mutex_);
+		if (unclaimed_.empty())
+			return false;
+		message.swap(unclaimed_.front());
+		unclaimed_.pop_front();
+		return true;
+	}
+
+
+private:
+	static constexpr const size_t UnclaimedLimit = 4096;
+
+	bool IsOwnMessage(const char* const data, const size_t size) const
+	{
+		FrameHeader header;
+		const char* payload = nullptr;
+		return DecodeFrame(data, size, header, payload) && header.sender_id == encoder_.SenderId();
+	}
+
+
+	void OnReadable()
+	{
+		while (recv_socket_->RecvBatch(batch_))
+		{
+			const auto now = steady_clock::now();
+			for (const auto& datagram : batch_)
+			{
+				if (IsOwnMessage(datagram.data, datagram.size))
+					continue;
+				if (datagram.truncated)
+					metrics_.Add(ChannelMetrics::Truncations);
+
+				FrameHeader header = {};
+				if (!decoder_.Decode(datagram.data, datagram.size, datagram.truncated, datagram.buffer, message_, header))
+				{
+					if (!(header.flags & FrameFlagFragment))
+						metrics_.Add(ChannelMetrics::Drops);
+					continue;
+				}
+
+				if (callbackHandler_)
+				{
+					callbackHandler_->OnBufferReceived(datagram.remote, message_);
+				}
+				else
+				{
+					lock_guard<mutex> lock(unclaimed_mutex_);
+					if (unclaimed_.size() < UnclaimedLimit)
+						unclaimed_.emplace_back(message_.data(), message_.size());
+					else
+						metrics_.Add(ChannelMetrics::Drops);
+				}
+				metrics_.Add(ChannelMetrics::RxBytes, message_.size());
+				metrics_.Add(ChannelMetrics::RxMessages);
+				metrics_.DeliveryLatency().Record(steady_clock::now() - now);
+				message_ = BufferRef();
+			}
+		}
+	}
+
+
+
+private:
+	string group_ip_;
+	unsigned short group_port_;
+	string interface_ip_;
+	int ttl_;
+	sockaddr_in group_ = { 0 };
+	MessageEncoder encoder_;
+	MessageDecoder decoder_;
+	BufferRef message_;
+	vector<IoSpan> parts_;
+	vector<GatherDatagram> gathered_;
+	unique_ptr<UdpSocket> send_socket_;
+	unique_ptr<UdpSocket> recv_socket_;
+	unique_ptr<Reactor> reactor_;
+	unique_ptr<thread> worker_;
+	ChannelMetrics metrics_;
+	DatagramBatch batch_;
+	mutex unclaimed_mutex_;
+	deque<string> unclaimed_;	//delivered with no callback handler, for ReceiveMessage()
+};
+
+
+
+//A ChatChannel to another InProcessChatChannel in the same process, for tests
+//and benchmarks: no sockets or ports, so any number of pairs can run at once.
+//Sent messages cross to the peer through a lock-free queue, then wait there
+//until the arrival time the sender's LinkConditions give them. Initialise()
+//starts a thread that hands them to the callback handler as they arrive.
+//Given a SimulatedClock (the same one for both ends) there is no thread:
+//Poll() delivers whatever has arrived by the clock's time on the calling
+//thread, so what happens depends on nothing but the seed and the clock.
+//SendMessage() may be called from one thread at a time. Connect() pairs two
+//channels before they are used; both must outlive any traffic between them.
+class InProcessChatChannel : public ChatChannel
+{
+public:
+	explicit InProcessChatChannel(const string& name, const LinkConditions& conditions = LinkConditions()
+		, SimulatedClock* const clock = nullptr, const size_t capacity = 4096)
+		: name_(name)
+		, link_(conditions)
+		, clock_(clock)
+		, peer_(nullptr)
+		, inbound_(capacity)
+		, sequence_(0)
+		, open_(false)
+		, running_(false)
+	{}
+
+
+	~InProcessChatChannel()
+	{
+		running_ = false;
+		if (worker_)
+			worker_->join();
+		if (peer_ && peer_->peer_ == this)
+			peer_->peer_ = nullptr;
+	}
+
+
+	static void Connect(InProcessChatChannel& first, InProcessChatChannel& second)
+	{
+		first.peer_ = &second;
+		second.peer_ = &first;
+	}
+
+
+	size_t ReceivedMessageCount() const { return static_cast<size_t>(metrics_.Get(ChannelMetrics::RxMessages)); }
+	ChannelMetrics::Snapshot Metrics() const { return metrics_.Take(); }
+	const LinkConditions& Conditions() const { return link_.Conditions(); }
+
+
+	string ToString() const override
+	{
+		return name_ + " <---> " + (peer_ ? peer_->name_ : string()) + " (in-process)";
+	}
+
+
+	bool Initialise() override
+	{
+		if (IsOpen())
+		{
+			CHATTER_ERROR("Error: Already running!");
+			return false;
+		}
+
+		open_ = true;
+		if (!clock_)
+		{
+			running_ = true;
+			worker_ = make_unique<thread>(&InProcessChatChannel::Run, this);
+		}
+		CHATTER_INFO("Channel initialised.");
+		return true;
+	}
+
+
+	bool IsOpen() const override { return open_; }
+
+
+	//Messages the link loses count as sent; a full peer queue is a send error
+	void SendMessage(const std::string& message) override
+	{
+		const auto start = steady_clock::now();
+		metrics_.Add(ChannelMetrics::TxMessages);
+		metrics_.Add(ChannelMetrics::TxBytes, message.size());
+
+		int64_t arrivals[2];
+		const size_t copies = peer_ ? link_.Transmit(Now(), message.size(), arrivals) : 0;
+		if (!peer_)
+			metrics_.Add(ChannelMetrics::SendErrors);
+		for (size_t i = 0; i < copies; ++i)
+		{
+			if (!peer_->inbound_.TryPush(Envelope{ arrivals[i], sequence_++, message }))
+				metrics_.Add(ChannelMetrics::SendErrors);
+		}
+		metrics_.SendLatency().Record(steady_clock::now() - start);
+	}
+
+
+	//Takes the next message that has arrived, without calling the handler
+	bool ReceiveMessage(std::string& message) override
+	{
+		lock_guard<mutex> lock(pending_mutex_);
+		Collect();
+		if (pending_.empty() || pending_.front().arrival > Now())
+			return false;
+
+		message = Pop().message;
+		metrics_.Add(ChannelMetrics::RxMessages);
+		metrics_.Add(ChannelMetrics::RxBytes, message.size());
+		return true;
+	}
+
+
+	//Delivers every message that has arrived by now. Returns how many.
+	size_t Poll()
+	{
+		lock_guard<mutex> lock(pending_mutex_);
+		return Deliver(Now());
+	}
+
+
+private:
+	struct Envelope
+	{
+		int64_t arrival;	//nanoseconds, on the sender's clock
+		uint64_t sequence;	//keeps sending order among equal arrivals
+		string message;
+	};
+
+	//Orders pending_ as a min-heap on arrival
+	static bool Later(const Envelope& a, const Envelope& b)
+	{
+		return a.arrival != b.arrival ? a.arrival > b.arrival : a.sequence > b.sequence;
+	}
+
+
+	int64_t Now() const { return clock_ ? clock_->Now() : ProbeClock(); }
+
+
+	//Moves everything the peer has queued into pending_
+	void Collect()
+	{
+		inbound_.ConsumeAll([this](Envelope& envelope)
+		{
+			pending_.push_back(move(envelope));
+			push_heap(pending_.begin(), pending_.end(), Later);
+		});
+	}
+
+
+	Envelope Pop()
+	{
+		pop_heap(pending_.begin(), pending_.end(), Later);
+		Envelope envelope(move(pending_.back()));
+		pending_.pop_back();
+		return envelope;
+	}
+
+
+	size_t Deliver(const int64_t now)
+	{
+		Collect();
+		size_t n = 0;
+		for (; !pending_.empty() && pending_.front().arrival <= now; ++n)
+		{
+			const auto start = steady_clock::now();
+			const Envelope envelope = Pop();
+			if (callbackHandler_)
+				callbackHandler_->OnMessageReceived(envelope.message);
+			metrics_.Add(ChannelMetrics::RxMessages);
+			metrics_.Add(ChannelMetrics::RxBytes, envelope.message.size());
+			metrics_.DeliveryLatency().Record(steady_clock::now() - start);
+		}
+		return n;
+	}
+
+
+	//Delivery thread: spins briefly while idle, then naps
+	void Run()
+	{
+		size_t idle = 0;
+		while (running_.load(memory_order_relaxed))
+		{
+			if (Poll())
+				idle = 0;
+			else if (++idle < 64)
+				this_thread::yield();
+			else
+				this_thread::sleep_for(microseconds(50));
+		}
+	}
+
+
+	const string name_;
+	LinkModel link_;
+	SimulatedClock* const clock_;
+	InProcessChatChannel* peer_;
+	SpscQueue<Envelope> inbound_;	//filled by the peer's SendMessage()
+	uint64_t sequence_;
+	mutex pending_mutex_;
+	vector<Envelope> pending_;		//arrived at the queue, waiting for their arrival time
+	atomic<bool> open_;
+	atomic<bool> running_;
+	unique_ptr<thread> worker_;
+	ChannelMetrics metrics_;
+};
+
+
+
+//Wraps another ChatChannel, e.g. a UdpChatChannel, and impairs the messages it
+//sends and delivers the way netem would, without needing root: they are lost,
+//duplicated, delayed and reordered as the outbound and inbound LinkConditions
+//say, the same way every time for the same seeds. Delayed messages are copied
+//into pooled buffers and wait in a TimerWheel, so even hundreds of thousands
+//in flight cost no thread or allocation each. Copies that are not delayed are
+//queued too, so every message is sent to inner and handed to the callback
+//handler from one thread, as single producer queues behind them require.
+//Initialise() starts that thread, which sends and delivers them when due;
+//given a SimulatedClock there is none and Poll() does it on the calling
+//thread. Only the callbacks are impaired, ReceiveMessage() is passed straight
+//through. inner must outlive the wrapper.
+class ImpairedChatChannel : public ChatChannel, private ChannelCallbackHandler
+{
+public:
+	struct Stats
+	{
+		uint64_t sent_lost;
+		uint64_t sent_duplicated;
+		uint64_t received_lost;
+		uint64_t received_duplicated;
+		size_t delayed;				//waiting in the wheel
+		uint64_t misses;			//copies that needed a heap allocation
+	};
+
+	ImpairedChatChannel(ChatChannel& inner, const LinkConditions& outbound, const LinkConditions& inbound = LinkConditions()
+		, SimulatedClock* const clock = nullptr, const size_t capacity = 4096)
+		: inner_(inner)
+		, clock_(clock)
+		, outbound_(outbound)
+		, inbound_(inbound)
+		, buffers_(capacity, BufferSize)
+		, large_buffers_(capacity / 16 + 1, LargeBufferSize)
+		, wheel_(Tick(), capacity, Now())
+		, open_(false)
+		, running_(false)
+	{
+		stats_ = Stats{};
+		inner_.SetCallbackHandler(this);
+	}
+
+
+	~ImpairedChatChannel()
+	{
+		running_ = false;
+		if (worker_)
+			worker_->join();
+		inner_.SetCallbackHandler(nullptr);
+	}
+
+
+	Stats GetStats() const
+	{
+		lock_guard<mutex> lock(mutex_);
+		Stats stats = stats_;
+		stats.delayed = wheel_.Size();
+		stats.misses += buffers_.GetStats().misses + large_buffers_.GetStats().misses;
+		return stats;
+	}
+
+
+	string ToString() const override { return inner_.ToString() + " (impaired)"; }
+
+
+	bool Initialise() override
+	{
+		if (IsOpen())
+		{
+			CHATTER_ERROR("Error: Already running!");
+			return false;
+		}
+		if (!inner_.IsOpen() && !inner_.Initialise())
+			return false;
+
+		open_ = true;
+		if (!clock_)
+		{
+			running_ = true;
+			worker_ = make_unique<thread>(&ImpairedChatChannel::Run, this);
+		}
+		return true;
+	}
+
+
+	bool IsOpen() const override { return open_ && inner_.IsOpen(); }
+
+
+	void SendMessage(const std::string& message) override
+	{
+		Impair(outbound_, message.data(), message.size(), sockaddr_in{}, false, stats_.sent_lost, stats_.sent_duplicated);
+	}
+
+
+	bool ReceiveMessage(std::string& message) override { return inner_.ReceiveMessage(message); }
+
+
+	//Sends and delivers every message that is due. Returns how many.
+	size_t Poll()
+	{
+		lock_guard<mutex> polling(poll_mutex_);
+		{
+			lock_guard<mutex> lock(mutex_);
+			wheel_.Advance(Now(), [this](Delayed& delayed) { due_.push_back(move(delayed)); });
+			for (auto& ready : ready_)
+				due_.push_back(move(ready));
+			ready_.clear();
+		}
+
+		for (auto& delayed : due_)
+		{
+			if (delayed.inbound)
+			{
+				if (callbackHandler_)
+					callbackHandler_->OnBufferReceived(delayed.sender, delayed.message);
+			}
+			else
+			{
+				outgoing_.assign(delayed.message.data(), delayed.message.size());
+				inner_.SendMessage(outgoing_);
+			}
+		}
+
+		const size_t n = due_.size();
+		due_.clear();
+		return n;
+	}
+
+
+private:
+	//Most chat messages fit the small buffers; any a datagram can carry fit the large
+	//ones, of which a sixteenth as many are kept. Larger messages get heap buffers.
+	static constexpr const size_t BufferSize = 256;
+	static constexpr const size_t LargeBufferSize = 65536;
+	static microseconds Tick() { return microseconds(100); }
+
+	struct Delayed
+	{
+		BufferRef message;
+		sockaddr_in sender;
+		bool inbound;
+	};
+
+
+	int64_t Now() const { return clock_ ? clock_->Now() : ProbeClock(); }
+
+
+	void OnMessageReceived(const string& message) override
+	{
+		Impair(inbound_, message.data(), message.size(), sockaddr_in{}, true, stats_.received_lost, stats_.received_duplicated);
+	}
+
+	void OnBufferReceived(const sockaddr_in& sender, const BufferRef& message) override
+	{
+		Impair(inbound_, message.data(), message.size(), sender, true, stats_.received_lost, stats_.received_duplicated);
+	}
+
+
+	//Decides the message's fate and files a copy of each that arrives:
+	//in ready_ when it is due already, otherwise in the wheel
+	void Impair(LinkModel& link, const char* const data, const size_t size, const sockaddr_in& sender, const bool inbound
+		, uint64_t& lost, uint64_t& duplicated)
+	{
+		const int64_t now = Now();
+		int64_t arrivals[2];
+
+		lock_guard<mutex> lock(mutex_);
+		const size_t copies = link.Transmit(now, size, arrivals);
+		lost += copies == 0;
+		duplicated += copies == 2;
+		for (size_t i = 0; i < copies; ++i)
+		{
+			BufferRef buffer = Copy(size);
+			memcpy(buffer.data(), data, size);
+			buffer.resize(size);
+			if (arrivals[i] <= now)
+				ready_.push_back(Delayed{ move(buffer), sender, inbound });
+			else
+				wheel_.Schedule(arrivals[i], Delayed{ move(buffer), sender, inbound });
+		}
+	}
+
+
+	BufferRef Copy(const size_t size)
+	{
+		if (size <= buffers_.BufferSize())
+			return buffers_.Acquire();
+		if (size <= large_buffers_.BufferSize())
+			return large_buffers_.Acquire();
+		stats_.misses++;
+		return BufferRef::Allocate(size);
+	}
+
+
+	void Run()
+	{
+		while (running_.load(memory_order_relaxed))
+		{
+			Poll();
+			this_thread::sleep_for(Tick());
+		}
+	}
+
+
+	ChatChannel& inner_;
+	SimulatedClock* const clock_;
+	LinkModel outbound_;
+	LinkModel inbound_;
+	mutable mutex mutex_;			//the models, the wheel, ready_ and stats_
+	Stats stats_;
+	BufferPool buffers_;			//ahead of the wheel, which must release its buffers first
+	BufferPool large_buffers_;
+	TimerWheel<Delayed> wheel_;
+	vector<Delayed> ready_;			//copies due already, for the next Poll()
+	mutex poll_mutex_;
+	vector<Delayed> due_;
+	string outgoing_;
+	atomic<bool> open_;
+	atomic<bool> running_;
+	unique_ptr<thread> worker_;
+};
+
+
+
+//Received messages are queued by the channel's receive thread and handed to
+//the view in batches when the GUI thread calls ProcessReceivedMessages(), so
+//the network thread never touches the view or waits on rendering.
+//Every sent and received message is also recorded in a bounded ChatHistory
+//that views can render from.
+class ChatterPresenter : public ChannelCallbackHandler
+{
+public:
+	ChatterPresenter(ChatChannel& channel, const size_t receive_queue_capacity = 4096
+		, const size_t history_capacity = 10000)
+		: channel_(channel)
+		, view_(nullptr)
+		, received_(receive_queue_capacity)
+		, dropped_message_count_(0lu)
+		, history_(history_capacity)
+	{
+		channel_.SetCallbackHandler(this);
+	}
+
+	void SetView(ChatterView* view)
+	{
+		view_ = view;
+	}
+
+	void OnSendCommand()
+	{
+		string msg = view_->GetMessage();
+		msg += '\n';
+		history_.Add(system_clock::now(), "me", msg);
+		view_->ChatHistoryChanged();
+		channel_.SendMessage(msg);
+		view_->SetMessage("");
+	}
+
+	bool CanSend() const
+	{
+		return view_->GetMessageLength() > 0;
+	}
+
+	void Initialise()
+	{
+		channel_.Initialise();
+		view_->Show();
+		view_->SetStatus(channel_.ToString());
+	}
+
+	//Receive thread
+	void OnMessageReceived(const string& message) override
+	{
+		Enqueue(PendingMessage{ sockaddr_in{}, system_clock::now(), BufferRef(), message });
+	}
+
+	//Receive thread
+	void OnBufferReceived(const sockaddr_in& sender, const BufferRef& message) override
+	{
+		Enqueue(PendingMessage{ sender, system_clock::now(), message, string() });
+	}
+
+	//GUI thread. Adds everything received since the last call to the chat
+	//history, tells the view once and returns the number of messages added.
+	size_t ProcessReceivedMessages()
+	{
+		const size_t count = received_.ConsumeAll([this](PendingMessage& message)
+		{
+			const auto sender = message.sender.sin_family == AF_INET ? EndpointToString(message.sender) : string();
+			if (message.buffer)
+				history_.Add(message.received_at, sender, message.buffer.data(), message.buffer.size());
+			else
+				history_.Add(message.received_at, sender, message.text);
+		});
+
+		if (count)
+			view_->ChatHistoryChanged();
+		return count;
+	}
+
+	size_t DroppedMessageCount() const { return dropped_message_count_; }
+	const ChatHistory& History() const { return history_; }
+
+
+private:
+	//Exactly one of buffer/text is set, depending on how the channel delivered it
+	struct PendingMessage
+	{
+		sockaddr_in sender;
+		system_clock::time_point received_at;
+		BufferRef buffer;
+		string text;
+	};
+
+	void Enqueue(PendingMessage&& message)
+	{
+		if (!received_.TryPush(std::move(message)))
+			dropped_message_count_++;
+	}
+
+
 	ChatChannel& channel_;
 	ChatterView* view_;
+	SpscQueue<PendingMessage> received_;
+	std::atomic<size_t> dropped_message_count_;
+	ChatHistory history_;
 };
 
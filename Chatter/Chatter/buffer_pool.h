@@ -0,0 +1,251 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+class BufferPool;
+
+
+//Reference counted handle to a fixed-capacity buffer handed out by a BufferPool.
+//Copies share the same bytes; the buffer goes back to its pool when the last
+//handle is released, which may happen on any thread.
+//A handle may also view just a slice of its buffer, see Slice().
+class BufferRef
+{
+public:
+	BufferRef() : block_(nullptr), offset_(0), length_(0) {}
+	BufferRef(const BufferRef& other) : block_(other.block_), offset_(other.offset_), length_(other.length_) { AddRef(); }
+	BufferRef(BufferRef&& other) : block_(other.block_), offset_(other.offset_), length_(other.length_) { other.block_ = nullptr; }
+	~BufferRef() { Release(); }
+
+	BufferRef& operator= (const BufferRef& other)
+	{
+		if (block_ != other.block_)
+		{
+			Release();
+			block_ = other.block_;
+			AddRef();
+		}
+		offset_ = other.offset_;
+		length_ = other.length_;
+		return *this;
+	}
+
+	BufferRef& operator= (BufferRef&& other)
+	{
+		if (this != &other)
+		{
+			Release();
+			block_ = other.block_;
+			offset_ = other.offset_;
+			length_ = other.length_;
+			other.block_ = nullptr;
+		}
+		return *this;
+	}
+
+	explicit operator bool() const { return block_ != nullptr; }
+	char* data() { return block_->data + offset_; }
+	const char* data() const { return block_->data + offset_; }
+	size_t size() const { return block_ ? length_ : 0; }
+	size_t capacity() const { return block_ ? block_->capacity - offset_ : 0; }
+	bool empty() const { return size() == 0; }
+	void resize(const size_t n) { length_ = n < capacity() ? n : capacity(); }
+	std::string ToString() const { return block_ ? std::string(data(), size()) : std::string(); }
+
+	//A one-off heap buffer outside any pool, for payloads bigger than pool buffers
+	static BufferRef Allocate(const size_t capacity)
+	{
+		auto block = new Block;
+		block->pool = nullptr;
+		block->refs.store(1, std::memory_order_relaxed);
+		block->data = new char[capacity];
+		block->capacity = capacity;
+		block->pooled = false;
+		return BufferRef(block);
+	}
+
+	//Another handle on the same buffer viewing length bytes from offset
+	BufferRef Slice(const size_t offset, const size_t length) const
+	{
+		const size_t start = offset < length_ ? offset : length_;
+		BufferRef slice(*this);
+		slice.offset_ = offset_ + start;
+		slice.length_ = length < length_ - start ? length : length_ - start;
+		return slice;
+	}
+
+private:
+	friend class BufferPool;
+
+	struct Block
+	{
+		BufferPool* pool;
+		std::atomic<unsigned> refs;
+		char* data;
+		size_t capacity;
+		bool pooled;
+	};
+
+	explicit BufferRef(Block* block) : block_(block), offset_(0), length_(0) {}
+
+	void AddRef()
+	{
+		if (block_)
+			block_->refs.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	inline void Release();
+
+	Block* block_;
+	size_t offset_;
+	size_t length_;
+};
+
+
+
+//Fixed-size slab of equally sized buffers. The slab is allocated on first use,
+//after which Acquire() is allocation free until the pool runs dry; then it falls
+//back to the heap and records a miss. All buffers must be released before the
+//pool is destroyed.
+class BufferPool
+{
+public:
+	struct Stats
+	{
+		size_t hits;
+		size_t misses;
+		size_t in_use;
+		size_t high_water;
+	};
+
+
+	BufferPool(const size_t count, const size_t buffer_size)
+		: count_(count)
+		, buffer_size_(buffer_size)
+		, hits_(0)
+		, misses_(0)
+		, in_use_(0)
+		, high_water_(0)
+	{}
+
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator= (const BufferPool&) = delete;
+
+
+	size_t BufferSize() const { return buffer_size_; }
+	size_t Count() const { return count_; }
+
+
+	BufferRef Acquire()
+	{
+		BufferRef::Block* block = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (!slab_)
+				AllocateSlab();
+			if (!free_.empty())
+			{
+				block = free_.back();
+				free_.pop_back();
+			}
+		}
+
+		if (block)
+		{
+			hits_.fetch_add(1, std::memory_order_relaxed);
+		}
+		else
+		{
+			misses_.fetch_add(1, std::memory_order_relaxed);
+			block = new BufferRef::Block;
+			block->pool = this;
+			block->data = new char[buffer_size_];
+			block->capacity = buffer_size_;
+			block->pooled = false;
+		}
+
+		block->refs.store(1, std::memory_order_relaxed);
+
+		const size_t in_use = in_use_.fetch_add(1, std::memory_order_relaxed) + 1;
+		size_t high_water = high_water_.load(std::memory_order_relaxed);
+		while (in_use > high_water && !high_water_.compare_exchange_weak(high_water, in_use, std::memory_order_relaxed))
+			;
+
+		return BufferRef(block);
+	}
+
+
+	Stats GetStats() const
+	{
+		return Stats{ hits_.load(), misses_.load(), in_use_.load(), high_water_.load() };
+	}
+
+
+private:
+	friend class BufferRef;
+
+	void AllocateSlab()
+	{
+		slab_.reset(new char[count_ * buffer_size_]);
+		blocks_.reset(new BufferRef::Block[count_]);
+		free_.reserve(count_);
+		for (size_t i = count_; i-- > 0;)
+		{
+			auto& block = blocks_[i];
+			block.pool = this;
+			block.data = &slab_[i * buffer_size_];
+			block.capacity = buffer_size_;
+			block.pooled = true;
+			free_.push_back(&block);
+		}
+	}
+
+	void Release(BufferRef::Block* block)
+	{
+		in_use_.fetch_sub(1, std::memory_order_relaxed);
+		if (!block->pooled)
+		{
+			delete[] block->data;
+			delete block;
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		free_.push_back(block);
+	}
+
+
+	const size_t count_;
+	const size_t buffer_size_;
+	std::mutex mutex_;
+	std::unique_ptr<char[]> slab_;
+	std::unique_ptr<BufferRef::Block[]> blocks_;
+	std::vector<BufferRef::Block*> free_;
+	std::atomic<size_t> hits_;
+	std::atomic<size_t> misses_;
+	std::atomic<size_t> in_use_;
+	std::atomic<size_t> high_water_;
+};
+
+
+
+inline void BufferRef::Release()
+{
+	if (block_ && block_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+	{
+		if (block_->pool)
+		{
+			block_->pool->Release(block_);
+		}
+		else
+		{
+			delete[] block_->data;
+			delete block_;
+		}
+	}
+	block_ = nullptr;
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include "frame.h"
+#include "fragmentation.h"
+#include "buffer_pool.h"
+#include <string>
+#include <vector>
+
+
+//Everything a channel does to a message on its way out: framing plus, when it
+//does not fit in one datagram, fragmentation.
+class MessageEncoder
+{
+public:
+	explicit MessageEncoder(const uint32_t sender_id, const size_t max_datagram = DefaultMaxDatagram, const uint8_t flags = 0)
+		: frame_sender_(sender_id)
+		, fragmenter_(max_datagram)
+		, flags_(flags)
+		, count_(0)
+	{}
+
+	uint32_t SenderId() const { return frame_sender_.SenderId(); }
+
+	//Encodes into Frames(); returns the number of datagrams to send
+	size_t Encode(const char* payload, const size_t length)
+	{
+		count_ = fragmenter_.Encode(frame_sender_, payload, length, frames_, flags_);
+		return count_;
+	}
+
+	//As Encode(), but leaves the payload where it is: datagram i is Gathered(i).header
+	//followed by Gathered(i).body, which points into payload
+	size_t EncodeGather(const char* payload, const size_t length)
+	{
+		count_ = fragmenter_.Encode(frame_sender_, payload, length, gathered_, flags_);
+		return count_;
+	}
+
+	size_t Count() const { return count_; }
+	const std::string& Frame(const size_t i) const { return frames_[i]; }
+	const GatherFrame& Gathered(const size_t i) const { return gathered_[i]; }
+
+private:
+	FrameSender frame_sender_;
+	Fragmenter fragmenter_;
+	const uint8_t flags_;
+	std::vector<std::string> frames_;
+	std::vector<GatherFrame> gathered_;
+	size_t count_;
+};
+
+
+
+//And on its way in: frame validation, loss accounting and reassembly.
+//Single-threaded, owned by the receive thread; the stats may be read from anywhere.
+class MessageDecoder
+{
+public:
+	MessageDecoder(const std::chrono::milliseconds reassembly_timeout = std::chrono::seconds(5)
+		, const size_t reassembly_max_bytes = 8u << 20)
+		: reassembler_(reassembly_timeout, reassembly_max_bytes)
+	{}
+
+	//buffer holds the datagram (data/size point into it). Returns true and sets
+	//message when the datagram completes a message; single-datagram messages
+	//are sliced out of buffer without copying.
+	bool Decode(const char* data, const size_t size, const bool truncated, const BufferRef& buffer, BufferRef& message, FrameHeader& header)
+	{
+		const char* payload = nullptr;
+		if (!frame_receiver_.Accept(data, size, truncated, header, payload))
+			return false;
+
+		if (header.flags & FrameFlagFragment)
+			return reassembler_.Add(header.sender_id, payload, header.payload_length, message);
+
+		message = buffer.Slice(FrameHeaderSize, header.payload_length);
+		return true;
+	}
+
+	//Drops messages that have waited too long for their missing fragments
+	void ExpireFragments() { reassembler_.Expire(); }
+	std::chrono::milliseconds ReassemblyTimeout() const { return reassembler_.Timeout(); }
+
+	FrameReceiver::Stats FrameStats() const { return frame_receiver_.GetStats(); }
+	Reassembler::Stats ReassemblyStats() const { return reassembler_.GetStats(); }
+
+private:
+	FrameReceiver frame_receiver_;
+	Reassembler reassembler_;
+};
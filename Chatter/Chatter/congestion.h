@@ -0,0 +1,158 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <algorithm>
+
+
+//Byte rate limiter. Tokens accrue at rate bytes per second up to burst; a send is
+//admitted whenever the bucket is not in debt and may overdraw it, so messages
+//bigger than the burst still go out and the long run rate holds.
+//A rate of 0 admits everything.
+class TokenBucket
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	TokenBucket(const double rate = 0, const double burst = 0)
+		: rate_(rate)
+		, burst_(burst)
+		, tokens_(burst)
+		, last_(Clock::now())
+	{}
+
+	double Rate() const { return rate_; }
+	double Burst() const { return burst_; }
+
+	void SetRate(const double rate, const double burst)
+	{
+		rate_ = rate;
+		burst_ = burst;
+		if (tokens_ > burst_)
+			tokens_ = burst_;
+	}
+
+	bool TryConsume(const size_t bytes, const Clock::time_point now = Clock::now())
+	{
+		if (rate_ <= 0)
+			return true;
+
+		Refill(now);
+		if (tokens_ < 0)
+			return false;
+
+		tokens_ -= static_cast<double>(bytes);
+		return true;
+	}
+
+	//How long until TryConsume() will succeed again
+	Clock::duration Delay(const Clock::time_point now = Clock::now())
+	{
+		if (rate_ <= 0)
+			return Clock::duration::zero();
+
+		Refill(now);
+		if (tokens_ >= 0)
+			return Clock::duration::zero();
+		return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(-tokens_ / rate_));
+	}
+
+private:
+	void Refill(const Clock::time_point now)
+	{
+		if (now <= last_)
+			return;
+		tokens_ = std::min(burst_, tokens_ + rate_ * std::chrono::duration<double>(now - last_).count());
+		last_ = now;
+	}
+
+	double rate_;
+	double burst_;
+	double tokens_;
+	Clock::time_point last_;
+};
+
+
+
+//Congestion window in frames, TCP Reno style: slow start doubles it every round
+//trip up to the threshold, then it grows by one frame per window acknowledged.
+//A loss halves it, at most once per round trip; a retransmission timeout
+//drops it to the minimum.
+class AimdWindow
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	struct Stats
+	{
+		size_t cwnd;
+		size_t ssthresh;
+		size_t decreases;
+		size_t collapses;	//retransmission timeouts
+	};
+
+	AimdWindow(const size_t initial = 4, const size_t min = 1, const size_t max = 64)
+		: min_(min < 1 ? 1 : min)
+		, max_(max < min_ ? min_ : max)
+		, cwnd_(std::max(min_, std::min(initial, max_)))
+		, ssthresh_(max_)
+		, credit_(0)
+		, recovery_until_()
+		, decreases_(0)
+		, collapses_(0)
+	{}
+
+	size_t Window() const { return cwnd_; }
+
+	void OnAcked(size_t frames)
+	{
+		while (frames && cwnd_ < max_)
+		{
+			frames--;
+			if (cwnd_ < ssthresh_)
+			{
+				cwnd_++;
+			}
+			else if (++credit_ >= cwnd_)
+			{
+				credit_ = 0;
+				cwnd_++;
+			}
+		}
+	}
+
+	//rtt bounds how soon another loss may shrink the window again
+	void OnLoss(const Clock::time_point now, const Clock::duration rtt)
+	{
+		if (now < recovery_until_)
+			return;
+
+		recovery_until_ = now + rtt;
+		ssthresh_ = std::max(min_, cwnd_ / 2);
+		cwnd_ = ssthresh_;
+		credit_ = 0;
+		decreases_++;
+	}
+
+	void OnTimeout()
+	{
+		ssthresh_ = std::max(min_, cwnd_ / 2);
+		cwnd_ = min_;
+		credit_ = 0;
+		collapses_++;
+	}
+
+	Stats GetStats() const
+	{
+		return Stats{ cwnd_, ssthresh_, decreases_, collapses_ };
+	}
+
+private:
+	const size_t min_;
+	const size_t max_;
+	size_t cwnd_;
+	size_t ssthresh_;
+	size_t credit_;
+	Clock::time_point recovery_until_;
+	size_t decreases_;
+	size_t collapses_;
+};
@@ -0,0 +1,295 @@
+#pragma once
+#include "frame.h"
+#include "buffer_pool.h"
+#include <chrono>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+
+//Messages that do not fit in one datagram are split into fragments, each sent
+//as its own frame with FrameFlagFragment set and this 12 byte header (big-endian)
+//in front of the chunk:
+//
+//  0             4             8      10     12
+//  +-------------+-------------+------+------+
+//  |message id   |total length |index |count |
+//  +-------------+-------------+------+------+
+//
+//All fragments but the last carry ceil(total length / count) bytes, so the
+//receiver can place any fragment without having seen the others.
+constexpr const size_t FragmentHeaderSize = 12;
+
+//Keeps datagrams under a typical 1500 byte path MTU once IP and UDP headers are added
+constexpr const size_t DefaultMaxDatagram = 1400;
+
+
+//A frame whose payload stays in the caller's buffer: on the wire it is header
+//(frame header plus any fragment header) followed by body.
+struct GatherFrame
+{
+	char header[FrameHeaderSize + FragmentHeaderSize];
+	size_t header_size;
+	const char* body;
+	size_t body_size;
+};
+
+
+struct FragmentHeader
+{
+	uint32_t message_id;
+	uint32_t total_length;
+	uint16_t index;
+	uint16_t count;
+};
+
+
+inline void EncodeFragmentHeader(const FragmentHeader& header, char* out)
+{
+	using namespace frame_detail;
+	Put32(out, header.message_id);
+	Put32(out + 4, header.total_length);
+	Put16(out + 8, header.index);
+	Put16(out + 10, header.count);
+}
+
+
+inline bool DecodeFragmentHeader(const char* data, const size_t size, FragmentHeader& header)
+{
+	using namespace frame_detail;
+	if (size < FragmentHeaderSize)
+		return false;
+
+	header.message_id = Get32(data);
+	header.total_length = Get32(data + 4);
+	header.index = Get16(data + 8);
+	header.count = Get16(data + 10);
+	return header.count > 0 && header.index < header.count;
+}
+
+
+inline size_t FragmentChunkSize(const size_t total_length, const size_t count)
+{
+	return (total_length + count - 1) / count;
+}
+
+
+
+//Send side: turns one message into as many frames as it needs
+class Fragmenter
+{
+public:
+	explicit Fragmenter(const size_t max_datagram = DefaultMaxDatagram)
+		: max_datagram_(max_datagram)
+		, next_message_id_(0)
+	{}
+
+	size_t MaxDatagram() const { return max_datagram_; }
+
+	//Fills the first N entries of frames (grown as needed, storage reused) and returns N.
+	//flags are added to those of every frame.
+	size_t Encode(FrameSender& sender, const char* payload, const size_t length, std::vector<std::string>& frames, const uint8_t flags = 0)
+	{
+		return Split(payload, length, frames, [&](std::string& frame, const char* prefix, const size_t prefix_length, const char* chunk, const size_t n, const uint8_t fragment)
+		{
+			sender.Encode(prefix, prefix_length, chunk, n, frame, static_cast<uint8_t>(flags | fragment));
+		});
+	}
+
+	//As above without copying the payload: each frame's body points into payload
+	size_t Encode(FrameSender& sender, const char* payload, const size_t length, std::vector<GatherFrame>& frames, const uint8_t flags = 0)
+	{
+		return Split(payload, length, frames, [&](GatherFrame& frame, const char* prefix, const size_t prefix_length, const char* chunk, const size_t n, const uint8_t fragment)
+		{
+			sender.EncodeHeader(prefix_length + n, frame.header, static_cast<uint8_t>(flags | fragment));
+			std::copy(prefix, prefix + prefix_length, frame.header + FrameHeaderSize);
+			frame.header_size = FrameHeaderSize + prefix_length;
+			frame.body = chunk;
+			frame.body_size = n;
+		});
+	}
+
+private:
+	//Calls emit(frame, prefix, prefix length, chunk, chunk length, fragment flag) for each frame
+	template<class Frame, class Emit>
+	size_t Split(const char* payload, const size_t length, std::vector<Frame>& frames, Emit emit)
+	{
+		const size_t unfragmented = max_datagram_ - FrameHeaderSize;
+		if (length <= unfragmented)
+		{
+			if (frames.empty())
+				frames.resize(1);
+			emit(frames[0], nullptr, 0, payload, length, 0);
+			return 1;
+		}
+
+		const size_t max_chunk = unfragmented - FragmentHeaderSize;
+		size_t count = (length + max_chunk - 1) / max_chunk;
+		if (count > 0xFFFF)
+			count = 0xFFFF;
+		const size_t chunk = FragmentChunkSize(length, count);
+		if (frames.size() < count)
+			frames.resize(count);
+
+		FragmentHeader header = { next_message_id_++, static_cast<uint32_t>(length), 0, static_cast<uint16_t>(count) };
+		char prefix[FragmentHeaderSize];
+		for (size_t i = 0; i < count; ++i)
+		{
+			header.index = static_cast<uint16_t>(i);
+			EncodeFragmentHeader(header, prefix);
+			const size_t offset = i * chunk;
+			const size_t n = length - offset < chunk ? length - offset : chunk;
+			emit(frames[i], prefix, FragmentHeaderSize, payload + offset, n, FrameFlagFragment);
+		}
+		return count;
+	}
+
+	const size_t max_datagram_;
+	uint32_t next_message_id_;
+};
+
+
+
+//Receive side: collects fragments per (sender id, message id) until a message is
+//complete. Each message is assembled straight into the buffer it is delivered in.
+//Incomplete messages are dropped after a timeout by Expire(), which the owner
+//should call every timeout / 4 or so; Add() sweeps too, in case it does not.
+//New messages are refused while the bytes held for incomplete messages would
+//exceed max_bytes.
+class Reassembler
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	struct Stats
+	{
+		size_t completed;
+		size_t expired;
+		size_t rejected;	//over the memory cap or inconsistent with earlier fragments
+		size_t in_progress;
+		size_t bytes_held;
+	};
+
+	Reassembler(const std::chrono::milliseconds timeout = std::chrono::seconds(5), const size_t max_bytes = 8u << 20)
+		: timeout_(timeout)
+		, max_bytes_(max_bytes)
+		, bytes_held_(0)
+		, last_sweep_()
+		, completed_(0)
+		, expired_(0)
+		, rejected_(0)
+		, in_progress_(0)
+	{}
+
+	//Feeds the payload of a FrameFlagFragment frame. Returns true and sets message
+	//when this fragment completed its message.
+	bool Add(const uint32_t sender_id, const char* payload, const size_t length, BufferRef& message, const Clock::time_point now = Clock::now())
+	{
+		if (now - last_sweep_ >= timeout_ / 4)
+			Expire(now);
+
+		FragmentHeader header;
+		if (!DecodeFragmentHeader(payload, length, header))
+		{
+			rejected_++;
+			return false;
+		}
+
+		const size_t chunk = FragmentChunkSize(header.total_length, header.count);
+		const size_t offset = header.index * chunk;
+		const size_t expected = offset >= header.total_length ? 0 : (header.total_length - offset < chunk ? header.total_length - offset : chunk);
+		if (expected == 0 || length - FragmentHeaderSize != expected)
+		{
+			rejected_++;
+			return false;
+		}
+
+		const uint64_t key = (static_cast<uint64_t>(sender_id) << 32) | header.message_id;
+		auto it = pending_.find(key);
+		if (it == pending_.end())
+		{
+			if (bytes_held_ + header.total_length > max_bytes_)
+			{
+				rejected_++;
+				return false;
+			}
+
+			Pending entry;
+			entry.buffer = BufferRef::Allocate(header.total_length);
+			entry.buffer.resize(header.total_length);
+			entry.received.assign(header.count, false);
+			entry.remaining = header.count;
+			entry.started = now;
+			it = pending_.emplace(key, std::move(entry)).first;
+			bytes_held_ += header.total_length;
+			in_progress_ = pending_.size();
+		}
+
+		auto& entry = it->second;
+		if (entry.received.size() != header.count || entry.buffer.size() != header.total_length)
+		{
+			rejected_++;
+			return false;
+		}
+		if (entry.received[header.index])
+			return false;
+
+		std::copy(payload + FragmentHeaderSize, payload + length, entry.buffer.data() + offset);
+		entry.received[header.index] = true;
+		if (--entry.remaining)
+			return false;
+
+		message = std::move(entry.buffer);
+		bytes_held_ -= header.total_length;
+		pending_.erase(it);
+		in_progress_ = pending_.size();
+		completed_++;
+		return true;
+	}
+
+	//Drops incomplete messages older than the timeout
+	void Expire(const Clock::time_point now = Clock::now())
+	{
+		last_sweep_ = now;
+		for (auto it = pending_.begin(); it != pending_.end();)
+		{
+			if (now - it->second.started >= timeout_)
+			{
+				bytes_held_ -= it->second.buffer.size();
+				it = pending_.erase(it);
+				expired_++;
+			}
+			else
+			{
+				++it;
+			}
+		}
+		in_progress_ = pending_.size();
+	}
+
+	std::chrono::milliseconds Timeout() const { return timeout_; }
+
+	Stats GetStats() const
+	{
+		return Stats{ completed_.load(), expired_.load(), rejected_.load(), in_progress_.load(), bytes_held_.load() };
+	}
+
+private:
+	struct Pending
+	{
+		BufferRef buffer;
+		std::vector<bool> received;
+		size_t remaining;
+		Clock::time_point started;
+	};
+
+	const std::chrono::milliseconds timeout_;
+	const size_t max_bytes_;
+	std::unordered_map<uint64_t, Pending> pending_;
+	std::atomic<size_t> bytes_held_;
+	Clock::time_point last_sweep_;
+	std::atomic<size_t> completed_;
+	std::atomic<size_t> expired_;
+	std::atomic<size_t> rejected_;
+	std::atomic<size_t> in_progress_;
+};
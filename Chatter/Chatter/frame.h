@@ -0,0 +1,265 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <unordered_map>
+#include <algorithm>
+
+
+//Every datagram starts with a fixed 16 byte header, all fields big-endian:
+//
+//  0      2      3      4             8             12     14     16
+//  +------+------+------+-------------+-------------+------+-------+
+//  |magic |ver   |flags |sender id    |sequence     |length|unacked|
+//  +------+------+------+-------------+-------------+------+-------+
+//
+//length is the payload length, so truncated datagrams can be recognised.
+//unacked is only used by reliable frames, see reliability.h.
+//Decoding never copies: the payload is returned as a pointer into the datagram.
+constexpr const uint16_t FrameMagic = 0xC4A7;
+constexpr const uint8_t FrameVersion = 1;
+constexpr const size_t FrameHeaderSize = 16;
+constexpr const size_t MaxFramePayload = 65507 - FrameHeaderSize;
+
+//flags
+constexpr const uint8_t FrameFlagFragment = 0x01;	//payload starts with a fragment header, see fragmentation.h
+constexpr const uint8_t FrameFlagReliable = 0x02;	//must be acknowledged, delivered in order, see reliability.h
+constexpr const uint8_t FrameFlagAck = 0x04;		//selective acknowledgement of reliable frames
+constexpr const uint8_t FrameFlagProbe = 0x08;		//latency probe or its echo, see latency.h
+
+
+struct FrameHeader
+{
+	uint8_t version;
+	uint8_t flags;
+	uint32_t sender_id;
+	uint32_t sequence;
+	uint16_t payload_length;
+	uint16_t unacked;	//reliable frames: how far sequence is ahead of the sender's oldest unacknowledged frame
+};
+
+
+namespace frame_detail
+{
+	inline void Put16(char* p, const uint16_t v)
+	{
+		p[0] = static_cast<char>(v >> 8);
+		p[1] = static_cast<char>(v);
+	}
+
+	inline void Put32(char* p, const uint32_t v)
+	{
+		Put16(p, static_cast<uint16_t>(v >> 16));
+		Put16(p + 2, static_cast<uint16_t>(v));
+	}
+
+	inline uint16_t Get16(const char* p)
+	{
+		const auto* u = reinterpret_cast<const unsigned char*>(p);
+		return static_cast<uint16_t>((u[0] << 8) | u[1]);
+	}
+
+	inline uint32_t Get32(const char* p)
+	{
+		return (static_cast<uint32_t>(Get16(p)) << 16) | Get16(p + 2);
+	}
+}
+
+
+//Writes FrameHeaderSize bytes to out
+inline void EncodeFrameHeader(const FrameHeader& header, char* out)
+{
+	using namespace frame_detail;
+	Put16(out, FrameMagic);
+	out[2] = static_cast<char>(header.version);
+	out[3] = static_cast<char>(header.flags);
+	Put32(out + 4, header.sender_id);
+	Put32(out + 8, header.sequence);
+	Put16(out + 12, header.payload_length);
+	Put16(out + 14, header.unacked);
+}
+
+
+//Validates and parses a datagram. On success payload points into data.
+inline bool DecodeFrame(const char* data, const size_t size, FrameHeader& header, const char*& payload)
+{
+	using namespace frame_detail;
+	if (size < FrameHeaderSize || Get16(data) != FrameMagic)
+		return false;
+
+	header.version = static_cast<uint8_t>(data[2]);
+	header.flags = static_cast<uint8_t>(data[3]);
+	header.sender_id = Get32(data + 4);
+	header.sequence = Get32(data + 8);
+	header.payload_length = Get16(data + 12);
+	header.unacked = Get16(data + 14);
+
+	if (header.version != FrameVersion || header.payload_length > size - FrameHeaderSize)
+		return false;
+
+	payload = data + FrameHeaderSize;
+	return true;
+}
+
+
+
+//Classifies sequence numbers from one sender against a 64-frame sliding window
+class SequenceTracker
+{
+public:
+	enum class Result { InOrder, AfterGap, Reordered, Duplicate };
+
+	SequenceTracker() : started_(false), highest_(0), window_(0) {}
+
+	//missing is set to the number of frames skipped when the result is AfterGap
+	Result Track(const uint32_t sequence, uint32_t& missing)
+	{
+		missing = 0;
+		if (!started_)
+		{
+			started_ = true;
+			highest_ = sequence;
+			window_ = 1;
+			return Result::InOrder;
+		}
+
+		const int32_t ahead = static_cast<int32_t>(sequence - highest_);
+		if (ahead > 0)
+		{
+			window_ = ahead >= 64 ? 0 : window_ << ahead;
+			window_ |= 1;
+			highest_ = sequence;
+			missing = static_cast<uint32_t>(ahead - 1);
+			return missing ? Result::AfterGap : Result::InOrder;
+		}
+
+		const uint32_t behind = static_cast<uint32_t>(-ahead);
+		if (behind >= 64 || (window_ & (uint64_t(1) << behind)))
+			return Result::Duplicate;
+
+		window_ |= uint64_t(1) << behind;
+		return Result::Reordered;
+	}
+
+private:
+	bool started_;
+	uint32_t highest_;
+	uint64_t window_;
+};
+
+
+
+//Receive side bookkeeping: decodes frames and keeps loss/duplicate counters
+//per sender id. Track() runs on the receive thread; GetStats() from anywhere.
+class FrameReceiver
+{
+public:
+	struct Stats
+	{
+		size_t frames;
+		size_t malformed;
+		size_t truncated;
+		size_t duplicates;
+		size_t reordered;
+		size_t lost;	//frames skipped over; reordered arrivals are subtracted again
+	};
+
+	FrameReceiver()
+		: frames_(0), malformed_(0), truncated_(0), duplicates_(0), reordered_(0), lost_(0)
+	{}
+
+	//Returns false for datagrams that should not be delivered
+	bool Accept(const char* data, const size_t size, const bool truncated, FrameHeader& header, const char*& payload)
+	{
+		if (truncated)
+		{
+			truncated_++;
+			return false;
+		}
+		if (!DecodeFrame(data, size, header, payload))
+		{
+			malformed_++;
+			return false;
+		}
+
+		uint32_t missing = 0;
+		switch (senders_[header.sender_id].Track(header.sequence, missing))
+		{
+		case SequenceTracker::Result::Duplicate:
+			duplicates_++;
+			return false;
+		case SequenceTracker::Result::Reordered:
+			reordered_++;
+			if (lost_.load(std::memory_order_relaxed))
+				lost_--;
+			break;
+		case SequenceTracker::Result::AfterGap:
+			lost_ += missing;
+			break;
+		case SequenceTracker::Result::InOrder:
+			break;
+		}
+
+		frames_++;
+		return true;
+	}
+
+	Stats GetStats() const
+	{
+		return Stats{ frames_.load(), malformed_.load(), truncated_.load(), duplicates_.load(), reordered_.load(), lost_.load() };
+	}
+
+private:
+	std::unordered_map<uint32_t, SequenceTracker> senders_;
+	std::atomic<size_t> frames_;
+	std::atomic<size_t> malformed_;
+	std::atomic<size_t> truncated_;
+	std::atomic<size_t> duplicates_;
+	std::atomic<size_t> reordered_;
+	std::atomic<size_t> lost_;
+};
+
+
+
+//Send side: stamps outgoing payloads with our sender id and the next sequence number
+class FrameSender
+{
+public:
+	explicit FrameSender(const uint32_t sender_id) : sender_id_(sender_id), next_sequence_(0) {}
+
+	uint32_t SenderId() const { return sender_id_; }
+
+	//Lays out header + payload in frame, reusing its storage
+	template<class Container>
+	void Encode(const char* payload, const size_t length, Container& frame, const uint8_t flags = 0)
+	{
+		Encode(nullptr, 0, payload, length, frame, flags);
+	}
+
+	//As above, with prefix placed between the frame header and the payload
+	template<class Container>
+	void Encode(const char* prefix, const size_t prefix_length, const char* payload, size_t length, Container& frame, const uint8_t flags)
+	{
+		if (prefix_length + length > MaxFramePayload)
+			length = MaxFramePayload - prefix_length;
+
+		const size_t total = prefix_length + length;
+		frame.resize(FrameHeaderSize + total);
+		EncodeHeader(total, &frame[0], flags);
+		if (prefix_length)
+			std::copy(prefix, prefix + prefix_length, &frame[FrameHeaderSize]);
+		if (length)
+			std::copy(payload, payload + length, &frame[FrameHeaderSize + prefix_length]);
+	}
+
+	//Just the FrameHeaderSize byte header of the next frame, for callers that send
+	//its length bytes of payload from where they already are
+	void EncodeHeader(const size_t length, char* out, const uint8_t flags = 0)
+	{
+		EncodeFrameHeader(FrameHeader{ FrameVersion, flags, sender_id_, next_sequence_++, static_cast<uint16_t>(length), 0 }, out);
+	}
+
+private:
+	const uint32_t sender_id_;
+	uint32_t next_sequence_;
+};
@@ -0,0 +1,148 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+#include <algorithm>
+
+
+//How jitter is spread around the latency
+enum class DelayDistribution
+{
+	Uniform,	//0 to jitter
+	Normal,		//jitter is the standard deviation, never below zero delay
+	Pareto		//heavy tailed, jitter is the mean
+};
+
+
+//Conditions to simulate on one direction of a link
+struct LinkConditions
+{
+	LinkConditions()
+		: latency(0)
+		, jitter(0)
+		, distribution(DelayDistribution::Uniform)
+		, loss(0)
+		, duplicate(0)
+		, reorder(0)
+		, reorder_delay(1000)
+		, bandwidth(0)
+		, seed(1)
+	{}
+
+	std::chrono::microseconds latency;			//one-way delay
+	std::chrono::microseconds jitter;			//plus a random delay, see DelayDistribution
+	DelayDistribution distribution;
+	double loss;								//probability a message is lost
+	double duplicate;							//probability it arrives twice
+	double reorder;								//probability a message is held back...
+	std::chrono::microseconds reorder_delay;	//...this much longer, for later ones to overtake
+	uint64_t bandwidth;							//bytes per second, 0 for unlimited
+	uint64_t seed;								//same seed and sends, same outcome
+};
+
+
+
+//Decides what happens to each message sent over a link with the given
+//conditions: lost, or when it arrives, and when its duplicate does. Times are
+//in nanoseconds on whatever clock the caller uses. Not thread safe, one per
+//sender.
+class LinkModel
+{
+public:
+	explicit LinkModel(const LinkConditions& conditions)
+		: conditions_(conditions)
+		, random_(conditions.seed)
+		, link_free_(0)
+	{}
+
+	const LinkConditions& Conditions() const { return conditions_; }
+
+
+	//Returns how many copies arrive (0 when lost, 2 when duplicated) and when
+	size_t Transmit(const int64_t now, const size_t size, int64_t (&arrivals)[2])
+	{
+		//With limited bandwidth a message leaves once the ones before it have
+		int64_t departure = now;
+		if (conditions_.bandwidth)
+		{
+			link_free_ = std::max(now, link_free_) + static_cast<int64_t>(size * 1e9 / conditions_.bandwidth);
+			departure = link_free_;
+		}
+
+		//Always the same draws per message, so one setting does not shift the others
+		const double lost = Chance();
+		const double duplicated = Chance();
+		arrivals[0] = departure + Delay();
+		arrivals[1] = departure + Delay();
+		if (lost < conditions_.loss)
+			return 0;
+		return duplicated < conditions_.duplicate ? 2 : 1;
+	}
+
+
+private:
+	//Uniform in [0, 1), the same on every platform for a seed
+	double Chance() { return (random_() >> 11) / 9007199254740992.0; }
+
+
+	//Latency, jitter and reordering for one copy; always three draws
+	int64_t Delay()
+	{
+		using std::chrono::nanoseconds;
+		const double u1 = Chance();
+		const double u2 = Chance();
+		const double held = Chance();
+
+		const double jitter = static_cast<double>(nanoseconds(conditions_.jitter).count());
+		double extra = 0;
+		switch (conditions_.distribution)
+		{
+		case DelayDistribution::Uniform:
+			extra = u1 * jitter;
+			break;
+		case DelayDistribution::Normal:	//Box-Muller
+			extra = jitter * std::sqrt(-2 * std::log(1 - u1)) * std::cos(6.283185307179586 * u2);
+			break;
+		case DelayDistribution::Pareto:	//shape 2 and scale 1 less the minimum leaves a mean of 1
+			extra = jitter * (1 / std::sqrt(1 - u1) - 1);
+			break;
+		}
+
+		int64_t delay = nanoseconds(conditions_.latency).count() + static_cast<int64_t>(extra);
+		if (held < conditions_.reorder)
+			delay += nanoseconds(conditions_.reorder_delay).count();
+		return delay < 0 ? 0 : delay;
+	}
+
+	const LinkConditions conditions_;
+	std::mt19937_64 random_;
+	int64_t link_free_;	//when the last message finishes leaving
+};
+
+
+
+//A clock that only moves when told to, for simulations that must not depend
+//on how fast the machine runs them. Starts at zero.
+class SimulatedClock
+{
+public:
+	SimulatedClock() : now_(0) {}
+
+	SimulatedClock(const SimulatedClock&) = delete;
+	SimulatedClock& operator= (const SimulatedClock&) = delete;
+
+
+	int64_t Now() const { return now_.load(std::memory_order_acquire); }
+
+	template<class Rep, class Period>
+	void Advance(const std::chrono::duration<Rep, Period> by)
+	{
+		now_.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(by).count(), std::memory_order_acq_rel);
+	}
+
+private:
+	std::atomic<int64_t> now_;	//nanoseconds
+};
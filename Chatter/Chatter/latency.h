@@ -0,0 +1,142 @@
+#pragma once
+#include "frame.h"
+#include "metrics.h"
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+
+//Latency probes are FrameFlagProbe frames with this 24 byte payload (big-endian):
+//
+//  0      1             4             8                    16                   24
+//  +------+-------------+-------------+--------------------+--------------------+
+//  |kind  |reserved     |probe id     |sent                |echoed              |
+//  +------+-------------+-------------+--------------------+--------------------+
+//
+//sent is the prober's steady clock in nanoseconds. The peer answers a probe
+//straight away with an echo carrying the same id and sent, plus its own clock
+//in echoed. The prober gets the round trip from sent; both sides get a one-way
+//delay from the timestamp of whatever arrives. One-way delays are only true
+//when both ends share a clock, e.g. two chatters on the same machine; across
+//machines they are off by the clock offset, which the round trip is not.
+constexpr const size_t ProbePayloadSize = 24;
+constexpr const size_t ProbeFrameSize = FrameHeaderSize + ProbePayloadSize;
+
+struct Probe
+{
+	enum Kind : uint8_t { Request = 1, Echo = 2 };
+
+	uint8_t kind;
+	uint32_t id;
+	int64_t sent;
+	int64_t echoed;	//Echo only
+};
+
+
+//The steady clock probes are stamped with, in nanoseconds
+inline int64_t ProbeClock()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+//Writes ProbeFrameSize bytes to out
+inline void EncodeProbe(const Probe& probe, const uint32_t sender_id, char* out)
+{
+	using namespace frame_detail;
+	EncodeFrameHeader(FrameHeader{ FrameVersion, FrameFlagProbe, sender_id, probe.id, static_cast<uint16_t>(ProbePayloadSize), 0 }, out);
+
+	char* p = out + FrameHeaderSize;
+	p[0] = static_cast<char>(probe.kind);
+	p[1] = p[2] = p[3] = 0;
+	Put32(p + 4, probe.id);
+	Put32(p + 8, static_cast<uint32_t>(static_cast<uint64_t>(probe.sent) >> 32));
+	Put32(p + 12, static_cast<uint32_t>(probe.sent));
+	Put32(p + 16, static_cast<uint32_t>(static_cast<uint64_t>(probe.echoed) >> 32));
+	Put32(p + 20, static_cast<uint32_t>(probe.echoed));
+}
+
+
+//Looks at the flags alone, so other frames pay no more than this for probes
+inline bool IsProbeFrame(const char* data, const size_t size)
+{
+	return size >= FrameHeaderSize && (static_cast<uint8_t>(data[3]) & FrameFlagProbe);
+}
+
+
+//Parses the payload of a FrameFlagProbe frame
+inline bool DecodeProbe(const char* payload, const size_t size, Probe& probe)
+{
+	using namespace frame_detail;
+	if (size < ProbePayloadSize)
+		return false;
+
+	probe.kind = static_cast<uint8_t>(payload[0]);
+	probe.id = Get32(payload + 4);
+	probe.sent = static_cast<int64_t>((static_cast<uint64_t>(Get32(payload + 8)) << 32) | Get32(payload + 12));
+	probe.echoed = static_cast<int64_t>((static_cast<uint64_t>(Get32(payload + 16)) << 32) | Get32(payload + 20));
+	return probe.kind == Probe::Request || probe.kind == Probe::Echo;
+}
+
+
+
+//Probe bookkeeping for one peer. OnProbe() fills in the echo to send back.
+class LatencyTracker
+{
+public:
+	struct Stats
+	{
+		uint64_t probes_sent;
+		uint64_t echoes_received;
+		LatencyHistogram::Summary round_trip;
+		LatencyHistogram::Summary one_way;	//both directions, see above
+	};
+
+	LatencyTracker() : next_id_(0), probes_sent_(0), echoes_received_(0) {}
+
+	LatencyTracker(const LatencyTracker&) = delete;
+	LatencyTracker& operator= (const LatencyTracker&) = delete;
+
+
+	Probe NextProbe(const int64_t now)
+	{
+		probes_sent_++;
+		return Probe{ Probe::Request, next_id_++, now, 0 };
+	}
+
+
+	//Returns true when probe is a request and echo should be sent
+	bool OnProbe(const Probe& probe, const int64_t now, Probe& echo)
+	{
+		if (probe.kind == Probe::Request)
+		{
+			Record(one_way_, now - probe.sent);
+			echo = Probe{ Probe::Echo, probe.id, probe.sent, now };
+			return true;
+		}
+
+		echoes_received_++;
+		Record(round_trip_, now - probe.sent);
+		Record(one_way_, now - probe.echoed);
+		return false;
+	}
+
+
+	Stats GetStats() const
+	{
+		return Stats{ probes_sent_.load(), echoes_received_.load(), round_trip_.Summarise(), one_way_.Summarise() };
+	}
+
+private:
+	//Clocks that are not shared can put a peer's stamp in our future
+	static void Record(LatencyHistogram& histogram, const int64_t ns)
+	{
+		histogram.Record(static_cast<uint64_t>(ns < 0 ? 0 : ns));
+	}
+
+	uint32_t next_id_;
+	std::atomic<uint64_t> probes_sent_;
+	std::atomic<uint64_t> echoes_received_;
+	LatencyHistogram round_trip_;
+	LatencyHistogram one_way_;
+};
@@ -0,0 +1,415 @@
+#pragma once
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <tuple>
+#include <memory>
+#include <string>
+#include <utility>
+#include <type_traits>
+#include <new>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+
+//Statements below CHATTER_LOG_LEVEL are removed at compile time, arguments and all
+#define CHATTER_LOG_LEVEL_DEBUG		0
+#define CHATTER_LOG_LEVEL_INFO		1
+#define CHATTER_LOG_LEVEL_WARNING	2
+#define CHATTER_LOG_LEVEL_ERROR		3
+#define CHATTER_LOG_LEVEL_OFF		4
+
+#ifndef CHATTER_LOG_LEVEL
+#define CHATTER_LOG_LEVEL CHATTER_LOG_LEVEL_DEBUG
+#endif
+
+
+enum class LogLevel
+{
+	Debug = CHATTER_LOG_LEVEL_DEBUG,
+	Info = CHATTER_LOG_LEVEL_INFO,
+	Warning = CHATTER_LOG_LEVEL_WARNING,
+	Error = CHATTER_LOG_LEVEL_ERROR,
+	Off = CHATTER_LOG_LEVEL_OFF
+};
+
+
+
+//Asynchronous logger. Write() stores the printf format, a timestamp and the
+//arguments in binary form into a fixed size record of a bounded lock-free ring;
+//a background thread formats and prints the records. Nothing on the calling
+//thread formats, locks or touches the output stream, and when the ring is
+//full the record is dropped rather than waiting.
+//
+//The format must be a string literal. Arguments may be numbers, pointers,
+//strings (copied; longer than LogText::Size - 1 characters, they are cut short
+//and end in "...") and sockaddr_in, which
+//prints as ip:port through %s. The CHATTER_* macros have the compiler check
+//the format against the arguments, as it would for printf.
+class Logger
+{
+public:
+	struct Stats
+	{
+		size_t written;
+		size_t dropped;		//ring was full
+	};
+
+	struct LogText
+	{
+		static constexpr const size_t Size = 96;
+		char data[Size];
+	};
+
+
+	static Logger& Instance()
+	{
+		static Logger logger(4096);
+		return logger;
+	}
+
+
+	//capacity is rounded up to a power of two
+	explicit Logger(const size_t capacity, FILE* const output = stdout)
+		: mask_(RoundUpToPowerOfTwo(capacity) - 1)
+		, records_(new Record[mask_ + 1])
+		, tail_(0)
+		, head_(0)
+		, consumed_(0)
+		, level_(static_cast<int>(LogLevel::Info))
+		, output_(output)
+		, dropped_(0)
+		, start_(Clock::now())
+		, running_(true)
+	{
+		for (size_t i = 0; i <= mask_; ++i)
+			records_[i].sequence.store(i, std::memory_order_relaxed);
+		worker_ = std::thread(&Logger::Run, this);
+	}
+
+	~Logger()
+	{
+		running_ = false;
+		worker_.join();
+		Drain();
+	}
+
+	Logger(const Logger&) = delete;
+	Logger& operator= (const Logger&) = delete;
+
+
+	//Records below level are skipped at run time
+	void SetLevel(const LogLevel level) { level_.store(static_cast<int>(level), std::memory_order_relaxed); }
+	LogLevel Level() const { return static_cast<LogLevel>(level_.load(std::memory_order_relaxed)); }
+	bool Enabled(const LogLevel level) const { return static_cast<int>(level) >= level_.load(std::memory_order_relaxed); }
+
+	void SetOutput(FILE* const output) { output_.store(output); }
+
+
+	template<class... Args>
+	void Write(const LogLevel level, const char* const format, const Args&... args)
+	{
+		using Stored = std::tuple<decltype(Store(std::declval<const Args&>()))...>;
+		static_assert(sizeof(Stored) <= sizeof(Record::args), "too many log arguments");
+		static_assert(std::is_trivially_destructible<Stored>::value, "log arguments must be plain data");
+
+		const int64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start_).count();
+
+		size_t position = tail_.load(std::memory_order_relaxed);
+		Record* record;
+		for (;;)
+		{
+			record = &records_[position & mask_];
+			const size_t sequence = record->sequence.load(std::memory_order_acquire);
+			const auto lag = static_cast<std::ptrdiff_t>(sequence - position);
+			if (lag == 0)
+			{
+				if (tail_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (lag < 0)
+			{
+				dropped_.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			else
+			{
+				position = tail_.load(std::memory_order_relaxed);
+			}
+		}
+
+		record->time = time;
+		record->level = level;
+		record->format = format;
+		record->print = &Print<Stored>;
+		new (record->args) Stored(Store(args)...);
+		record->sequence.store(position + 1, std::memory_order_release);
+	}
+
+
+	//Waits until everything written so far has been printed
+	void Flush()
+	{
+		const size_t target = tail_.load(std::memory_order_acquire);
+		while (consumed_.load(std::memory_order_acquire) < target)
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		fflush(output_.load());
+	}
+
+
+	Stats GetStats() const
+	{
+		return Stats{ consumed_.load(std::memory_order_relaxed), dropped_.load(std::memory_order_relaxed) };
+	}
+
+
+	//Never called, only compiled: the macros pass it the format and each
+	//argument as Print() will hand it to printf, for -Wformat to check
+#if defined(__GNUC__) || defined(__clang__)
+	__attribute__((format(printf, 1, 2)))
+#endif
+	static void CheckFormat(const char*, ...) {}
+
+	static const char* FormatArg(const char* text) { return text; }
+	static const char* FormatArg(const std::string& text) { return text.c_str(); }
+	static const char* FormatArg(const sockaddr_in&) { return ""; }
+
+	template<class T>
+	static typename std::enable_if<std::is_arithmetic<T>::value || std::is_same<T, const void*>::value || std::is_same<T, void*>::value, T>::type
+		FormatArg(const T& value) { return value; }
+
+
+private:
+	using Clock = std::chrono::steady_clock;
+	using Printer = void(*)(FILE*, const char*, const void*);
+
+	//Sized to four cache lines, though before C++17 new[] cannot be relied on
+	//to align it to them; sequence tells producers and the consumer whose turn it is
+	struct Record
+	{
+		std::atomic<size_t> sequence;
+		int64_t time;
+		LogLevel level;
+		const char* format;
+		Printer print;
+		alignas(8) char args[216];
+	};
+
+
+	//How each argument is kept in the record
+	static LogText Store(const char* text)
+	{
+		LogText stored;
+		if (!text)
+			text = "(null)";
+		const size_t length = strnlen(text, LogText::Size);
+		if (length < LogText::Size)
+		{
+			memcpy(stored.data, text, length + 1);
+		}
+		else
+		{
+			static const char marker[] = "...";
+			memcpy(stored.data, text, LogText::Size - sizeof marker);
+			memcpy(stored.data + LogText::Size - sizeof marker, marker, sizeof marker);
+		}
+		return stored;
+	}
+
+	static LogText Store(const std::string& text) { return Store(text.c_str()); }
+	static sockaddr_in Store(const sockaddr_in& endpoint) { return endpoint; }
+
+	template<class T>
+	static typename std::enable_if<std::is_arithmetic<T>::value || std::is_same<T, const void*>::value || std::is_same<T, void*>::value, T>::type
+		Store(const T& value) { return value; }
+
+
+	//And how it is handed back to printf; scratch is room for one LogText
+	template<class T>
+	static const T& Expand(const T& value, char*) { return value; }
+	static const char* Expand(const LogText& text, char*) { return text.data; }
+
+	static const char* Expand(const sockaddr_in& endpoint, char* const scratch)
+	{
+		char ip[INET_ADDRSTRLEN] = { 0 };
+		inet_ntop(AF_INET, &endpoint.sin_addr, ip, sizeof ip);
+		snprintf(scratch, LogText::Size, "%s:%d", ip, ntohs(endpoint.sin_port));
+		return scratch;
+	}
+
+
+	template<class Stored>
+	static void Print(FILE* const output, const char* const format, const void* const args)
+	{
+		const auto& stored = *static_cast<const Stored*>(args);
+		Print(output, format, stored, std::make_index_sequence<std::tuple_size<Stored>::value>());
+	}
+
+	static void Print(FILE* const output, const char* const format, const std::tuple<>&, std::index_sequence<>)
+	{
+		fputs(format, output);
+	}
+
+	template<class Stored, size_t... I>
+	static void Print(FILE* const output, const char* const format, const Stored& stored, std::index_sequence<I...>)
+	{
+		char scratch[sizeof...(I)][LogText::Size];
+		fprintf(output, format, Expand(std::get<I>(stored), scratch[I])...);
+	}
+
+
+	static const char* Name(const LogLevel level)
+	{
+		switch (level)
+		{
+		case LogLevel::Debug: return "DEBUG";
+		case LogLevel::Info: return "INFO";
+		case LogLevel::Warning: return "WARN";
+		case LogLevel::Error: return "ERROR";
+		default: return "";
+		}
+	}
+
+
+	void Run()
+	{
+		while (running_.load(std::memory_order_relaxed))
+		{
+			if (!Drain())
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+
+
+	//Consumer side: prints every record that is ready, returns how many
+	size_t Drain()
+	{
+		FILE* const output = output_.load();
+		size_t n = 0;
+		for (;; ++n)
+		{
+			Record& record = records_[head_ & mask_];
+			if (record.sequence.load(std::memory_order_acquire) != head_ + 1)
+				break;
+
+			fprintf(output, "%12.6f %-5s ", record.time / 1e9, Name(record.level));
+			record.print(output, record.format, record.args);
+			fputc('\n', output);
+
+			record.sequence.store(head_ + mask_ + 1, std::memory_order_release);
+			consumed_.store(++head_, std::memory_order_release);
+		}
+		if (n)
+			fflush(output);
+		return n;
+	}
+
+
+	static size_t RoundUpToPowerOfTwo(const size_t n)
+	{
+		size_t p = 1;
+		while (p < n)
+			p <<= 1;
+		return p;
+	}
+
+	const size_t mask_;
+	std::unique_ptr<Record[]> records_;
+	std::atomic<size_t> tail_;		//next record producers claim
+	size_t head_;					//next record the worker prints
+	std::atomic<size_t> consumed_;
+	std::atomic<int> level_;
+	std::atomic<FILE*> output_;
+	std::atomic<size_t> dropped_;
+	const Clock::time_point start_;
+	std::atomic<bool> running_;
+	std::thread worker_;
+};
+
+
+//CHATTER_LOG_CHECKED(format, a, b, ...) is format, Logger::FormatArg(a), Logger::FormatArg(b), ...
+//for up to 16 arguments. CHATTER_LOG_EXPAND is for MSVC's traditional preprocessor.
+#define CHATTER_LOG_EXPAND(x) x
+#define CHATTER_LOG_CAT(a, b) CHATTER_LOG_CAT_(a, b)
+#define CHATTER_LOG_CAT_(a, b) a##b
+#define CHATTER_LOG_NTH(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, _17, N, ...) N
+#define CHATTER_LOG_COUNT(...) CHATTER_LOG_EXPAND(CHATTER_LOG_NTH(__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0))
+#define CHATTER_LOG_CHECKED(...) CHATTER_LOG_EXPAND(CHATTER_LOG_CAT(CHATTER_LOG_MAP, CHATTER_LOG_COUNT(__VA_ARGS__))(__VA_ARGS__))
+
+#define CHATTER_LOG_MAP0(f) f
+#define CHATTER_LOG_MAP1(f, ...) f, CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS1(__VA_ARGS__))
+#define CHATTER_LOG_MAP2(f, ...) f, CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS2(__VA_ARGS__))
+#define CHATTER_LOG_MAP3(f, ...) f, CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS3(__VA_ARGS__))
+#define CHATTER_LOG_MAP4(f, ...) f, CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS4(__VA_ARGS__))
+#define CHATTER_LOG_MAP5(f, ...) f, CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS5(__VA_ARGS__))
+#define CHATTER_LOG_MAP6(f, ...) f, CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS6(__VA_ARGS__))
+#define CHATTER_LOG_MAP7(f, ...) f, CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS7(__VA_ARGS__))
+#define CHATTER_LOG_MAP8(f, ...) f, CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS8(__VA_ARGS__))
+#define CHATTER_LOG_MAP9(f, ...) f, CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS9(__VA_ARGS__))
+#define CHATTER_LOG_MAP10(f, ...) f, CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS10(__VA_ARGS__))
+#define CHATTER_LOG_MAP11(f, ...) f, CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS11(__VA_ARGS__))
+#define CHATTER_LOG_MAP12(f, ...) f, CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS12(__VA_ARGS__))
+#define CHATTER_LOG_MAP13(f, ...) f, CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS13(__VA_ARGS__))
+#define CHATTER_LOG_MAP14(f, ...) f, CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS14(__VA_ARGS__))
+#define CHATTER_LOG_MAP15(f, ...) f, CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS15(__VA_ARGS__))
+#define CHATTER_LOG_MAP16(f, ...) f, CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS16(__VA_ARGS__))
+
+#define CHATTER_LOG_ARGS1(a) Logger::FormatArg(a)
+#define CHATTER_LOG_ARGS2(a, ...) Logger::FormatArg(a), CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS1(__VA_ARGS__))
+#define CHATTER_LOG_ARGS3(a, ...) Logger::FormatArg(a), CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS2(__VA_ARGS__))
+#define CHATTER_LOG_ARGS4(a, ...) Logger::FormatArg(a), CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS3(__VA_ARGS__))
+#define CHATTER_LOG_ARGS5(a, ...) Logger::FormatArg(a), CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS4(__VA_ARGS__))
+#define CHATTER_LOG_ARGS6(a, ...) Logger::FormatArg(a), CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS5(__VA_ARGS__))
+#define CHATTER_LOG_ARGS7(a, ...) Logger::FormatArg(a), CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS6(__VA_ARGS__))
+#define CHATTER_LOG_ARGS8(a, ...) Logger::FormatArg(a), CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS7(__VA_ARGS__))
+#define CHATTER_LOG_ARGS9(a, ...) Logger::FormatArg(a), CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS8(__VA_ARGS__))
+#define CHATTER_LOG_ARGS10(a, ...) Logger::FormatArg(a), CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS9(__VA_ARGS__))
+#define CHATTER_LOG_ARGS11(a, ...) Logger::FormatArg(a), CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS10(__VA_ARGS__))
+#define CHATTER_LOG_ARGS12(a, ...) Logger::FormatArg(a), CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS11(__VA_ARGS__))
+#define CHATTER_LOG_ARGS13(a, ...) Logger::FormatArg(a), CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS12(__VA_ARGS__))
+#define CHATTER_LOG_ARGS14(a, ...) Logger::FormatArg(a), CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS13(__VA_ARGS__))
+#define CHATTER_LOG_ARGS15(a, ...) Logger::FormatArg(a), CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS14(__VA_ARGS__))
+#define CHATTER_LOG_ARGS16(a, ...) Logger::FormatArg(a), CHATTER_LOG_EXPAND(CHATTER_LOG_ARGS15(__VA_ARGS__))
+
+#define CHATTER_LOG(level, ...) \
+	do \
+	{ \
+		if (false) \
+			Logger::CheckFormat(CHATTER_LOG_CHECKED(__VA_ARGS__)); \
+		if (Logger::Instance().Enabled(level)) \
+			Logger::Instance().Write(level, __VA_ARGS__); \
+	} while (0)
+
+#if CHATTER_LOG_LEVEL <= CHATTER_LOG_LEVEL_DEBUG
+#define CHATTER_DEBUG(...)	CHATTER_LOG(LogLevel::Debug, __VA_ARGS__)
+#else
+#define CHATTER_DEBUG(...)	do {} while (0)
+#endif
+
+#if CHATTER_LOG_LEVEL <= CHATTER_LOG_LEVEL_INFO
+#define CHATTER_INFO(...)	CHATTER_LOG(LogLevel::Info, __VA_ARGS__)
+#else
+#define CHATTER_INFO(...)	do {} while (0)
+#endif
+
+#if CHATTER_LOG_LEVEL <= CHATTER_LOG_LEVEL_WARNING
+#define CHATTER_WARN(...)	CHATTER_LOG(LogLevel::Warning, __VA_ARGS__)
+#else
+#define CHATTER_WARN(...)	do {} while (0)
+#endif
+
+#if CHATTER_LOG_LEVEL <= CHATTER_LOG_LEVEL_ERROR
+#define CHATTER_ERROR(...)	CHATTER_LOG(LogLevel::Error, __VA_ARGS__)
+#else
+#define CHATTER_ERROR(...)	do {} while (0)
+#endif
@@ -0,0 +1,248 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+
+//Latency histogram in nanoseconds with HDR style log-linear buckets: values
+//below SubBuckets get a bucket each, above that every power of two is split
+//into SubBuckets / 2 buckets, so any value is reported within ~3% of itself.
+//Record() is a single relaxed increment and may be called from any thread.
+class LatencyHistogram
+{
+public:
+	using Duration = std::chrono::nanoseconds;
+
+	struct Summary
+	{
+		uint64_t count;
+		Duration mean;
+		Duration p50;
+		Duration p90;
+		Duration p99;
+		Duration p999;
+		Duration max;
+	};
+
+	LatencyHistogram()
+		: sum_(0)
+		, max_(0)
+	{
+		Reset();
+	}
+
+	LatencyHistogram(const LatencyHistogram&) = delete;
+	LatencyHistogram& operator= (const LatencyHistogram&) = delete;
+
+
+	template<class Rep, class Period>
+	void Record(const std::chrono::duration<Rep, Period> latency)
+	{
+		const auto ns = std::chrono::duration_cast<Duration>(latency).count();
+		Record(static_cast<uint64_t>(ns < 0 ? 0 : ns));
+	}
+
+	void Record(const uint64_t ns)
+	{
+		counts_[Index(ns)].fetch_add(1, std::memory_order_relaxed);
+		sum_.fetch_add(ns, std::memory_order_relaxed);
+		uint64_t max = max_.load(std::memory_order_relaxed);
+		while (ns > max && !max_.compare_exchange_weak(max, ns, std::memory_order_relaxed))
+		{}
+	}
+
+
+	//Not synchronised with Record(); samples recorded meanwhile may be lost
+	void Reset()
+	{
+		for (auto& count : counts_)
+			count.store(0, std::memory_order_relaxed);
+		sum_.store(0, std::memory_order_relaxed);
+		max_.store(0, std::memory_order_relaxed);
+	}
+
+
+	uint64_t Count() const
+	{
+		uint64_t total = 0;
+		for (const auto& count : counts_)
+			total += count.load(std::memory_order_relaxed);
+		return total;
+	}
+
+
+	//Highest value equivalent to the sample at fraction (0..1) of the distribution
+	Duration Percentile(const double fraction) const
+	{
+		uint64_t counts[Buckets];
+		uint64_t total = 0;
+		for (size_t i = 0; i < Buckets; ++i)
+			total += counts[i] = counts_[i].load(std::memory_order_relaxed);
+		return Percentile(counts, total, fraction);
+	}
+
+
+	Summary Summarise() const
+	{
+		uint64_t counts[Buckets];
+		uint64_t total = 0;
+		for (size_t i = 0; i < Buckets; ++i)
+			total += counts[i] = counts_[i].load(std::memory_order_relaxed);
+
+		Summary summary = {};
+		summary.count = total;
+		if (!total)
+			return summary;
+		//Bucket bounds may overshoot the largest sample actually seen
+		summary.max = Duration(max_.load(std::memory_order_relaxed));
+		summary.mean = Duration(sum_.load(std::memory_order_relaxed) / total);
+		summary.p50 = std::min(summary.max, Percentile(counts, total, 0.5));
+		summary.p90 = std::min(summary.max, Percentile(counts, total, 0.9));
+		summary.p99 = std::min(summary.max, Percentile(counts, total, 0.99));
+		summary.p999 = std::min(summary.max, Percentile(counts, total, 0.999));
+		return summary;
+	}
+
+
+	//Bucket a value lands in, and the smallest value of a bucket
+	static size_t Index(const uint64_t value)
+	{
+		if (value < SubBuckets)
+			return static_cast<size_t>(value);
+		const unsigned shift = Log2(value) - SubBits + 1;
+		return shift * HalfBuckets + static_cast<size_t>(value >> shift);
+	}
+
+	static uint64_t LowestValue(const size_t index)
+	{
+		if (index < SubBuckets)
+			return index;
+		const size_t shift = index / HalfBuckets - 1;
+		return static_cast<uint64_t>(index - shift * HalfBuckets) << shift;
+	}
+
+
+private:
+	static constexpr const unsigned SubBits = 6;
+	static constexpr const size_t SubBuckets = size_t(1) << SubBits;
+	static constexpr const size_t HalfBuckets = SubBuckets / 2;
+	static constexpr const size_t Buckets = (64 - SubBits) * HalfBuckets + SubBuckets;
+
+	static unsigned Log2(uint64_t value)
+	{
+		unsigned log = 0;
+		while (value >>= 1)
+			log++;
+		return log;
+	}
+
+	static Duration Percentile(const uint64_t* const counts, const uint64_t total, const double fraction)
+	{
+		if (!total)
+			return Duration::zero();
+
+		const double wanted = fraction * total;
+		uint64_t rank = wanted < 1 ? 1 : static_cast<uint64_t>(wanted + 0.5);
+		if (rank > total)
+			rank = total;
+
+		uint64_t seen = 0;
+		for (size_t i = 0; i < Buckets; ++i)
+		{
+			seen += counts[i];
+			if (seen >= rank)
+				return Duration(i + 1 < Buckets ? LowestValue(i + 1) - 1 : ~uint64_t(0) >> 1);
+		}
+		return Duration::zero();
+	}
+
+	std::atomic<uint64_t> counts_[Buckets];
+	std::atomic<uint64_t> sum_;
+	std::atomic<uint64_t> max_;
+};
+
+
+
+//Counters of one channel. Senders and the receive threads update them
+//concurrently, so each counter sits on a cache line of its own.
+class ChannelMetrics
+{
+public:
+	enum Counter
+	{
+		TxMessages,
+		TxBytes,
+		RxMessages,
+		RxBytes,
+		Drops,			//datagrams discarded: unknown sender or refused by the decoder
+		Truncations,	//datagrams larger than the receive buffer
+		SendErrors,		//datagrams the socket failed to send
+		QueueDepth,		//gauge: frames queued or in flight on reliable links
+		Counters
+	};
+
+	struct Snapshot
+	{
+		uint64_t tx_messages;
+		uint64_t tx_bytes;
+		uint64_t rx_messages;
+		uint64_t rx_bytes;
+		uint64_t drops;
+		uint64_t truncations;
+		uint64_t send_errors;
+		uint64_t queue_depth;
+		LatencyHistogram::Summary send;		//time spent in SendMessage()
+		LatencyHistogram::Summary delivery;	//datagram received to callback returned
+	};
+
+	ChannelMetrics()
+	{
+		for (auto& counter : counters_)
+			counter.value.store(0, std::memory_order_relaxed);
+	}
+
+	ChannelMetrics(const ChannelMetrics&) = delete;
+	ChannelMetrics& operator= (const ChannelMetrics&) = delete;
+
+
+	void Add(const Counter counter, const uint64_t n = 1) { counters_[counter].value.fetch_add(n, std::memory_order_relaxed); }
+	void Set(const Counter counter, const uint64_t value) { counters_[counter].value.store(value, std::memory_order_relaxed); }
+	uint64_t Get(const Counter counter) const { return counters_[counter].value.load(std::memory_order_relaxed); }
+
+	LatencyHistogram& SendLatency() { return send_; }
+	LatencyHistogram& DeliveryLatency() { return delivery_; }
+
+
+	Snapshot Take() const
+	{
+		Snapshot snapshot;
+		snapshot.tx_messages = Get(TxMessages);
+		snapshot.tx_bytes = Get(TxBytes);
+		snapshot.rx_messages = Get(RxMessages);
+		snapshot.rx_bytes = Get(RxBytes);
+		snapshot.drops = Get(Drops);
+		snapshot.truncations = Get(Truncations);
+		snapshot.send_errors = Get(SendErrors);
+		snapshot.queue_depth = Get(QueueDepth);
+		snapshot.send = send_.Summarise();
+		snapshot.delivery = delivery_.Summarise();
+		return snapshot;
+	}
+
+
+private:
+	static constexpr const size_t CacheLine = 64;
+
+	struct PaddedCounter
+	{
+		std::atomic<uint64_t> value;
+		char pad[CacheLine - sizeof(std::atomic<uint64_t>)];
+	};
+
+	char pad_[CacheLine];
+	PaddedCounter counters_[Counters];
+	LatencyHistogram send_;
+	LatencyHistogram delivery_;
+};
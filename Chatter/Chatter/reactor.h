@@ -0,0 +1,322 @@
+#pragma once
+#include "transport.h"
+#include "timer_wheel.h"
+#include <functional>
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+
+//Single-threaded readiness loop. Watch() every socket before Run(), then Run()
+//blocks the calling thread dispatching readable sockets and due timers until
+//Stop() is called from any thread.
+//Timers, one-off After() and periodic Every() ones, share a TimerWheel of
+//Tick resolution and may be added or cancelled from any thread at any time.
+//Linux uses epoll with an eventfd for wakeup and one timerfd, set for the
+//wheel's next wakeup; elsewhere we fall back to select().
+class Reactor
+{
+public:
+	using Handler = std::function<void()>;
+	using TimerId = TimerWheel<Handler>::TimerId;
+
+	Reactor()
+#ifdef __linux__
+		: epollfd(epoll_create1(EPOLL_CLOEXEC))
+		, wakefd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+		, timerfd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+		, armed(-1)
+		, timers(Tick(), 64, Now())
+#else
+		: stopped(false)
+		, timers(Tick(), 64, Now())
+#endif
+	{
+#ifdef __linux__
+		if (epollfd == INVALID_SOCKET || wakefd == INVALID_SOCKET || timerfd == INVALID_SOCKET)
+		{
+			CHATTER_ERROR("reactor setup failed: %d", GetLastError());
+			return;
+		}
+
+		epoll_event ev = { 0 };
+		ev.events = EPOLLIN;
+		ev.data.ptr = nullptr; //null marks the wakeup descriptor
+		epoll_ctl(epollfd, EPOLL_CTL_ADD, wakefd, &ev);
+		Watch(timerfd, [this] { OnTimers(); });
+#endif
+	}
+
+
+	~Reactor()
+	{
+#ifdef __linux__
+		if (timerfd != INVALID_SOCKET)
+			close(timerfd);
+		if (wakefd != INVALID_SOCKET)
+			close(wakefd);
+		if (epollfd != INVALID_SOCKET)
+			close(epollfd);
+#endif
+	}
+
+
+	bool IsOpen() const
+	{
+#ifdef __linux__
+		return epollfd != INVALID_SOCKET && wakefd != INVALID_SOCKET && timerfd != INVALID_SOCKET;
+#else
+		return true;
+#endif
+	}
+
+
+	bool Watch(const SOCKET fd, Handler on_readable)
+	{
+		watches.emplace_back(new Watched{ fd, std::move(on_readable) });
+
+#ifdef __linux__
+		epoll_event ev = { 0 };
+		ev.events = EPOLLIN;
+		ev.data.ptr = watches.back().get();
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == SOCKET_ERROR)
+		{
+			CHATTER_ERROR("epoll_ctl failed with error code: %d", GetLastError());
+			watches.pop_back();
+			return false;
+		}
+#endif
+		return true;
+	}
+
+
+	//Calls on_timeout once on the reactor thread after delay. The id it returns
+	//is for Cancel().
+	TimerId After(const std::chrono::nanoseconds delay, Handler on_timeout)
+	{
+		std::lock_guard<std::mutex> lock(timers_mutex);
+		const TimerId id = timers.Schedule(Now() + delay.count(), std::move(on_timeout));
+		Rearm();
+		return id;
+	}
+
+
+	//Returns false when the timer has fired, is firing or was cancelled already
+	bool Cancel(const TimerId id)
+	{
+		std::lock_guard<std::mutex> lock(timers_mutex);
+		return timers.Cancel(id);
+	}
+
+
+	//Calls on_tick on the reactor thread roughly every interval
+	bool Every(const std::chrono::milliseconds interval, Handler on_tick)
+	{
+		if (interval.count() <= 0)
+			return false;
+
+		const int64_t period = std::chrono::duration_cast<std::chrono::nanoseconds>(interval).count();
+		std::lock_guard<std::mutex> lock(timers_mutex);
+		Repeat(Now() + period, period, std::make_shared<Handler>(std::move(on_tick)));
+		Rearm();
+		return true;
+	}
+
+
+	void Run()
+	{
+		//Once up front, so handlers can start work that must come from this thread
+		//(see UdpSocket::EventHandle()); a handler with nothing to read just returns.
+		for (auto& w : watches)
+			w->on_readable();
+
+#ifdef __linux__
+		epoll_event events[MaxEvents];
+		for (;;)
+		{
+			const int n = epoll_wait(epollfd, events, MaxEvents, -1);
+			if (n == SOCKET_ERROR)
+			{
+				if (errno == EINTR)
+					continue;
+				CHATTER_ERROR("epoll_wait failed with error code: %d", GetLastError());
+				return;
+			}
+
+			for (int i = 0; i < n; ++i)
+			{
+				if (!events[i].data.ptr)
+					return;
+				static_cast<Watched*>(events[i].data.ptr)->on_readable();
+			}
+		}
+#else
+		while (!stopped)
+		{
+			fd_set readable;
+			FD_ZERO(&readable);
+			SOCKET maxfd = 0;
+			for (auto& w : watches)
+			{
+				FD_SET(w->fd, &readable);
+				if (w->fd > maxfd)
+					maxfd = w->fd;
+			}
+
+			timeval timeout = { 0, 10000 };
+			if (select(static_cast<int>(maxfd) + 1, &readable, nullptr, nullptr, &timeout) > 0)
+			{
+				for (auto& w : watches)
+					if (FD_ISSET(w->fd, &readable))
+						w->on_readable();
+			}
+
+			OnTimers();
+		}
+#endif
+	}
+
+
+	void Stop()
+	{
+#ifdef __linux__
+		const uint64_t one = 1;
+		if (write(wakefd, &one, sizeof one) != sizeof one)
+			CHATTER_ERROR("reactor wakeup failed: %d", GetLastError());
+#else
+		stopped = true;
+#endif
+	}
+
+
+private:
+	struct Watched
+	{
+		SOCKET fd;
+		Handler on_readable;
+	};
+
+	static constexpr const int MaxEvents = 64;
+	static std::chrono::microseconds Tick() { return std::chrono::microseconds(100); }
+
+	static int64_t Now()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+
+	//Files the next round of an Every() timer. Rounds stay on the grid of the
+	//first one, skipping any that a late handler made us miss. Holding timers_mutex.
+	void Repeat(const int64_t due, const int64_t period, const std::shared_ptr<Handler>& on_tick)
+	{
+		timers.Schedule(due, [this, due, period, on_tick]
+		{
+			(*on_tick)();
+			const int64_t now = Now();
+			int64_t next = due + period;
+			if (next <= now)
+				next += ((now - next) / period + 1) * period;
+
+			std::lock_guard<std::mutex> lock(timers_mutex);
+			Repeat(next, period, on_tick);
+		});
+	}
+
+
+	//Runs the timers that are due, outside the lock so they may add and cancel timers
+	void OnTimers()
+	{
+#ifdef __linux__
+		uint64_t expirations = 0;
+		if (read(timerfd, &expirations, sizeof expirations) != sizeof expirations && errno != EAGAIN)
+			CHATTER_ERROR("timerfd read failed with error code: %d", GetLastError());
+#endif
+		{
+			std::lock_guard<std::mutex> lock(timers_mutex);
+			timers.Advance(Now(), [this](Handler& handler) { firing.push_back(std::move(handler)); });
+		}
+		for (auto& handler : firing)
+			handler();
+		firing.clear();
+
+		std::lock_guard<std::mutex> lock(timers_mutex);
+		Rearm();
+	}
+
+
+	//Sets the timerfd for the wheel's next wakeup, if that changed. Holding timers_mutex.
+	void Rearm()
+	{
+#ifdef __linux__
+		const int64_t wakeup = timers.NextWakeup();
+		if (wakeup == armed)
+			return;
+		armed = wakeup;
+
+		itimerspec spec = { { 0 } };	//all zero disarms
+		if (wakeup >= 0)
+		{
+			spec.it_value.tv_sec = static_cast<time_t>(wakeup / 1000000000);
+			spec.it_value.tv_nsec = static_cast<long>(wakeup % 1000000000);
+			if (!spec.it_value.tv_sec && !spec.it_value.tv_nsec)
+				spec.it_value.tv_nsec = 1;
+		}
+		if (timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &spec, nullptr) == SOCKET_ERROR)
+			CHATTER_ERROR("timerfd_settime failed with error code: %d", GetLastError());
+#endif
+	}
+
+
+	std::vector<std::unique_ptr<Watched>> watches;
+#ifdef __linux__
+	int epollfd;
+	int wakefd;
+	int timerfd;
+	int64_t armed;			//what timerfd is set for, -1 for nothing
+#else
+	std::atomic<bool> stopped;
+#endif
+	std::mutex timers_mutex;
+	TimerWheel<Handler> timers;
+	std::vector<Handler> firing;	//reactor thread only
+};
+
+
+
+//Restricts a thread to the index'th CPU this process may run on (wrapping
+//around); does nothing off Linux. Returns whether the thread was pinned.
+inline bool PinThreadToCore(std::thread& thread, const size_t index)
+{
+#ifdef __linux__
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof allowed, &allowed) != 0 || CPU_COUNT(&allowed) == 0)
+		return false;
+
+	size_t n = index % CPU_COUNT(&allowed);
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+	{
+		if (!CPU_ISSET(cpu, &allowed) || n--)
+			continue;
+
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		return pthread_setaffinity_np(thread.native_handle(), sizeof set, &set) == 0;
+	}
+	return false;
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,535 @@
+#pragma once
+#include "codec.h"
+#include "congestion.h"
+#include "transport.h"
+#include <chrono>
+#include <deque>
+#include <string>
+#include <vector>
+
+
+//Optional reliable, in-order delivery between two endpoints, built on the frame
+//sequence numbers. Each peer gets its own stream: frames carry FrameFlagReliable
+//and are kept until acknowledged, and the receiver holds back frames that arrive
+//early until the gap before them is filled. Only the streams with a gap wait, so
+//one slow peer never stalls the others.
+//
+//Acknowledgements are FrameFlagAck frames with the acknowledged stream's sender id,
+//the next sequence expected as the frame sequence, and an 8 byte (big-endian)
+//bitmap of the frames received beyond it: bit i set means next + 1 + i arrived.
+//The sender retransmits only what the bitmap reports missing, either when its
+//timeout expires or after three acks have reported later frames (fast retransmit).
+//
+//A frame that still is not acknowledged after max_transmissions attempts is
+//abandoned. The unacked field of later frames tells the receiver where the
+//sender's window now starts, so it skips the abandoned frames instead of waiting.
+//
+//With congestion_control on, new frames are further limited by an AIMD
+//congestion window (see congestion.h) that shrinks on loss, and are paced
+//out at pacing_gain windows per smoothed round trip rather than in bursts.
+constexpr const size_t ReliableMaxWindow = 64;	//limited by the ack bitmap and SequenceTracker
+constexpr const size_t AckPayloadSize = 8;
+
+
+struct ReliableOptions
+{
+	ReliableOptions()
+		: window(32)
+		, initial_rto(200)
+		, min_rto(10)
+		, max_rto(2000)
+		, max_transmissions(10)
+		, max_queued(4096)
+		, congestion_control(true)
+		, initial_cwnd(4)
+		, pacing_gain(2.0)
+	{}
+
+	size_t window;	//frames in flight per peer, at most ReliableMaxWindow
+	std::chrono::milliseconds initial_rto;
+	std::chrono::milliseconds min_rto;
+	std::chrono::milliseconds max_rto;
+	unsigned max_transmissions;
+	size_t max_queued;	//frames waiting for window space; further messages are dropped
+	bool congestion_control;
+	size_t initial_cwnd;
+	double pacing_gain;
+};
+
+
+
+//Smoothed round trip time and retransmission timeout as in RFC 6298,
+//with the bounds scaled down for LAN latencies
+class RttEstimator
+{
+public:
+	using Duration = std::chrono::microseconds;
+
+	RttEstimator(const Duration initial, const Duration min, const Duration max)
+		: srtt_(0)
+		, rttvar_(0)
+		, rto_(initial)
+		, min_(min)
+		, max_(max)
+		, sampled_(false)
+	{}
+
+	void Sample(const Duration rtt)
+	{
+		if (!sampled_)
+		{
+			srtt_ = rtt;
+			rttvar_ = rtt / 2;
+			sampled_ = true;
+		}
+		else
+		{
+			const Duration error = rtt > srtt_ ? rtt - srtt_ : srtt_ - rtt;
+			rttvar_ = (3 * rttvar_ + error) / 4;
+			srtt_ = (7 * srtt_ + rtt) / 8;
+		}
+		rto_ = Clamp(srtt_ + 4 * rttvar_);
+	}
+
+	//Called when a retransmission timer expires
+	void Backoff() { rto_ = Clamp(2 * rto_); }
+
+	Duration Srtt() const { return srtt_; }
+	Duration RttVar() const { return rttvar_; }
+	Duration Rto() const { return rto_; }
+
+private:
+	Duration Clamp(const Duration d) const { return d < min_ ? min_ : d > max_ ? max_ : d; }
+
+	Duration srtt_;
+	Duration rttvar_;
+	Duration rto_;
+	const Duration min_;
+	const Duration max_;
+	bool sampled_;
+};
+
+
+
+//Send half of a reliable stream to one peer
+class ReliableSender
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	struct Stats
+	{
+		size_t window;
+		size_t in_flight;	//sent and not yet acknowledged
+		size_t queued;
+		RttEstimator::Duration srtt;
+		RttEstimator::Duration rttvar;
+		RttEstimator::Duration rto;
+		size_t sent;
+		size_t retransmits;
+		size_t timeouts;
+		size_t abandoned;
+		size_t dropped;
+		AimdWindow::Stats congestion;
+		double pacing_rate;	//bytes per second, 0 until the first RTT sample
+		size_t paced;		//times a frame had to wait for the pacer
+	};
+
+	ReliableSender(const uint32_t sender_id, const ReliableOptions& options, const size_t max_datagram = DefaultMaxDatagram)
+		: encoder_(sender_id, max_datagram, FrameFlagReliable)
+		, options_(options)
+		, max_datagram_(max_datagram)
+		, window_(options.window < 1 ? 1 : options.window > ReliableMaxWindow ? ReliableMaxWindow : options.window)
+		, rtt_(options.initial_rto, options.min_rto, options.max_rto)
+		, cwnd_(options.initial_cwnd, 1, window_)
+		, outstanding_(0)
+		, paced_(0)
+		, sent_(0)
+		, retransmits_(0)
+		, timeouts_(0)
+		, abandoned_(0)
+		, dropped_(0)
+	{}
+
+	uint32_t SenderId() const { return encoder_.SenderId(); }
+
+	//Frames the message for sending by the next Poll(). Returns false, dropping
+	//the message, when max_queued frames are already waiting for the window.
+	bool Queue(const char* payload, const size_t length)
+	{
+		if (unsent_.size() >= options_.max_queued)
+		{
+			dropped_++;
+			return false;
+		}
+
+		const size_t frames = encoder_.Encode(payload, length);
+		for (size_t i = 0; i < frames; ++i)
+			unsent_.push_back(encoder_.Frame(i));
+		return true;
+	}
+
+	void OnAck(const uint32_t stream_id, const uint32_t cumulative, const uint64_t sack, const Clock::time_point now)
+	{
+		if (stream_id != encoder_.SenderId())
+			return;
+
+		//Highest sequence the bitmap reports, anything missing below it is a hole
+		uint32_t highest = cumulative;
+		for (uint64_t bits = sack; bits; bits >>= 1)
+			highest++;
+
+		const InFlight* newest_sample = nullptr;
+		size_t acked = 0;
+		bool lost = false;
+		for (auto& frame : in_flight_)
+		{
+			if (frame.done)
+				continue;
+
+			const int32_t ahead = static_cast<int32_t>(frame.sequence - cumulative);
+			if (ahead < 0 || (ahead > 0 && ahead <= 64 && ((sack >> (ahead - 1)) & 1)))
+			{
+				frame.done = true;
+				acked++;
+				if (frame.transmissions == 1 && (!newest_sample || newest_sample->sent_at < frame.sent_at))
+					newest_sample = &frame;	//Karn: retransmitted frames give ambiguous samples
+			}
+			else if (static_cast<int32_t>(highest - frame.sequence) > 0 && ++frame.nacks == FastRetransmitAcks)
+			{
+				frame.due = now;
+				lost = true;
+			}
+		}
+
+		if (newest_sample)
+			rtt_.Sample(std::chrono::duration_cast<RttEstimator::Duration>(now - newest_sample->sent_at));
+		outstanding_ -= acked;
+		cwnd_.OnAcked(acked);
+		if (lost)
+			cwnd_.OnLoss(now, rtt_.Srtt());
+		UpdatePacing();
+		PopDone();
+	}
+
+	//Calls send(frame) for every frame due for (re)transmission and every
+	//queued frame the window has room for
+	template<class Send>
+	void Poll(const Clock::time_point now, Send send)
+	{
+		PopDone();
+
+		bool timed_out = false;
+		for (auto& frame : in_flight_)
+		{
+			if (!frame.done && now >= frame.due && frame.nacks < FastRetransmitAcks)
+				timed_out = true;
+		}
+		if (timed_out)
+		{
+			timeouts_++;
+			rtt_.Backoff();
+			cwnd_.OnTimeout();
+			UpdatePacing();
+		}
+
+		for (auto& frame : in_flight_)
+		{
+			if (frame.done || now < frame.due)
+				continue;
+			if (frame.transmissions >= options_.max_transmissions)
+			{
+				frame.done = true;
+				outstanding_--;
+				abandoned_++;
+				continue;
+			}
+
+			retransmits_++;
+			frame.nacks = 0;
+			Transmit(frame, now);
+			send(frame.frame);
+		}
+
+		while (!unsent_.empty() && in_flight_.size() < window_ && outstanding_ < CongestionWindow())
+		{
+			if (!pacer_.TryConsume(unsent_.front().size(), now))
+			{
+				paced_++;
+				break;
+			}
+
+			in_flight_.push_back(InFlight{ std::move(unsent_.front()), 0, {}, {}, 0, 0, false });
+			unsent_.pop_front();
+
+			auto& frame = in_flight_.back();
+			frame.sequence = frame_detail::Get32(&frame.frame[8]);
+			outstanding_++;
+			sent_++;
+			Transmit(frame, now);
+			send(frame.frame);
+		}
+	}
+
+	Stats GetStats() const
+	{
+		return Stats{ window_, outstanding_, unsent_.size(), rtt_.Srtt(), rtt_.RttVar(), rtt_.Rto()
+			, sent_, retransmits_, timeouts_, abandoned_, dropped_, cwnd_.GetStats(), pacer_.Rate(), paced_ };
+	}
+
+private:
+	static constexpr const unsigned FastRetransmitAcks = 3;
+
+	size_t CongestionWindow() const { return options_.congestion_control ? cwnd_.Window() : window_; }
+
+	//Spreads pacing_gain congestion windows over one smoothed round trip, with a
+	//burst allowance covering one 5ms reactor tick
+	void UpdatePacing()
+	{
+		const double srtt = std::chrono::duration<double>(rtt_.Srtt()).count();
+		if (!options_.congestion_control || srtt <= 0)
+			return;
+
+		const double rate = options_.pacing_gain * cwnd_.Window() * max_datagram_ / srtt;
+		pacer_.SetRate(rate, std::max(rate * 0.005, 2.0 * max_datagram_));
+	}
+
+	struct InFlight
+	{
+		std::string frame;
+		uint32_t sequence;
+		Clock::time_point sent_at;
+		Clock::time_point due;
+		unsigned transmissions;
+		unsigned nacks;	//acks that reported later frames but not this one
+		bool done;		//acknowledged or abandoned, removed once it reaches the front
+	};
+
+	void PopDone()
+	{
+		while (!in_flight_.empty() && in_flight_.front().done)
+			in_flight_.pop_front();
+	}
+
+	void Transmit(InFlight& frame, const Clock::time_point now)
+	{
+		//The front may already be abandoned, which only makes the receiver skip less
+		frame_detail::Put16(&frame.frame[14], static_cast<uint16_t>(frame.sequence - in_flight_.front().sequence));
+		frame.transmissions++;
+		frame.sent_at = now;
+		frame.due = now + rtt_.Rto();
+	}
+
+	MessageEncoder encoder_;
+	const ReliableOptions options_;
+	const size_t max_datagram_;
+	const size_t window_;
+	RttEstimator rtt_;
+	AimdWindow cwnd_;
+	TokenBucket pacer_;
+	std::deque<std::string> unsent_;
+	std::deque<InFlight> in_flight_;	//storage of frames handed to send() stays put until they are done
+	size_t outstanding_;	//in_flight_ entries not yet done
+	size_t paced_;
+	size_t sent_;
+	size_t retransmits_;
+	size_t timeouts_;
+	size_t abandoned_;
+	size_t dropped_;
+};
+
+
+
+//Receive half of a reliable stream from one peer. Restarts whenever the
+//sender id changes, i.e. the peer was restarted.
+class ReliableReceiver
+{
+public:
+	struct Stats
+	{
+		size_t delivered;
+		size_t duplicates;
+		size_t reordered;	//arrived ahead of a gap and held back
+		size_t skipped;		//abandoned by the sender
+		size_t discarded;	//too far ahead of the window
+	};
+
+	ReliableReceiver()
+		: started_(false)
+		, stream_(0)
+		, next_(0)
+		, present_(0)
+		, slots_(ReliableMaxWindow)
+		, delivered_(0)
+		, duplicates_(0)
+		, reordered_(0)
+		, skipped_(0)
+		, discarded_(0)
+	{}
+
+	uint32_t Stream() const { return stream_; }
+	uint32_t Cumulative() const { return next_; }
+	uint64_t Sack() const { return present_ >> 1; }
+
+	//Takes a FrameFlagReliable frame; appends every frame that is now in order to ready
+	void Accept(const FrameHeader& header, const Datagram& datagram, std::vector<Datagram>& ready)
+	{
+		const uint32_t base = header.sequence - header.unacked;
+		if (!started_ || header.sender_id != stream_)
+			Restart(header.sender_id, base);
+		else if (static_cast<int32_t>(base - next_) > 0)
+			Skip(base - next_, ready);
+
+		const int32_t ahead = static_cast<int32_t>(header.sequence - next_);
+		if (ahead < 0 || (ahead < static_cast<int32_t>(ReliableMaxWindow) && ((present_ >> ahead) & 1)))
+		{
+			duplicates_++;
+			return;
+		}
+		if (ahead >= static_cast<int32_t>(ReliableMaxWindow))
+		{
+			discarded_++;
+			return;
+		}
+
+		if (ahead > 0)
+			reordered_++;
+		slots_[header.sequence % ReliableMaxWindow] = datagram;
+		present_ |= uint64_t(1) << ahead;
+
+		while (present_ & 1)
+			Advance(ready);
+	}
+
+	Stats GetStats() const
+	{
+		return Stats{ delivered_, duplicates_, reordered_, skipped_, discarded_ };
+	}
+
+private:
+	void Restart(const uint32_t stream, const uint32_t next)
+	{
+		started_ = true;
+		stream_ = stream;
+		next_ = next;
+		present_ = 0;
+		for (auto& slot : slots_)
+			slot.buffer = BufferRef();
+	}
+
+	//Moves past count frames the sender has given up on, delivering those we do have
+	void Skip(uint32_t count, std::vector<Datagram>& ready)
+	{
+		for (; count && present_; --count)
+		{
+			if (present_ & 1)
+			{
+				Advance(ready);
+			}
+			else
+			{
+				skipped_++;
+				present_ >>= 1;
+				next_++;
+			}
+		}
+		skipped_ += count;
+		next_ += count;
+	}
+
+	void Advance(std::vector<Datagram>& ready)
+	{
+		ready.push_back(std::move(slots_[next_ % ReliableMaxWindow]));
+		present_ >>= 1;
+		next_++;
+		delivered_++;
+	}
+
+	bool started_;
+	uint32_t stream_;
+	uint32_t next_;
+	uint64_t present_;	//bit i: frame next_ + i is held in slots_
+	std::vector<Datagram> slots_;
+	size_t delivered_;
+	size_t duplicates_;
+	size_t reordered_;
+	size_t skipped_;
+	size_t discarded_;
+};
+
+
+
+//Both halves of the reliable conversation with one peer, plus ack generation.
+//Not thread safe; the channel serialises access.
+class ReliableLink
+{
+public:
+	using Clock = ReliableSender::Clock;
+
+	struct Stats
+	{
+		ReliableSender::Stats send;
+		ReliableReceiver::Stats receive;
+		size_t acks_sent;
+		size_t acks_received;
+	};
+
+	ReliableLink(const uint32_t sender_id, const ReliableOptions& options)
+		: sender_(sender_id, options)
+		, ack_pending_(false)
+		, acks_sent_(0)
+		, acks_received_(0)
+	{}
+
+	bool Queue(const char* payload, const size_t length) { return sender_.Queue(payload, length); }
+
+	template<class Send>
+	void Poll(const Clock::time_point now, Send send) { sender_.Poll(now, send); }
+
+	//Takes a FrameFlagReliable or FrameFlagAck frame from the peer; data frames
+	//that are now in order are appended to ready
+	void OnFrame(const FrameHeader& header, const char* payload, const Datagram& datagram, std::vector<Datagram>& ready, const Clock::time_point now)
+	{
+		if (header.flags & FrameFlagAck)
+		{
+			if (header.payload_length != AckPayloadSize)
+				return;
+			acks_received_++;
+			const uint64_t sack = (static_cast<uint64_t>(frame_detail::Get32(payload)) << 32) | frame_detail::Get32(payload + 4);
+			sender_.OnAck(header.sender_id, header.sequence, sack, now);
+			return;
+		}
+
+		receiver_.Accept(header, datagram, ready);
+		ack_pending_ = true;
+	}
+
+	//The ack to send if frames arrived since the last one, or null. Valid until the next call.
+	const std::string* TakeAck()
+	{
+		if (!ack_pending_)
+			return nullptr;
+
+		ack_pending_ = false;
+		acks_sent_++;
+		ack_.resize(FrameHeaderSize + AckPayloadSize);
+		EncodeFrameHeader(FrameHeader{ FrameVersion, FrameFlagAck, receiver_.Stream(), receiver_.Cumulative(), static_cast<uint16_t>(AckPayloadSize), 0 }, &ack_[0]);
+		const uint64_t sack = receiver_.Sack();
+		frame_detail::Put32(&ack_[FrameHeaderSize], static_cast<uint32_t>(sack >> 32));
+		frame_detail::Put32(&ack_[FrameHeaderSize + 4], static_cast<uint32_t>(sack));
+		return &ack_;
+	}
+
+	Stats GetStats() const
+	{
+		return Stats{ sender_.GetStats(), receiver_.GetStats(), acks_sent_, acks_received_ };
+	}
+
+private:
+	ReliableSender sender_;
+	ReliableReceiver receiver_;
+	bool ack_pending_;
+	std::string ack_;
+	size_t acks_sent_;
+	size_t acks_received_;
+};
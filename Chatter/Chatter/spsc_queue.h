@@ -0,0 +1,121 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+
+//Bounded lock-free single-producer/single-consumer ring.
+//Exactly one thread may push and exactly one (other) thread may pop.
+//Capacity is rounded up to a power of two. Producer and consumer indices
+//live on separate cache lines, and each side caches the other's index so
+//the shared line is only touched when the ring looks full/empty.
+template<class T>
+class SpscQueue
+{
+public:
+	explicit SpscQueue(const size_t capacity)
+		: mask_(RoundUpToPowerOfTwo(capacity) - 1)
+		, slots_(mask_ + 1)
+	{
+		producer_.index.store(0, std::memory_order_relaxed);
+		producer_.cached = 0;
+		consumer_.index.store(0, std::memory_order_relaxed);
+		consumer_.cached = 0;
+	}
+
+	SpscQueue(const SpscQueue&) = delete;
+	SpscQueue& operator= (const SpscQueue&) = delete;
+
+
+	size_t Capacity() const { return mask_ + 1; }
+
+
+	size_t SizeApprox() const
+	{
+		return producer_.index.load(std::memory_order_acquire) - consumer_.index.load(std::memory_order_acquire);
+	}
+
+
+	//Producer side. Returns false without blocking when the ring is full.
+	bool TryPush(T&& item)
+	{
+		const size_t tail = producer_.index.load(std::memory_order_relaxed);
+		if (tail - producer_.cached > mask_)
+		{
+			producer_.cached = consumer_.index.load(std::memory_order_acquire);
+			if (tail - producer_.cached > mask_)
+				return false;
+		}
+
+		slots_[tail & mask_] = std::move(item);
+		producer_.index.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+
+	//Consumer side. Returns false when the ring is empty.
+	bool TryPop(T& item)
+	{
+		const size_t head = consumer_.index.load(std::memory_order_relaxed);
+		if (head == consumer_.cached)
+		{
+			consumer_.cached = producer_.index.load(std::memory_order_acquire);
+			if (head == consumer_.cached)
+				return false;
+		}
+
+		item = std::move(slots_[head & mask_]);
+		consumer_.index.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+
+	//Consumer side. Hands every item currently queued (up to max) to fn and
+	//publishes the new head once for the whole batch. Returns the number consumed.
+	template<class Fn>
+	size_t ConsumeAll(Fn fn, const size_t max = ~size_t(0))
+	{
+		const size_t head = consumer_.index.load(std::memory_order_relaxed);
+		consumer_.cached = producer_.index.load(std::memory_order_acquire);
+
+		size_t n = consumer_.cached - head;
+		if (n > max)
+			n = max;
+
+		for (size_t i = 0; i < n; ++i)
+		{
+			T item(std::move(slots_[(head + i) & mask_]));
+			fn(item);
+		}
+
+		if (n)
+			consumer_.index.store(head + n, std::memory_order_release);
+		return n;
+	}
+
+
+private:
+	static size_t RoundUpToPowerOfTwo(const size_t n)
+	{
+		size_t p = 1;
+		while (p < n)
+			p <<= 1;
+		return p;
+	}
+
+	static constexpr const size_t CacheLine = 64;
+
+	//Own index plus a cached copy of the other side's, padded to a cache line
+	struct Side
+	{
+		std::atomic<size_t> index;
+		size_t cached;
+		char pad[CacheLine - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+	};
+
+	const size_t mask_;
+	std::vector<T> slots_;
+	char pad_[CacheLine];
+	Side producer_;
+	Side consumer_;
+};
@@ -0,0 +1,283 @@
+#pragma once
+#include <chrono>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+
+//Hierarchical timing wheel. Level 0 has a slot per tick and every level above
+//has slots Slots times wider, so Levels levels reach Slots^Levels ticks ahead
+//(79 days of 100us ticks). A timer is filed in the lowest level that reaches
+//its due tick. Each time level 0 starts a turn, the next slot of the level
+//above is emptied into the levels below, so a timer moves at most Levels - 1
+//times and scheduling, cancelling and firing are all O(1). Timers further out
+//wait in the top level and are refiled as it comes round.
+//Timers live in a pool of nodes that are reused, so once the pool has grown
+//to the most timers ever pending, nothing allocates. Times are in nanoseconds
+//on the caller's clock; timers fire at tick granularity and never early.
+//Not thread safe.
+template<class T>
+class TimerWheel
+{
+public:
+	//Names one scheduled timer; never 0, and never reused for a later one
+	using TimerId = uint64_t;
+
+	TimerWheel(const std::chrono::nanoseconds tick, const size_t capacity, const int64_t now = 0)
+		: tick_(tick.count() > 0 ? tick.count() : 1)
+		, next_(now / tick_ + 1)
+		, free_(Nil)
+		, size_(0)
+	{
+		for (auto& slot : slots_)
+			slot = List{ Nil, Nil };
+		for (auto& count : counts_)
+			count = 0;
+		nodes_.reserve(capacity);
+	}
+
+	TimerWheel(const TimerWheel&) = delete;
+	TimerWheel& operator= (const TimerWheel&) = delete;
+
+
+	size_t Size() const { return size_; }
+	bool Empty() const { return size_ == 0; }
+
+
+	TimerId Schedule(const int64_t when, T value)
+	{
+		const uint32_t index = NewNode();
+		Node& node = nodes_[index];
+		node.value = std::move(value);
+
+		//Due ticks are rounded up, and anything already due fires on the next one
+		const int64_t due = (when + tick_ - 1) / tick_;
+		node.due = due < next_ ? next_ : due;
+		File(index);
+		size_++;
+		return (static_cast<uint64_t>(node.generation) << 32) | index;
+	}
+
+
+	//Returns false when the timer has fired or was cancelled already
+	bool Cancel(const TimerId id)
+	{
+		const uint32_t index = static_cast<uint32_t>(id);
+		if (index >= nodes_.size() || nodes_[index].generation != static_cast<uint32_t>(id >> 32) || nodes_[index].slot == Free)
+			return false;
+
+		Unlink(index);
+		nodes_[index].value = T();
+		FreeNode(index);
+		return true;
+	}
+
+
+	//Calls fn(T&) for every timer due by now, in the order of their ticks.
+	//Within a tick, timers scheduled equally far ahead keep their order.
+	//Returns how many fired.
+	template<class Fn>
+	size_t Advance(const int64_t now, Fn fn)
+	{
+		const int64_t target = now / tick_;
+		size_t fired = 0;
+		while (next_ <= target)
+		{
+			//Nothing left to find: jump instead of visiting every empty slot
+			if (!size_)
+			{
+				next_ = target + 1;
+				break;
+			}
+
+			const int64_t tick = next_;
+			if ((tick & Mask) == 0)
+			{
+				for (unsigned level = 1; level < Levels; ++level)
+				{
+					const size_t slot = static_cast<size_t>(tick >> (Bits * level)) & Mask;
+					Cascade(level, slot);
+					if (slot)
+						break;
+				}
+			}
+
+			//Nothing can fire before the lowest level in use is next cascaded
+			const int64_t skip_to = NextCascade(tick + 1);
+			if (skip_to > tick + 1)
+			{
+				next_ = skip_to <= target ? skip_to : target + 1;
+				continue;
+			}
+
+			//fn may schedule and cancel timers: the tick is passed first, so new
+			//ones go behind those due now, and each is unlinked before it fires
+			List& slot = slots_[static_cast<size_t>(tick) & Mask];
+			next_ = tick + 1;
+			while (slot.head != Nil && nodes_[slot.head].due == tick)
+			{
+				const uint32_t index = slot.head;
+				Unlink(index);
+				T value(std::move(nodes_[index].value));	//fn may also move the nodes
+				nodes_[index].value = T();
+				FreeNode(index);
+				fn(value);
+				fired++;
+			}
+		}
+		return fired;
+	}
+
+
+	//When Advance() next has something to do: the earliest due tick in the
+	//current turn of level 0 or, failing that, when the levels above next
+	//refill it. Returns -1 when no timers are pending.
+	int64_t NextWakeup() const
+	{
+		if (!size_)
+			return -1;
+		if (!counts_[0])
+			return NextCascade(next_) * tick_;
+
+		const int64_t turn_end = (next_ | Mask) + 1;
+		for (int64_t tick = next_; tick < turn_end; ++tick)
+		{
+			if (slots_[static_cast<size_t>(tick) & Mask].head != Nil)
+				return tick * tick_;
+		}
+		return turn_end * tick_;
+	}
+
+
+private:
+	static constexpr const unsigned Bits = 6;
+	static constexpr const unsigned Levels = 6;
+	static constexpr const size_t Slots = size_t(1) << Bits;
+	static constexpr const int64_t Mask = Slots - 1;
+	static constexpr const uint32_t Nil = ~uint32_t(0);
+	static constexpr const uint16_t Free = 0xFFFF;
+
+	struct Node
+	{
+		T value;
+		int64_t due;			//tick
+		uint32_t prev;
+		uint32_t next;			//in the slot's list, or the free list
+		uint32_t generation;	//tells this timer from earlier ones in the same node
+		uint16_t slot;			//level * Slots + index, or Free
+	};
+
+	struct List
+	{
+		uint32_t head;
+		uint32_t tail;
+	};
+
+
+	//Files a node by how far ahead of next_ it is due
+	void File(const uint32_t index)
+	{
+		Node& node = nodes_[index];
+		const int64_t ahead = node.due - next_;
+		unsigned level = 0;
+		while (level + 1 < Levels && (ahead >> (Bits * (level + 1))) != 0)
+			level++;
+
+		//Beyond the top level's reach: wait in its furthest slot
+		int64_t due = node.due;
+		if ((ahead >> (Bits * Levels)) != 0)
+			due = next_ + (int64_t(1) << (Bits * Levels)) - 1;
+
+		node.slot = static_cast<uint16_t>(level * Slots + (static_cast<size_t>(due >> (Bits * level)) & Mask));
+		counts_[level]++;
+		node.next = Nil;
+		List& list = slots_[node.slot];
+		node.prev = list.tail;
+		if (list.tail == Nil)
+			list.head = index;
+		else
+			nodes_[list.tail].next = index;
+		list.tail = index;
+	}
+
+
+	//With level 0 empty, the first tick from tick on at which the lowest level
+	//in use is cascaded; before it nothing can fire. Otherwise tick itself.
+	int64_t NextCascade(const int64_t tick) const
+	{
+		unsigned lowest = 0;
+		while (lowest < Levels && !counts_[lowest])
+			lowest++;
+		if (!lowest || lowest == Levels)
+			return tick;
+		const int64_t span = int64_t(1) << (Bits * lowest);
+		return (tick + span - 1) & ~(span - 1);
+	}
+
+
+	void Unlink(const uint32_t index)
+	{
+		Node& node = nodes_[index];
+		counts_[node.slot / Slots]--;
+		List& list = slots_[node.slot];
+		if (node.prev == Nil)
+			list.head = node.next;
+		else
+			nodes_[node.prev].next = node.next;
+		if (node.next == Nil)
+			list.tail = node.prev;
+		else
+			nodes_[node.next].prev = node.prev;
+	}
+
+
+	//Refiles a slot of a higher level into the levels below it
+	void Cascade(const unsigned level, const size_t slot)
+	{
+		List& list = slots_[level * Slots + slot];
+		uint32_t index = list.head;
+		list = List{ Nil, Nil };
+		while (index != Nil)
+		{
+			const uint32_t next = nodes_[index].next;
+			counts_[level]--;
+			File(index);
+			index = next;
+		}
+	}
+
+
+	uint32_t NewNode()
+	{
+		if (free_ == Nil)
+		{
+			nodes_.emplace_back();
+			nodes_.back().generation = 1;
+			return static_cast<uint32_t>(nodes_.size() - 1);
+		}
+		const uint32_t index = free_;
+		free_ = nodes_[index].next;
+		return index;
+	}
+
+	void FreeNode(const uint32_t index)
+	{
+		Node& node = nodes_[index];
+		node.slot = Free;
+		if (++node.generation == 0)
+			node.generation = 1;
+		node.next = free_;
+		free_ = index;
+		size_--;
+	}
+
+
+	const int64_t tick_;	//nanoseconds
+	int64_t next_;			//next tick to fire
+	List slots_[Levels * Slots];
+	std::vector<Node> nodes_;
+	uint32_t free_;
+	size_t size_;			//timers pending
+	size_t counts_[Levels];	//of which in each level
+};
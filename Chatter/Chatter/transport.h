@@ -2,17 +2,34 @@
 
 #ifdef WIN32
 #include <winsock2.h>
+#include <ws2tcpip.h>
 #pragma comment(lib, "ws2_32.lib")
 #else
 #include <arpa/inet.h>
+#include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h> 
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
 #endif
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <poll.h>
+#include <netinet/udp.h>
+#endif
 
+#include "buffer_pool.h"
+#include "log.h"
+#include "uring.h"
 #include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <cstring>
+#include <utility>
 
 #ifdef WIN32
 #define GetLastError()	WSAGetLastError()
@@ -47,18 +64,18 @@ private:
 	{
 		if (status != 0)
 		{
-			printf("WSAStartup failed with error: %d\n", status);
+			CHATTER_ERROR("WSAStartup failed with error: %d", status);
 		}
 		else
 		{
-			printf("WinSock initialised successfully.\n");
+			CHATTER_INFO("WinSock initialised successfully.");
 		}
 	}
 
 	~TransportService()
 	{
 		WSACleanup();
-		printf("WinSock API closed\n");
+		CHATTER_INFO("WinSock API closed");
 	}
 
 	TransportService(const TransportService&) = delete;
@@ -74,11 +91,220 @@ private:
 
 
 
+//A datagram in flight: where it came from / goes to and a view of its payload.
+//Received datagrams also hold a reference to the pool buffer the kernel wrote
+//into, so the payload can be handed on without copying.
+struct Datagram
+{
+	sockaddr_in remote;
+	const char* data;
+	size_t size;
+	bool truncated;
+	BufferRef buffer;
+};
+
+
+//A view of bytes to send; several make up one datagram in a gathered send
+struct IoSpan
+{
+	const char* data;
+	size_t size;
+};
+
+
+//An outgoing datagram the kernel gathers from parts, e.g. a frame header and
+//the message body it describes, so they never have to be copied together
+struct GatherDatagram
+{
+	sockaddr_in remote;
+	const IoSpan* parts;
+	size_t count;
+};
+
+
+//Receive slots for UdpSocket::RecvBatch. Message headers are allocated once
+//and every slot is backed by a buffer from the socket's BufferPool, so the
+//receive hot path performs no heap allocations. A slot holding datagrams the
+//kernel coalesced (UDP_GRO) yields one Datagram per original datagram, so a
+//batch may return more than Capacity().
+class DatagramBatch
+{
+public:
+	DatagramBatch(const size_t capacity = 32)
+		: datagrams_(capacity)
+		, slots_(capacity)
+		, count_(0)
+#ifndef WIN32
+		, addresses_(capacity)
+		, iovecs_(capacity)
+		, controls_(capacity)
+		, headers_(capacity)
+#endif
+	{
+#ifndef WIN32
+		for (size_t i = 0; i < capacity; ++i)
+		{
+			headers_[i].msg_hdr.msg_name = &addresses_[i];
+			headers_[i].msg_hdr.msg_iov = &iovecs_[i];
+			headers_[i].msg_hdr.msg_iovlen = 1;
+		}
+#endif
+	}
+
+	size_t Capacity() const { return slots_.size(); }
+	size_t Size() const { return count_; }
+	const Datagram& operator[](const size_t i) const { return datagrams_[i]; }
+	const Datagram* begin() const { return datagrams_.data(); }
+	const Datagram* end() const { return datagrams_.data() + count_; }
+
+private:
+	friend struct UdpSocket;
+
+	//Drops the previous results
+	void Reset()
+	{
+		for (size_t i = 0; i < count_; ++i)
+			datagrams_[i].buffer = BufferRef();
+		count_ = 0;
+	}
+
+	//As Reset(), then tops up any slot whose buffer was handed out
+	void Refill(BufferPool& pool)
+	{
+		Reset();
+		for (size_t i = 0; i < slots_.size(); ++i)
+		{
+			if (!slots_[i])
+				slots_[i] = pool.Acquire();
+#ifndef WIN32
+			iovecs_[i].iov_base = slots_[i].data();
+			iovecs_[i].iov_len = slots_[i].capacity();
+			headers_[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+			headers_[i].msg_hdr.msg_control = controls_[i].data;
+			headers_[i].msg_hdr.msg_controllen = sizeof controls_[i].data;
+			headers_[i].msg_hdr.msg_flags = 0;
+#endif
+		}
+	}
+
+	Datagram& Next()
+	{
+		if (count_ == datagrams_.size())
+			datagrams_.emplace_back();
+		return datagrams_[count_++];
+	}
+
+	void Emit(const size_t i, const sockaddr_in& remote, const size_t size, const bool truncated)
+	{
+		auto& d = Next();
+		slots_[i].resize(size);
+		d.remote = remote;
+		d.data = slots_[i].data();
+		d.size = slots_[i].size();
+		d.truncated = truncated;
+		d.buffer = std::move(slots_[i]);
+	}
+
+	//For datagrams received into a buffer that did not come from a slot
+	void Emit(const sockaddr_in& remote, BufferRef&& buffer, const bool truncated)
+	{
+		auto& d = Next();
+		d.remote = remote;
+		d.data = buffer.data();
+		d.size = buffer.size();
+		d.truncated = truncated;
+		d.buffer = std::move(buffer);
+	}
+
+	//A coalesced datagram, split back into datagrams of segment bytes (the last
+	//may be shorter), all viewing the one buffer
+	void EmitSegments(BufferRef&& buffer, const sockaddr_in& remote, const size_t segment, const bool truncated)
+	{
+		const size_t size = buffer.size();
+		for (size_t offset = 0; offset < size; offset += segment)
+			Emit(remote, buffer.Slice(offset, segment), truncated && offset + segment >= size);
+	}
+
+#ifndef WIN32
+	//Room for the UDP_GRO segment size
+	struct Control
+	{
+		alignas(cmsghdr) char data[CMSG_SPACE(sizeof(int))];
+	};
+#endif
+
+	std::vector<Datagram> datagrams_;
+	std::vector<BufferRef> slots_;
+	size_t count_;
+#ifndef WIN32
+	std::vector<sockaddr_in> addresses_;
+	std::vector<iovec> iovecs_;
+	std::vector<Control> controls_;
+	std::vector<mmsghdr> headers_;
+#endif
+};
+
+
+
+//How a UdpSocket receives. Syscall uses recvmmsg on readiness; IoUring (Linux 6.0
+//and later) keeps one multishot recvmsg outstanding that the kernel completes
+//into pool buffers provided to it up front, so a burst is drained with one
+//io_uring_enter that also hands the used buffers back. A kernel that turns the
+//receive down makes the socket fall back to Syscall. Sends always use sendmmsg.
+enum class SocketBackend { Syscall, IoUring };
+
+
+//Kernel tuning applied when a UdpSocket is created. Zero (or -1 where noted)
+//keeps the kernel default. Options a platform lacks are skipped. The kernel
+//may adjust what was asked for (Linux doubles buffer sizes and caps them at
+//net.core.rmem_max/wmem_max), so read the effective values back with
+//UdpSocket::EffectiveOptions().
+struct SocketOptions
+{
+	SocketOptions()
+		: receive_buffer(0)
+		, send_buffer(0)
+		, busy_poll_us(0)
+		, reuse_address(true)
+		, reuse_port(false)
+		, tos(-1)
+		, priority(-1)
+		, backend(SocketBackend::Syscall)
+		, zerocopy(false)
+		, gso(false)
+		, gro(false)
+	{}
+
+	int receive_buffer;	//SO_RCVBUF bytes
+	int send_buffer;	//SO_SNDBUF bytes
+	int busy_poll_us;	//SO_BUSY_POLL, Linux
+	bool reuse_address;	//SO_REUSEADDR
+	bool reuse_port;	//SO_REUSEPORT, not on Windows
+	int tos;			//IP_TOS, -1 for default
+	int priority;		//SO_PRIORITY, Linux, -1 for default
+	SocketBackend backend;	//falls back to Syscall where io_uring is unavailable
+	bool zerocopy;		//SO_ZEROCOPY, Linux, lets UdpSocket::SendZeroCopy() skip the copy
+	bool gso;			//UDP_SEGMENT, Linux, UdpSocket::SendSegmented() hands the kernel many datagrams at once
+	bool gro;			//UDP_GRO, Linux, the kernel may coalesce datagrams of a flow; they are split again on receipt
+};
+
+
+
 struct UdpSocket
 {
-	UdpSocket(const unsigned short port = 0, const char* const ip = nullptr)
+	UdpSocket(const unsigned short port = 0, const char* const ip = nullptr
+		, const size_t pool_buffers = 256, const size_t pool_buffer_size = 2048)
+		: UdpSocket(port, ip, SocketOptions(), pool_buffers, pool_buffer_size)
+	{}
+
+
+	UdpSocket(const unsigned short port, const char* const ip, const SocketOptions& options
+		, const size_t pool_buffers = 256, const size_t pool_buffer_size = 2048)
 		: endpoint({ 0 })
 		, sockfd(INVALID_SOCKET)
+		, pool(pool_buffers, pool_buffer_size)
+		, gso(false)
+		, gro(false)
 	{
 		endpoint.sin_family = AF_INET;
 		endpoint.sin_port = htons(port);
@@ -93,35 +319,61 @@ struct UdpSocket
 
 		if (sockfd == INVALID_SOCKET)
 		{
-			printf("socket failed: %d\n", GetLastError());
+			CHATTER_ERROR("socket failed: %d", GetLastError());
 			return;
 		}
 
 
-		char flag = 1;
-		setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(char));
+		ApplyOptions(options);
 
-		//non-blocking
+		//non-blocking, readiness is signalled by the Reactor
 #ifdef WIN32
 		u_long mode = 1; // 1: NON-BLOCKING, 0:BLOCKING
 		ioctlsocket(sockfd, FIONBIO, &mode);
 #else
-		struct timeval read_timeout;
-		read_timeout.tv_sec = 0;
-		read_timeout.tv_usec = 10;
-		setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &read_timeout, sizeof read_timeout);
+		fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
 #endif
+
+		if (options.backend == SocketBackend::IoUring)
+			StartUring(pool_buffers);
 	}
 
 
 	bool IsOpen() const { return sockfd != INVALID_SOCKET; }
+	SOCKET Handle() const { return sockfd; }
+	BufferPool& Pool() { return pool; }
+	const sockaddr_in& LocalEndpoint() const { return endpoint; }
+	BufferPool::Stats PoolStats() const { return pool.GetStats(); }
+
+
+	//What to hand to Reactor::Watch(): the socket itself, or the io_uring it receives through.
+	//With io_uring the first RecvBatch() call arms the receive, so make it from the
+	//thread that will keep receiving (Reactor::Run() does this for its handlers).
+	//The ring stays the handle after a fall back to system calls; it then polls the socket.
+	SOCKET EventHandle() const
+	{
+#ifdef __linux__
+		if (uring)
+			return uring->ring.Handle();
+#endif
+		return sockfd;
+	}
+
+	SocketBackend Backend() const
+	{
+#ifdef __linux__
+		if (uring && !uring->fallen_back)
+			return SocketBackend::IoUring;
+#endif
+		return SocketBackend::Syscall;
+	}
 
 
 	bool Bind()
 	{
 		if (bind(sockfd, reinterpret_cast<sockaddr*>(&endpoint), sizeof(sockaddr_in)) == SOCKET_ERROR)
 		{
-			printf("Bind failed with error code: %d\n", GetLastError());
+			CHATTER_ERROR("Bind failed with error code: %d", GetLastError());
 			return false;
 		}
 		else
@@ -131,16 +383,156 @@ struct UdpSocket
 
 			if (getsockname(sockfd, reinterpret_cast<sockaddr*>(&endpoint), &len) < 0)
 			{
-				printf("Error getsockname: %d\n", GetLastError());
+				CHATTER_ERROR("Error getsockname: %d", GetLastError());
 				return false;
 			}
 
-			printf("Socket<%d> bound to ip %s on port %d\n", sockfd, inet_ntoa(endpoint.sin_addr), ntohs(endpoint.sin_port));
+			CHATTER_INFO("Socket<%d> bound to %s", static_cast<int>(sockfd), endpoint);
 			return true;
 		}
 	}
 
 
+	//Returns false if any requested option was refused; the others are still applied
+	bool ApplyOptions(const SocketOptions& options)
+	{
+		bool ok = SetReuseAddress(options.reuse_address);
+		if (options.receive_buffer > 0)
+		{
+			ok &= SetOption(SOL_SOCKET, SO_RCVBUF, options.receive_buffer, "SO_RCVBUF");
+#ifdef SO_RCVBUFFORCE
+			//Privileged processes may exceed net.core.rmem_max
+			if (EffectiveOptions().receive_buffer < options.receive_buffer)
+				setsockopt(sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &options.receive_buffer, sizeof(int));
+#endif
+		}
+		if (options.send_buffer > 0)
+		{
+			ok &= SetOption(SOL_SOCKET, SO_SNDBUF, options.send_buffer, "SO_SNDBUF");
+#ifdef SO_SNDBUFFORCE
+			if (EffectiveOptions().send_buffer < options.send_buffer)
+				setsockopt(sockfd, SOL_SOCKET, SO_SNDBUFFORCE, &options.send_buffer, sizeof(int));
+#endif
+		}
+#ifdef SO_BUSY_POLL
+		if (options.busy_poll_us > 0)
+			ok &= SetOption(SOL_SOCKET, SO_BUSY_POLL, options.busy_poll_us, "SO_BUSY_POLL");
+#endif
+#ifdef SO_REUSEPORT
+		if (options.reuse_port)
+			ok &= SetOption(SOL_SOCKET, SO_REUSEPORT, 1, "SO_REUSEPORT");
+#endif
+		if (options.tos >= 0)
+			ok &= SetOption(IPPROTO_IP, IP_TOS, options.tos, "IP_TOS");
+#ifdef SO_PRIORITY
+		if (options.priority >= 0)
+			ok &= SetOption(SOL_SOCKET, SO_PRIORITY, options.priority, "SO_PRIORITY");
+#endif
+#ifdef SO_ZEROCOPY
+		if (options.zerocopy)
+		{
+			zerocopy.enabled = SetOption(SOL_SOCKET, SO_ZEROCOPY, 1, "SO_ZEROCOPY");
+			ok &= zerocopy.enabled;
+		}
+#endif
+#ifdef UDP_SEGMENT
+		//Kernels without GSO do not know the option
+		if (options.gso)
+		{
+			gso = GetOption(SOL_UDP, UDP_SEGMENT, -1) >= 0;
+			if (!gso)
+				CHATTER_WARN("UDP_SEGMENT not supported, sending segments one datagram at a time");
+			ok &= gso;
+		}
+#endif
+#ifdef UDP_GRO
+		if (options.gro)
+		{
+			gro = SetOption(SOL_UDP, UDP_GRO, 1, "UDP_GRO");
+			ok &= gro;
+		}
+#endif
+
+#if CHATTER_LOG_LEVEL <= CHATTER_LOG_LEVEL_INFO
+		const auto effective = EffectiveOptions();
+		CHATTER_INFO("Socket<%d> rcvbuf %d, sndbuf %d, busy poll %dus, reuseaddr %d, reuseport %d, tos %d, priority %d, zerocopy %d, gso %d, gro %d"
+			, static_cast<int>(sockfd), effective.receive_buffer, effective.send_buffer, effective.busy_poll_us
+			, effective.reuse_address, effective.reuse_port, effective.tos, effective.priority, effective.zerocopy
+			, effective.gso, effective.gro);
+#endif
+		return ok;
+	}
+
+
+	//What the kernel actually applied; options a platform lacks read as 0 / false / -1
+	SocketOptions EffectiveOptions() const
+	{
+		SocketOptions options;
+		options.receive_buffer = GetOption(SOL_SOCKET, SO_RCVBUF, 0);
+		options.send_buffer = GetOption(SOL_SOCKET, SO_SNDBUF, 0);
+		options.reuse_address = GetOption(SOL_SOCKET, SO_REUSEADDR, 0) != 0;
+		options.tos = GetOption(IPPROTO_IP, IP_TOS, -1);
+#ifdef SO_BUSY_POLL
+		options.busy_poll_us = GetOption(SOL_SOCKET, SO_BUSY_POLL, 0);
+#endif
+#ifdef SO_REUSEPORT
+		options.reuse_port = GetOption(SOL_SOCKET, SO_REUSEPORT, 0) != 0;
+#endif
+#ifdef SO_PRIORITY
+		options.priority = GetOption(SOL_SOCKET, SO_PRIORITY, -1);
+#endif
+#ifdef SO_ZEROCOPY
+		options.zerocopy = GetOption(SOL_SOCKET, SO_ZEROCOPY, 0) != 0;
+#endif
+#ifdef UDP_GRO
+		options.gro = GetOption(SOL_UDP, UDP_GRO, 0) != 0;
+#endif
+		options.gso = gso;
+		options.backend = Backend();
+		return options;
+	}
+
+
+	//Lets several sockets on this host bind the same multicast group and port
+	bool SetReuseAddress(const bool enabled)
+	{
+		const int flag = enabled ? 1 : 0;
+		return SetOption(SOL_SOCKET, SO_REUSEADDR, flag, "SO_REUSEADDR");
+	}
+
+
+	bool JoinMulticastGroup(const char* const group, const char* const interface_ip)
+	{
+		ip_mreq request = { 0 };
+		request.imr_multiaddr.s_addr = inet_addr(group);
+		request.imr_interface.s_addr = interface_ip ? inet_addr(interface_ip) : INADDR_ANY;
+		return SetOption(IPPROTO_IP, IP_ADD_MEMBERSHIP, request, "IP_ADD_MEMBERSHIP");
+	}
+
+
+	//Outgoing interface for multicast datagrams
+	bool SetMulticastInterface(const char* const interface_ip)
+	{
+		in_addr address = { 0 };
+		address.s_addr = interface_ip ? inet_addr(interface_ip) : INADDR_ANY;
+		return SetOption(IPPROTO_IP, IP_MULTICAST_IF, address, "IP_MULTICAST_IF");
+	}
+
+
+	//Whether our own multicast datagrams are looped back to listeners on this host
+	bool SetMulticastLoopback(const bool enabled)
+	{
+		const int flag = enabled ? 1 : 0;
+		return SetOption(IPPROTO_IP, IP_MULTICAST_LOOP, flag, "IP_MULTICAST_LOOP");
+	}
+
+
+	bool SetMulticastTtl(const int ttl)
+	{
+		return SetOption(IPPROTO_IP, IP_MULTICAST_TTL, ttl, "IP_MULTICAST_TTL");
+	}
+
+
 	template<class Container>
 	int SendTo(const char* const destIp, const Container& data)
 	{
@@ -155,13 +547,13 @@ struct UdpSocket
 	template<class Container>
 	int SendTo(const sockaddr_in& remote, const Container& data)
 	{
-		printf("TX: {%s;%d} (%lu bytes) => ", inet_ntoa(remote.sin_addr), ntohs(remote.sin_port), data.size());
+		CHATTER_DEBUG("TX: %s (%lu bytes)", remote, static_cast<unsigned long>(data.size()));
 
 		int rc = sendto(sockfd, reinterpret_cast<const char*>(&data[0]), data.size(), 0, reinterpret_cast<const sockaddr*>(&remote), sizeof(sockaddr_in));
 
 		if (rc == SOCKET_ERROR)
 		{
-			printf("sendto() failed with error code : %d\n", GetLastError());
+			CHATTER_ERROR("sendto() failed with error code : %d", GetLastError());
 		}
 
 		return rc;
@@ -169,27 +561,148 @@ struct UdpSocket
 
 
 
+	//Sends up to MaxGatherParts parts as one datagram with a single sendmsg
+	int SendTo(const sockaddr_in& remote, const IoSpan* const parts, const size_t count)
+	{
+		CHATTER_DEBUG("TX: %s (%lu parts)", remote, static_cast<unsigned long>(count));
+		return SendGathered(remote, parts, count, 0);
+	}
+
+
+	//As above, but with SocketOptions::zerocopy the kernel sends straight from the
+	//buffers' pages instead of copying them. parts stay referenced until the kernel
+	//reports it is done with them, see ReapZeroCopy(). Pinning pages costs more
+	//than copying a few kilobytes, so this is for large datagrams.
+	int SendZeroCopy(const sockaddr_in& remote, const BufferRef* const parts, const size_t count)
+	{
+		if (count > MaxGatherParts)
+		{
+			CHATTER_ERROR("sendmsg() of %lu parts, at most %lu supported", static_cast<unsigned long>(count), static_cast<unsigned long>(MaxGatherParts));
+			return SOCKET_ERROR;
+		}
+
+		IoSpan spans[MaxGatherParts];
+		for (size_t i = 0; i < count; ++i)
+			spans[i] = IoSpan{ parts[i].data(), parts[i].size() };
+		if (!zerocopy.enabled)
+			return SendTo(remote, spans, count);
+
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+		CHATTER_DEBUG("TX: %s (%lu parts, zerocopy)", remote, static_cast<unsigned long>(count));
+		ReapZeroCopy();
+
+		//The kernel numbers zero-copy sends in the order it accepts them
+		std::lock_guard<std::mutex> lock(zerocopy.mutex);
+		const int rc = SendGathered(remote, spans, count, MSG_ZEROCOPY);
+		if (rc != SOCKET_ERROR)
+		{
+			zerocopy.pending.emplace_back();
+			auto& send = zerocopy.pending.back();
+			send.id = zerocopy.next_id++;
+			std::copy(parts, parts + count, send.parts);
+			zerocopy.sent++;
+			zerocopy.outstanding = zerocopy.pending.size();
+		}
+		return rc;
+#else
+		return SendTo(remote, spans, count);
+#endif
+	}
+
+
+	//Releases the buffers of zero-copy sends the kernel has finished with and
+	//returns how many there were. RecvBatch() calls this too: until they are read,
+	//the notifications keep the socket signalling an error condition to the Reactor.
+	size_t ReapZeroCopy()
+	{
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+		std::lock_guard<std::mutex> lock(zerocopy.mutex);
+		size_t completed = 0;
+		for (;;)
+		{
+			char control[128];
+			msghdr msg = {};
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof control;
+			if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == SOCKET_ERROR)
+				break;
+
+			for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+			{
+				if (c->cmsg_level != SOL_IP || c->cmsg_type != IP_RECVERR)
+					continue;
+				sock_extended_err error;
+				memcpy(&error, CMSG_DATA(c), sizeof error);
+				if (error.ee_origin != SO_EE_ORIGIN_ZEROCOPY || error.ee_errno != 0)
+					continue;
+
+				//sends ee_info to ee_data inclusive are done
+				const uint32_t span = error.ee_data - error.ee_info;
+				if (error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+					zerocopy.copied += span + 1;
+				for (auto it = zerocopy.pending.begin(); it != zerocopy.pending.end();)
+				{
+					if (it->id - error.ee_info <= span)
+					{
+						it = zerocopy.pending.erase(it);
+						completed++;
+					}
+					else
+					{
+						++it;
+					}
+				}
+			}
+		}
+		zerocopy.completed += completed;
+		zerocopy.outstanding = zerocopy.pending.size();
+		return completed;
+#else
+		return 0;
+#endif
+	}
+
+
+	struct ZeroCopyStats
+	{
+		size_t sent;
+		size_t completed;
+		size_t copied;		//completed, but the kernel had to copy after all (e.g. loopback)
+		size_t outstanding;	//still holding their buffers
+	};
+
+	ZeroCopyStats GetZeroCopyStats() const
+	{
+		return ZeroCopyStats{ zerocopy.sent.load(), zerocopy.completed.load(), zerocopy.copied.load(), zerocopy.outstanding.load() };
+	}
+
+
 	template<class Container>
 	std::pair<sockaddr_in, Container> RecvFrom(const size_t buffer_size)
 	{
+#ifdef __linux__
+		if (uring || gro)
+		{
+			auto received = RecvFrom();
+			Container data(received.second.data(), received.second.data() + (received.second.size() < buffer_size ? received.second.size() : buffer_size));
+			return std::pair<sockaddr_in, Container>(received.first, data);
+		}
+#endif
 		Container data;
 		data.resize(buffer_size);
 
 		sockaddr_in remote = { 0 };
 		auto len = static_cast<socklen_t>(sizeof(sockaddr_in));
 
-		//printf("Listening on port %d...\n", ntohs(endpoint.sin_port));
-
 		int rc = recvfrom(sockfd, reinterpret_cast<char*>(&data[0]), buffer_size, 0, reinterpret_cast<sockaddr*>(&remote), &len);
 
 		if (rc == SOCKET_ERROR)
 		{
-			//printf("recvfrom() failed with error code : %d\n" , GetLastError());
 			data.resize(0);
 		}
 		else
 		{
-			printf("RX: {%s;%d} (%d bytes) <= ", inet_ntoa(remote.sin_addr), ntohs(remote.sin_port), rc);
+			CHATTER_DEBUG("RX: %s (%d bytes)", remote, rc);
 			data.resize(rc);
 		}
 
@@ -197,15 +710,700 @@ struct UdpSocket
 	}
 
 
+	//Receives straight into a pool buffer; the returned buffer is empty when nothing was pending.
+	std::pair<sockaddr_in, BufferRef> RecvFrom()
+	{
+		//io_uring completions and coalesced datagrams come in batches, handed out one at a time
+		if (gro || uring)
+		{
+			if (unread.empty())
+			{
+				DatagramBatch batch(1);
+				RecvBatch(batch);
+				unread.insert(unread.end(), batch.begin(), batch.end());
+			}
+			if (unread.empty())
+				return std::make_pair(sockaddr_in{ 0 }, BufferRef());
+
+			auto datagram = std::move(unread.front());
+			unread.pop_front();
+			return std::make_pair(datagram.remote, std::move(datagram.buffer));
+		}
+
+		auto data = pool.Acquire();
+		sockaddr_in remote = { 0 };
+		auto len = static_cast<socklen_t>(sizeof(sockaddr_in));
+
+		int rc = recvfrom(sockfd, data.data(), static_cast<int>(data.capacity()), 0, reinterpret_cast<sockaddr*>(&remote), &len);
+
+		if (rc == SOCKET_ERROR)
+			return std::make_pair(remote, BufferRef());
+
+		CHATTER_DEBUG("RX: %s (%d bytes)", remote, rc);
+		data.resize(rc);
+		return std::make_pair(remote, std::move(data));
+	}
+
+
+	//Receives up to batch.Capacity() pending datagrams with a single recvmmsg.
+	//Returns the number received; 0 when nothing is pending.
+	size_t RecvBatch(DatagramBatch& batch)
+	{
+		if (zerocopy.outstanding.load(std::memory_order_relaxed))
+			ReapZeroCopy();
+#ifdef __linux__
+		if (uring)
+		{
+			batch.Reset();
+			RecvUring(batch);
+			if (batch.count_ || !uring->fallen_back)
+			{
+				if (batch.count_)
+					CHATTER_DEBUG("RX: %lu datagrams", static_cast<unsigned long>(batch.count_));
+				return batch.count_;
+			}
+		}
+#endif
+		batch.Refill(pool);
+#ifndef WIN32
+		const int rc = recvmmsg(sockfd, batch.headers_.data(), static_cast<unsigned>(batch.Capacity()), MSG_DONTWAIT, nullptr);
+#ifdef __linux__
+		if (uring)
+			PollUring();
+#endif
+		if (rc == SOCKET_ERROR)
+			return 0;
+
+		for (int i = 0; i < rc; ++i)
+		{
+			auto& header = batch.headers_[i];
+			const bool truncated = (header.msg_hdr.msg_flags & MSG_TRUNC) != 0;
+			const size_t segment = GroSegment(header.msg_hdr);
+			if (segment && header.msg_len > segment)
+			{
+				BufferRef buffer = std::move(batch.slots_[i]);
+				buffer.resize(header.msg_len);
+				batch.EmitSegments(std::move(buffer), batch.addresses_[i], segment, truncated);
+			}
+			else
+			{
+				batch.Emit(i, batch.addresses_[i], header.msg_len, truncated);
+			}
+		}
+#else
+		for (size_t i = 0; i < batch.Capacity(); ++i)
+		{
+			auto& slot = batch.slots_[i];
+			sockaddr_in remote = { 0 };
+			auto len = static_cast<socklen_t>(sizeof(sockaddr_in));
+			const int rc = recvfrom(sockfd, slot.data(), static_cast<int>(slot.capacity()), 0, reinterpret_cast<sockaddr*>(&remote), &len);
+			const bool truncated = rc == SOCKET_ERROR && GetLastError() == WSAEMSGSIZE;
+			if (rc == SOCKET_ERROR && !truncated)
+				break;
+
+			batch.Emit(i, remote, truncated ? slot.capacity() : rc, truncated);
+		}
+#endif
+		if (batch.count_)
+			CHATTER_DEBUG("RX: %lu datagrams", static_cast<unsigned long>(batch.count_));
+		return batch.count_;
+	}
+
+
+	//Sends count datagrams with as few sendmmsg calls as the kernel allows.
+	//Returns the number actually sent, which is less than count only on error.
+	size_t SendBatch(const Datagram* const datagrams, const size_t count)
+	{
+		if (count == 0)
+			return 0;
+
+		CHATTER_DEBUG("TX: %lu datagrams", static_cast<unsigned long>(count));
+		size_t sent = 0;
+#ifndef WIN32
+		iovec iovecs[MaxSendBatch];
+		mmsghdr headers[MaxSendBatch];
+
+		while (sent < count)
+		{
+			const size_t n = count - sent < MaxSendBatch ? count - sent : MaxSendBatch;
+			for (size_t i = 0; i < n; ++i)
+			{
+				const auto& d = datagrams[sent + i];
+				iovecs[i].iov_base = const_cast<char*>(d.data);
+				iovecs[i].iov_len = d.size;
+				headers[i] = mmsghdr{};
+				headers[i].msg_hdr.msg_name = const_cast<sockaddr_in*>(&d.remote);
+				headers[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+				headers[i].msg_hdr.msg_iov = &iovecs[i];
+				headers[i].msg_hdr.msg_iovlen = 1;
+			}
+
+			const int rc = sendmmsg(sockfd, headers, static_cast<unsigned>(n), 0);
+			if (rc == SOCKET_ERROR)
+			{
+				CHATTER_ERROR("sendmmsg() failed with error code : %d", GetLastError());
+				break;
+			}
+			sent += rc;
+		}
+#else
+		for (; sent < count; ++sent)
+		{
+			const auto& d = datagrams[sent];
+			if (sendto(sockfd, d.data, static_cast<int>(d.size), 0, reinterpret_cast<const sockaddr*>(&d.remote), sizeof(sockaddr_in)) == SOCKET_ERROR)
+			{
+				CHATTER_ERROR("sendto() failed with error code : %d", GetLastError());
+				break;
+			}
+		}
+#endif
+		return sent;
+	}
+
+
+	//As above for datagrams of up to MaxGatherParts parts each
+	size_t SendBatch(const GatherDatagram* const datagrams, const size_t count)
+	{
+		if (count == 0)
+			return 0;
+
+		CHATTER_DEBUG("TX: %lu gathered datagrams", static_cast<unsigned long>(count));
+		size_t sent = 0;
+#ifndef WIN32
+		iovec iovecs[MaxSendBatch * MaxGatherParts];
+		mmsghdr headers[MaxSendBatch];
+
+		while (sent < count)
+		{
+			const size_t n = count - sent < MaxSendBatch ? count - sent : MaxSendBatch;
+			for (size_t i = 0; i < n; ++i)
+			{
+				const auto& d = datagrams[sent + i];
+				if (d.count > MaxGatherParts)
+				{
+					CHATTER_ERROR("sendmmsg() of %lu parts, at most %lu supported", static_cast<unsigned long>(d.count), static_cast<unsigned long>(MaxGatherParts));
+					return sent;
+				}
+				headers[i] = mmsghdr{};
+				headers[i].msg_hdr.msg_name = const_cast<sockaddr_in*>(&d.remote);
+				headers[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+				headers[i].msg_hdr.msg_iov = &iovecs[i * MaxGatherParts];
+				headers[i].msg_hdr.msg_iovlen = ToIovecs(d.parts, d.count, &iovecs[i * MaxGatherParts]);
+			}
+
+			const int rc = sendmmsg(sockfd, headers, static_cast<unsigned>(n), 0);
+			if (rc == SOCKET_ERROR)
+			{
+				CHATTER_ERROR("sendmmsg() failed with error code : %d", GetLastError());
+				break;
+			}
+			sent += rc;
+		}
+#else
+		for (; sent < count; ++sent)
+		{
+			const auto& d = datagrams[sent];
+			if (SendGathered(d.remote, d.parts, d.count, 0) == SOCKET_ERROR)
+				break;
+		}
+#endif
+		return sent;
+	}
+
+
+	//Sends the bytes of parts as datagrams of segment bytes each, the last may be
+	//shorter. With SocketOptions::gso the kernel cuts them up, up to
+	//MaxGsoSegments per system call; otherwise, or once the kernel refuses, they
+	//go through SendBatch(). A segment may span at most MaxGatherParts parts.
+	//Returns the number of datagrams sent.
+	size_t SendSegmented(const sockaddr_in& remote, const IoSpan* const parts, const size_t count, const size_t segment)
+	{
+		if (segment == 0)
+			return 0;
+
+		IoSpan spans[MaxGsoSegments * MaxGatherParts];
+		GatherDatagram datagrams[MaxGsoSegments];
+		size_t part = 0, offset = 0, sent = 0;
+
+		while (part < count)
+		{
+			//Cut the next run of segments out of parts
+			size_t n = 0, used = 0, bytes = 0;
+			while (part < count && n < MaxGsoSegments && (n == 0 || bytes + segment <= MaxGsoBytes))
+			{
+				auto& d = datagrams[n];
+				d = GatherDatagram{ remote, &spans[used], 0 };
+				for (size_t left = segment; left && part < count;)
+				{
+					if (d.count == MaxGatherParts)
+					{
+						CHATTER_ERROR("segment of more than %lu parts", static_cast<unsigned long>(MaxGatherParts));
+						return sent;
+					}
+					const size_t take = parts[part].size - offset < left ? parts[part].size - offset : left;
+					spans[used + d.count++] = IoSpan{ parts[part].data + offset, take };
+					left -= take;
+					bytes += take;
+					offset += take;
+					if (offset == parts[part].size)
+					{
+						part++;
+						offset = 0;
+					}
+				}
+				used += d.count;
+				n++;
+			}
+
+			if (gso && n > 1)
+			{
+				const int rc = SendOffloaded(remote, spans, used, segment);
+				if (rc != SOCKET_ERROR)
+				{
+					sent += n;
+					continue;
+				}
+			}
+
+			const size_t rc = SendBatch(datagrams, n);
+			sent += rc;
+			if (rc < n)
+				break;
+		}
+		return sent;
+	}
+
+
+	bool SegmentOffload() const { return gso; }
+
+
 	~UdpSocket()
 	{
+#ifdef __linux__
+		uring.reset();
+#endif
 		CloseSocket(sockfd);
 		sockfd = INVALID_SOCKET;
 	}
 
 
 private:
+	template<class T>
+	bool SetOption(const int level, const int name, const T& value, const char* const description)
+	{
+		if (setsockopt(sockfd, level, name, reinterpret_cast<const char*>(&value), sizeof(T)) == SOCKET_ERROR)
+		{
+			CHATTER_ERROR("setsockopt(%s) failed with error code: %d", description, GetLastError());
+			return false;
+		}
+		return true;
+	}
+
+
+	//Integer option value, or fallback if it cannot be read
+	int GetOption(const int level, const int name, const int fallback) const
+	{
+		int value = 0;
+		auto len = static_cast<socklen_t>(sizeof value);
+		if (getsockopt(sockfd, level, name, reinterpret_cast<char*>(&value), &len) == SOCKET_ERROR)
+			return fallback;
+		return value;
+	}
+
+
+	void StartUring(const size_t pool_buffers)
+	{
+#ifdef __linux__
+		//Half the pool goes to the kernel, the rest covers buffers held by the application
+		const size_t half = pool_buffers / 2;
+		const unsigned entries = static_cast<unsigned>(half < 1 ? 1 : half > 0x8000 ? 0x8000 : half);
+
+		uring.reset(new UringReceive(pool, entries, gro));
+		if (uring->ring.IsOpen())
+		{
+			CHATTER_INFO("Socket<%d> receiving through io_uring with %u provided buffers", static_cast<int>(sockfd), entries);
+			return;
+		}
+		uring.reset();
+#else
+		(void)pool_buffers;
+#endif
+		CHATTER_WARN("Socket<%d> io_uring unavailable, receiving with system calls", static_cast<int>(sockfd));
+	}
+
+
+#ifdef __linux__
+	//One multishot recvmsg stays armed; the kernel completes it once per datagram,
+	//writing an io_uring_recvmsg_out header, the sender address and the payload
+	//into one of the provided buffers. Each buffer id holds its pool buffer in
+	//held until the completion hands it on, then a fresh one takes its place.
+	//Multishot receives need Linux 6.0, which the opcode probe cannot tell, so
+	//the first hard error sends the socket back to recvmmsg: a one-shot poll of
+	//the socket then keeps the ring signalling readiness.
+	struct UringReceive
+	{
+		//user_data of the requests, told apart on completion
+		static constexpr const uint64_t RecvTag = 1;
+		static constexpr const uint64_t PollTag = 2;
+		static constexpr const uint64_t CancelTag = 3;
+
+		UringReceive(BufferPool& pool, const unsigned entries, const bool gro)
+			: ring(entries < 32 ? 32 : entries)
+			, buffers(ring, 0)
+			, held(entries)
+			, armed(false)
+			, polling(false)
+			, fallen_back(false)
+		{
+			memset(&msg, 0, sizeof msg);
+			msg.msg_namelen = sizeof(sockaddr_in);
+			msg.msg_controllen = gro ? CMSG_SPACE(sizeof(int)) : 0;
+			if (!ring.IsOpen())
+				return;
+			if (!ring.Supports({ IORING_OP_RECVMSG, IORING_OP_PROVIDE_BUFFERS, IORING_OP_ASYNC_CANCEL, IORING_OP_POLL_ADD }))
+			{
+				CHATTER_WARN("io_uring lacks the operations to receive with");
+				ring.Close();
+				return;
+			}
+			for (unsigned id = 0; id < entries; ++id)
+				Provide(pool, static_cast<uint16_t>(id));
+		}
+
+		//The kernel must be done with the buffers before held returns them to the pool
+		~UringReceive()
+		{
+			if (armed)
+				Cancel();
+			while (armed)
+			{
+				if (ring.Submit(1) < 0 && errno != EINTR)
+					break;
+				ring.ForEachCompletion([this](const io_uring_cqe& cqe) { Reaped(cqe); });
+			}
+			ring.Close();
+		}
+
+		void Provide(BufferPool& pool, const uint16_t id)
+		{
+			held[id] = pool.Acquire();
+			buffers.Add(held[id].data(), static_cast<unsigned>(held[id].capacity()), id);
+		}
+
+		io_uring_sqe* Sqe()
+		{
+			io_uring_sqe* sqe = ring.NextSqe();
+			if (!sqe)
+			{
+				ring.Submit();
+				sqe = ring.NextSqe();
+			}
+			return sqe;
+		}
+
+		//Queues cancelling the receive; its last completion still has to be reaped
+		void Cancel()
+		{
+			if (io_uring_sqe* const sqe = Sqe())
+			{
+				sqe->opcode = IORING_OP_ASYNC_CANCEL;
+				sqe->addr = RecvTag;
+				sqe->user_data = CancelTag;
+			}
+		}
+
+		//Tracks which requests are outstanding. The kernel posts the receive's last
+		//completion from the task that submits, so a cancel finding nothing (ENOENT)
+		//means that completion is already in the queue or reaped.
+		void Reaped(const io_uring_cqe& cqe)
+		{
+			if (cqe.user_data == RecvTag && !(cqe.flags & IORING_CQE_F_MORE))
+				armed = false;
+			else if (cqe.user_data == PollTag)
+				polling = false;
+			else if (cqe.user_data == CancelTag && cqe.res == -ENOENT)
+				armed = false;
+		}
+
+		IoUring ring;
+		ProvidedBuffers buffers;
+		std::vector<BufferRef> held;
+		msghdr msg;
+		bool armed;			//the receive's last completion is yet to come
+		bool polling;		//after falling back, the socket poll's completion is yet to come
+		bool fallen_back;	//receiving with recvmmsg
+	};
+
+
+	//Gives up on the multishot receive for good; RecvBatch() uses recvmmsg from now on
+	void FallBackFromUring(const int error)
+	{
+		if (uring->fallen_back)
+			return;
+		CHATTER_WARN("Socket<%d> io_uring receive failed with error code: %d, receiving with system calls", static_cast<int>(sockfd), error);
+		uring->fallen_back = true;
+		if (uring->armed)
+			uring->Cancel();
+	}
+
+
+	//Queues the multishot receive and submits it with any buffers given back.
+	//Submitting only hands it to the kernel; it is turned down, if at all, in a completion.
+	void ArmUring()
+	{
+		io_uring_sqe* const sqe = uring->Sqe();
+		if (!sqe)
+			return;
+
+		sqe->opcode = IORING_OP_RECVMSG;
+		sqe->fd = sockfd;
+		sqe->addr = reinterpret_cast<uint64_t>(&uring->msg);
+		sqe->len = 1;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = uring->buffers.Group();
+		sqe->user_data = UringReceive::RecvTag;
+		if (uring->ring.Submit() < 0)
+			FallBackFromUring(errno);
+		else
+			uring->armed = true;
+	}
+
+
+	//After falling back, a completion on the ring tells the Reactor the socket is readable
+	void PollUring()
+	{
+		if (uring->polling)
+			return;
+		io_uring_sqe* const sqe = uring->Sqe();
+		if (!sqe)
+			return;
+
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = sockfd;
+		sqe->poll32_events = POLLIN;
+		sqe->user_data = UringReceive::PollTag;
+		uring->polling = uring->ring.Submit() >= 0;
+	}
+
+
+	//Collects up to batch.Capacity() completions into batch and returns how many
+	size_t RecvUring(DatagramBatch& batch)
+	{
+		auto& receive = *uring;
+		const unsigned completions = receive.ring.ForEachCompletion([&](const io_uring_cqe& cqe)
+		{
+			receive.Reaped(cqe);
+			if (cqe.user_data == ProvidedBuffers::Tag)
+			{
+				if (cqe.res < 0)
+					FallBackFromUring(-cqe.res);
+				return;
+			}
+			if (cqe.user_data != UringReceive::RecvTag)
+				return;
+
+			//ENOBUFS: the application holds every buffer; we re-arm once some are back
+			if (cqe.res < 0)
+			{
+				if (cqe.res != -ENOBUFS && cqe.res != -ECANCELED)
+					FallBackFromUring(-cqe.res);
+				return;
+			}
+			if (!(cqe.flags & IORING_CQE_F_BUFFER))
+				return;
+
+			const auto id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+			BufferRef buffer = std::move(receive.held[id]);
+			receive.Provide(pool, id);
+
+			const size_t length = static_cast<size_t>(cqe.res);
+			const size_t offset = sizeof(io_uring_recvmsg_out) + receive.msg.msg_namelen + receive.msg.msg_controllen;
+			if (length < offset)
+				return;
+
+			io_uring_recvmsg_out out;
+			sockaddr_in remote;
+			memcpy(&out, buffer.data(), sizeof out);
+			memcpy(&remote, buffer.data() + sizeof out, sizeof remote);
+			size_t segment = 0;
+			if (out.controllen)
+			{
+				msghdr control = {};
+				control.msg_control = buffer.data() + sizeof out + receive.msg.msg_namelen;
+				control.msg_controllen = out.controllen;
+				segment = GroSegment(control);
+			}
+
+			buffer.resize(length);
+			const size_t size = out.payloadlen < length - offset ? out.payloadlen : length - offset;
+			const bool truncated = (out.flags & MSG_TRUNC) != 0;
+			if (segment && size > segment)
+				batch.EmitSegments(buffer.Slice(offset, size), remote, segment, truncated);
+			else
+				batch.Emit(remote, buffer.Slice(offset, size), truncated);
+		}, static_cast<unsigned>(batch.Capacity()));
+
+		if (!receive.armed && !receive.fallen_back)
+			ArmUring();
+		else if (completions)
+			receive.ring.Submit();
+		return batch.count_;
+	}
+#endif
+
+
+#ifndef WIN32
+	//Segment size of a datagram the kernel coalesced, 0 if it was not
+	static size_t GroSegment(msghdr& msg)
+	{
+#ifdef UDP_GRO
+		for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+		{
+			if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO)
+			{
+				int size = 0;
+				memcpy(&size, CMSG_DATA(c), sizeof size);
+				return size > 0 ? static_cast<size_t>(size) : 0;
+			}
+		}
+#else
+		(void)msg;
+#endif
+		return 0;
+	}
+
+
+	static size_t ToIovecs(const IoSpan* const parts, const size_t count, iovec* const out)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			out[i].iov_base = const_cast<char*>(parts[i].data);
+			out[i].iov_len = parts[i].size;
+		}
+		return count;
+	}
+#endif
+
+
+	int SendGathered(const sockaddr_in& remote, const IoSpan* const parts, const size_t count, const int flags)
+	{
+		if (count > MaxGatherParts)
+		{
+			CHATTER_ERROR("sendmsg() of %lu parts, at most %lu supported", static_cast<unsigned long>(count), static_cast<unsigned long>(MaxGatherParts));
+			return SOCKET_ERROR;
+		}
+
+#ifndef WIN32
+		iovec iovecs[MaxGatherParts];
+		msghdr msg = {};
+		msg.msg_name = const_cast<sockaddr_in*>(&remote);
+		msg.msg_namelen = sizeof(sockaddr_in);
+		msg.msg_iov = iovecs;
+		msg.msg_iovlen = ToIovecs(parts, count, iovecs);
+		const int rc = static_cast<int>(sendmsg(sockfd, &msg, flags));
+#else
+		(void)flags;
+		WSABUF buffers[MaxGatherParts];
+		for (size_t i = 0; i < count; ++i)
+		{
+			buffers[i].buf = const_cast<char*>(parts[i].data);
+			buffers[i].len = static_cast<ULONG>(parts[i].size);
+		}
+		DWORD bytes = 0;
+		const int rc = WSASendTo(sockfd, buffers, static_cast<DWORD>(count), &bytes, 0, reinterpret_cast<const sockaddr*>(&remote), sizeof(sockaddr_in), nullptr, nullptr) == SOCKET_ERROR
+			? SOCKET_ERROR : static_cast<int>(bytes);
+#endif
+		if (rc == SOCKET_ERROR)
+			CHATTER_ERROR("sendmsg() failed with error code : %d", GetLastError());
+		return rc;
+	}
+
+
+	//One sendmsg the kernel splits into datagrams of segment bytes
+	int SendOffloaded(const sockaddr_in& remote, const IoSpan* const spans, const size_t count, const size_t segment)
+	{
+#ifdef UDP_SEGMENT
+		CHATTER_DEBUG("TX: %s (%lu byte segments)", remote, static_cast<unsigned long>(segment));
+
+		iovec iovecs[MaxGsoSegments * MaxGatherParts];
+		union
+		{
+			cmsghdr align;
+			char data[CMSG_SPACE(sizeof(uint16_t))];
+		} control;
+		memset(&control, 0, sizeof control);
+
+		msghdr msg = {};
+		msg.msg_name = const_cast<sockaddr_in*>(&remote);
+		msg.msg_namelen = sizeof(sockaddr_in);
+		msg.msg_iov = iovecs;
+		msg.msg_iovlen = ToIovecs(spans, count, iovecs);
+		msg.msg_control = control.data;
+		msg.msg_controllen = sizeof control.data;
+
+		cmsghdr* const c = CMSG_FIRSTHDR(&msg);
+		c->cmsg_level = SOL_UDP;
+		c->cmsg_type = UDP_SEGMENT;
+		c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		const uint16_t size = static_cast<uint16_t>(segment);
+		memcpy(CMSG_DATA(c), &size, sizeof size);
+
+		const int rc = static_cast<int>(sendmsg(sockfd, &msg, 0));
+		if (rc == SOCKET_ERROR)
+		{
+			//Segments larger than the route MTU, or a device without checksum offload
+			const int error = GetLastError();
+			CHATTER_WARN("sendmsg(UDP_SEGMENT) failed with error code : %d", error);
+			if (error == EIO || error == EINVAL || error == ENOPROTOOPT || error == EOPNOTSUPP)
+			{
+				CHATTER_WARN("Socket<%d> falling back to one datagram per segment", static_cast<int>(sockfd));
+				gso = false;
+			}
+		}
+		return rc;
+#else
+		(void)remote; (void)spans; (void)count; (void)segment;
+		return SOCKET_ERROR;
+#endif
+	}
+
+
+	static constexpr const size_t MaxSendBatch = 64;
+	static constexpr const size_t MaxGatherParts = 4;
+	static constexpr const size_t MaxGsoSegments = 64;		//UDP_MAX_SEGMENTS of older kernels
+	static constexpr const size_t MaxGsoBytes = 65507;		//a segmented send is still one UDP datagram to the stack
+
+	//Buffers of MSG_ZEROCOPY sends, held until the kernel's completion notification
+	struct ZeroCopyState
+	{
+		struct Send
+		{
+			uint32_t id;
+			BufferRef parts[MaxGatherParts];
+		};
+
+		ZeroCopyState() : enabled(false), next_id(0), sent(0), completed(0), copied(0), outstanding(0) {}
+
+		bool enabled;
+		std::mutex mutex;
+		std::deque<Send> pending;
+		uint32_t next_id;
+		std::atomic<size_t> sent;
+		std::atomic<size_t> completed;
+		std::atomic<size_t> copied;
+		std::atomic<size_t> outstanding;
+	};
+
 	sockaddr_in endpoint;
 	SOCKET sockfd;
+	BufferPool pool;
+	ZeroCopyState zerocopy;
+	std::atomic<bool> gso;		//cleared if the kernel refuses a segmented send
+	bool gro;
+	std::deque<Datagram> unread;	//segments and completions not yet handed out by RecvFrom()
+#ifdef __linux__
+	std::unique_ptr<UringReceive> uring;	//set when receiving through io_uring
+#endif
 };
 
@@ -0,0 +1,253 @@
+#pragma once
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+#include "log.h"
+
+
+//Minimal io_uring binding over the raw system calls, so no liburing is needed.
+//One submission and one completion queue, both used from a single thread.
+//The ring descriptor polls readable while completions are waiting, so it can
+//be watched by a Reactor like any socket.
+class IoUring
+{
+public:
+	explicit IoUring(const unsigned entries)
+		: fd_(-1)
+		, sq_ring_(nullptr)
+		, cq_ring_(nullptr)
+		, sqes_(nullptr)
+		, sq_ring_size_(0)
+		, cq_ring_size_(0)
+		, sqes_size_(0)
+		, sq_head_(nullptr)
+		, sq_tail_(nullptr)
+		, sq_array_(nullptr)
+		, sq_mask_(0)
+		, sq_entries_(0)
+		, sqe_tail_(0)
+		, cq_head_(nullptr)
+		, cq_tail_(nullptr)
+		, cq_mask_(0)
+		, cqes_(nullptr)
+		, features_(0)
+	{
+		io_uring_params params;
+		memset(&params, 0, sizeof params);
+		fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+		if (fd_ < 0)
+		{
+			CHATTER_ERROR("io_uring_setup failed with error code: %d", errno);
+			return;
+		}
+
+		features_ = params.features;
+		sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (single_mmap)
+			sq_ring_size_ = cq_ring_size_ = sq_ring_size_ > cq_ring_size_ ? sq_ring_size_ : cq_ring_size_;
+
+		sq_ring_ = Map(sq_ring_size_, IORING_OFF_SQ_RING);
+		cq_ring_ = single_mmap ? sq_ring_ : Map(cq_ring_size_, IORING_OFF_CQ_RING);
+		sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+		sqes_ = static_cast<io_uring_sqe*>(Map(sqes_size_, IORING_OFF_SQES));
+		if (!sq_ring_ || !cq_ring_ || !sqes_)
+		{
+			CHATTER_ERROR("io_uring mmap failed with error code: %d", errno);
+			Close();
+			return;
+		}
+
+		char* const sq = static_cast<char*>(sq_ring_);
+		sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+		sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+		sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+		sq_entries_ = params.sq_entries;
+		sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+		sqe_tail_ = *sq_tail_;
+
+		char* const cq = static_cast<char*>(cq_ring_);
+		cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+		cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+		cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+		cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+	}
+
+	~IoUring() { Close(); }
+
+	IoUring(const IoUring&) = delete;
+	IoUring& operator= (const IoUring&) = delete;
+
+
+	bool IsOpen() const { return fd_ >= 0; }
+	int Handle() const { return fd_; }
+	//IORING_FEAT_* flags the kernel reported
+	uint32_t Features() const { return features_; }
+
+
+	//Whether the kernel knows every one of the given IORING_OP_* opcodes
+	bool Supports(std::initializer_list<uint8_t> opcodes) const
+	{
+		static constexpr const unsigned Ops = 256;
+		std::vector<char> storage(sizeof(io_uring_probe) + Ops * sizeof(io_uring_probe_op), 0);
+		auto probe = reinterpret_cast<io_uring_probe*>(storage.data());
+		if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe, Ops) < 0)
+			return false;
+		for (const auto op : opcodes)
+		{
+			if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+				return false;
+		}
+		return true;
+	}
+
+
+	//Requests still in flight are cancelled by the kernel in its own time, so
+	//memory they write into must outlive the ring unless their final completions were reaped
+	void Close()
+	{
+		if (sqes_)
+			munmap(sqes_, sqes_size_);
+		if (cq_ring_ && cq_ring_ != sq_ring_)
+			munmap(cq_ring_, cq_ring_size_);
+		if (sq_ring_)
+			munmap(sq_ring_, sq_ring_size_);
+		if (fd_ >= 0)
+			close(fd_);
+		sqes_ = nullptr;
+		cq_ring_ = sq_ring_ = nullptr;
+		fd_ = -1;
+	}
+
+
+	//A zeroed submission entry, queued by the next Submit(); null when the queue is full
+	io_uring_sqe* NextSqe()
+	{
+		if (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+			return nullptr;
+
+		const unsigned index = sqe_tail_++ & sq_mask_;
+		io_uring_sqe* const sqe = &sqes_[index];
+		memset(sqe, 0, sizeof *sqe);
+		sq_array_[index] = index;
+		return sqe;
+	}
+
+
+	//Publishes the queued entries, then blocks until wait completions are pending
+	int Submit(const unsigned wait = 0)
+	{
+		const unsigned count = sqe_tail_ - *sq_tail_;
+		__atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+		const unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+		const int rc = static_cast<int>(syscall(__NR_io_uring_enter, fd_, count, wait, flags, nullptr, 0));
+		if (rc < 0)
+			CHATTER_ERROR("io_uring_enter failed with error code: %d", errno);
+		return rc;
+	}
+
+
+	//Hands up to max completions to fn and returns how many were consumed
+	template<class Fn>
+	unsigned ForEachCompletion(Fn fn, const unsigned max = ~0u)
+	{
+		unsigned head = *cq_head_;
+		const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+		unsigned n = 0;
+		for (; head != tail && n < max; ++head, ++n)
+			fn(cqes_[head & cq_mask_]);
+		__atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+		return n;
+	}
+
+
+private:
+	void* Map(const size_t size, const off_t offset)
+	{
+		void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+		return p == MAP_FAILED ? nullptr : p;
+	}
+
+	int fd_;
+	void* sq_ring_;
+	void* cq_ring_;
+	io_uring_sqe* sqes_;
+	size_t sq_ring_size_;
+	size_t cq_ring_size_;
+	size_t sqes_size_;
+	unsigned* sq_head_;
+	unsigned* sq_tail_;
+	unsigned* sq_array_;
+	unsigned sq_mask_;
+	unsigned sq_entries_;
+	unsigned sqe_tail_;		//entries handed out, published to the kernel by Submit()
+	unsigned* cq_head_;
+	unsigned* cq_tail_;
+	unsigned cq_mask_;
+	io_uring_cqe* cqes_;
+	uint32_t features_;
+};
+
+
+
+//Buffers the kernel picks from when a request carries IOSQE_BUFFER_SELECT with
+//this group id. Each completion names the buffer it used by the id given to
+//Add(); the buffer is then the caller's until it is added again. Additions are
+//queued submissions, so they reach the kernel with the next IoUring::Submit().
+class ProvidedBuffers
+{
+public:
+	//user_data of additions; successful ones post no completion where the kernel can skip it
+	static constexpr const uint64_t Tag = ~uint64_t(0);
+
+	ProvidedBuffers(IoUring& ring, const uint16_t group)
+		: ring_(ring)
+		, group_(group)
+	{}
+
+	ProvidedBuffers(const ProvidedBuffers&) = delete;
+	ProvidedBuffers& operator= (const ProvidedBuffers&) = delete;
+
+
+	uint16_t Group() const { return group_; }
+
+
+	bool Add(void* const data, const unsigned length, const uint16_t id)
+	{
+		io_uring_sqe* sqe = ring_.NextSqe();
+		if (!sqe)
+		{
+			ring_.Submit();
+			if (!(sqe = ring_.NextSqe()))
+				return false;
+		}
+
+		sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+		sqe->fd = 1;	//number of buffers
+		sqe->addr = reinterpret_cast<uint64_t>(data);
+		sqe->len = length;
+		sqe->off = id;
+		sqe->buf_group = group_;
+#ifdef IORING_FEAT_CQE_SKIP
+		if (ring_.Features() & IORING_FEAT_CQE_SKIP)
+			sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+#endif
+		sqe->user_data = Tag;
+		return true;
+	}
+
+
+private:
+	IoUring& ring_;
+	const uint16_t group_;
+};
+
+#endif
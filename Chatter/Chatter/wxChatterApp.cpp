@@ -2,52 +2,121 @@
 #include "wx/wx.h"
 #include <wx/textctrl.h>
 #include <wx/sizer.h>
+#include <wx/timer.h>
+#include <wx/listctrl.h>
 #endif
 #include "Chatter.h"
+#include <cstdlib>
 #ifdef WIN32
 #include "wx/wx.h"
 #include <wx/textctrl.h>
 #include <wx/sizer.h>
+#include <wx/timer.h>
+#include <wx/listctrl.h>
 #endif
 
 
 enum
 {
-	TEXT_CHATHISTORY = wxID_HIGHEST + 1,
+	LIST_CHATHISTORY = wxID_HIGHEST + 1,
 	TEXT_MESSAGE,
+	TIMER_RECEIVE,
 	BUTTON_SEND = wxID_OK
 };
 
 
+//Virtual list over the presenter's ChatHistory. wx only asks for the rows
+//that are actually visible, so repaint cost does not grow with the history.
+class wxChatHistoryList : public wxListCtrl
+{
+public:
+	wxChatHistoryList(wxWindow* parent, const ChatHistory& history)
+		: wxListCtrl(parent, LIST_CHATHISTORY, wxDefaultPosition, wxSize(400, 200)
+			, wxLC_REPORT | wxLC_VIRTUAL | wxLC_SINGLE_SEL)
+		, history_(history)
+	{
+		AppendColumn("Time", wxLIST_FORMAT_LEFT, 70);
+		AppendColumn("From", wxLIST_FORMAT_LEFT, 110);
+		AppendColumn("Message", wxLIST_FORMAT_LEFT, 400);
+	}
+
+	//Picks up whatever was added to the history since the last call
+	void Sync()
+	{
+		const long count = static_cast<long>(history_.Size());
+		SetItemCount(count);
+		if (count)
+		{
+			//once the ring wraps every row shifts, so repaint whatever is on screen
+			RefreshItems(GetTopItem(), count - 1);
+			EnsureVisible(count - 1);
+		}
+	}
+
+private:
+	wxString OnGetItemText(long item, long column) const override
+	{
+		const auto& record = history_[item];
+		switch (column)
+		{
+		case 0:
+		{
+			char text[16] = { 0 };
+			const time_t t = system_clock::to_time_t(record.timestamp);
+			strftime(text, sizeof text, "%H:%M:%S", localtime(&t));
+			return text;
+		}
+		case 1:
+			return record.sender;
+		default:
+		{
+			auto length = record.payload.size();
+			while (length && (record.payload[length - 1] == '\n' || record.payload[length - 1] == '\r'))
+				length--;
+			return wxString::FromUTF8(record.payload.data(), length);
+		}
+		}
+	}
+
+	const ChatHistory& history_;
+};
+
+
+
 class wxChatterView : public ChatterView, private wxFrame
 {
 public:
-	wxChatterView(ChatterPresenter& presenter)
+	wxChatterView(ChatterPresenter& presenter
+		, const milliseconds frame_interval = milliseconds(1000 / 30)
+		, const milliseconds max_latency = milliseconds(100))
 		: wxFrame(nullptr, wxID_ANY, "Chatter", wxDefaultPosition, wxDefaultSize, wxDEFAULT_FRAME_STYLE | wxCLIP_CHILDREN)
 		, presenter_(presenter)
 		, szr_content_(new wxBoxSizer(wxVERTICAL))
 		, szr_bottom_(new wxBoxSizer(wxHORIZONTAL))
-		, txt_chat_history_(new wxTextCtrl(this, TEXT_CHATHISTORY, "", wxDefaultPosition, wxSize(400, 200)
-			, wxTE_MULTILINE | wxTE_RICH, wxDefaultValidator, wxTextCtrlNameStr))
+		, lst_chat_history_(new wxChatHistoryList(this, presenter.History()))
 		, txt_message_(new wxTextCtrl(this, TEXT_MESSAGE, "", wxDefaultPosition, wxDefaultSize, wxTE_PROCESS_ENTER))
 		, btn_send_(new wxButton(this, BUTTON_SEND, "Send"))
+		, tmr_receive_(this, TIMER_RECEIVE)
+		, history_throttle_(frame_interval, max_latency)
 	{
 		CreateStatusBar();
 
 		szr_bottom_->Add(txt_message_, wxSizerFlags(1).Border(wxALL, 10).Expand());
 		szr_bottom_->Add(btn_send_, wxSizerFlags(0).Border(wxALL, 10));
 
-		szr_content_->Add(txt_chat_history_, wxSizerFlags(1).Border(wxALL, 10).Expand());
+		szr_content_->Add(lst_chat_history_, wxSizerFlags(1).Border(wxALL, 10).Expand());
 		szr_content_->Add(szr_bottom_, wxSizerFlags(0).Expand());
 		SetSizerAndFit(szr_content_);
 
-		txt_chat_history_->SetEditable(false);
-		txt_chat_history_->SetBackgroundColour(wxColor(200, 200, 200));
+		lst_chat_history_->SetBackgroundColour(wxColor(200, 200, 200));
 		txt_message_->SetFocus();
 
 		btn_send_->SetDefault();
 
 		presenter_.SetView(this);
+
+		//received messages are queued by the network thread and picked up here
+		tmr_receive_.Start(10);
 	}
 
 
@@ -66,9 +135,12 @@ public:
 		return txt_message_->GetValue().ToStdString();
 	}
 
-	void AppendToChatHistory(const std::string& text) override
+	//Repaints at most once per frame
+	void ChatHistoryChanged() override
 	{
-		txt_chat_history_->AppendText(text.c_str());
+		history_throttle_.Notify();
+		if (history_throttle_.FlushDue())
+			FlushChatHistory();
 	}
 
 	void SetMessage(const std::string& message) override
@@ -93,6 +165,19 @@ private:
 		event.Enable(presenter_.CanSend());
 	}
 
+	void OnReceiveTimer(wxTimerEvent& event)
+	{
+		presenter_.ProcessReceivedMessages();
+		if (history_throttle_.FlushDue())
+			FlushChatHistory();
+	}
+
+	void FlushChatHistory()
+	{
+		lst_chat_history_->Sync();
+		history_throttle_.Flushed();
+	}
+
 
 	DECLARE_EVENT_TABLE()
 
@@ -100,14 +185,17 @@ private:
 	ChatterPresenter& presenter_;
 	wxBoxSizer* szr_content_;
 	wxBoxSizer* szr_bottom_;
-	wxTextCtrl* txt_chat_history_;
+	wxChatHistoryList* lst_chat_history_;
 	wxTextCtrl* txt_message_;
 	wxButton* btn_send_;
+	wxTimer tmr_receive_;
+	FrameThrottle history_throttle_;
 };
 
 BEGIN_EVENT_TABLE(wxChatterView, wxFrame)
 EVT_BUTTON(BUTTON_SEND, wxChatterView::OnButtonSend)
 EVT_UPDATE_UI(BUTTON_SEND, wxChatterView::OnButtonSendUpdateUI)
+EVT_TIMER(TIMER_RECEIVE, wxChatterView::OnReceiveTimer)
 END_EVENT_TABLE();
 
 
@@ -119,15 +207,23 @@ struct MywxApp : public wxApp
 		//TODO Use program options, test first and validate!
 		if (wxApp::argc < 3)
 		{
-			cerr << "Usage: chatter_app my_ip:port peer_ip:port" << endl;
+			cerr << "Usage: chatter_app my_ip:port peer_ip:port [peer_ip:port...]" << endl;
 			return false;
 		}
 
 		my_endpoint_ = wxApp::argv[1];
-		peer_endpoint_ = wxApp::argv[2];
+		for (int i = 2; i < wxApp::argc; ++i)
+			peer_endpoints_.push_back(wxApp::argv[i].ToStdString());
 
 		//Model
-		channel_ = make_unique<UdpChatChannel>(my_endpoint_, peer_endpoint_);
+		channel_ = make_unique<UdpChatChannel>(my_endpoint_, peer_endpoints_);
+
+		//Latency mode: probe every CHATTER_PROBE_MS and log percentiles each second
+		if (const char* const probe_ms = getenv("CHATTER_PROBE_MS"))
+		{
+			channel_->EnableLatencyProbes(milliseconds(atoi(probe_ms)));
+			channel_->SetMetricsDump(seconds(1));
+		}
 
 		//Presenter
 		presenter_ = make_unique<ChatterPresenter>(*channel_);
@@ -144,7 +240,7 @@ struct MywxApp : public wxApp
 
 private:
 	string my_endpoint_;
-	string peer_endpoint_;
+	vector<string> peer_endpoints_;
 	unique_ptr<UdpChatChannel> channel_;
 	ChatterView* view_;
 	unique_ptr<ChatterPresenter> presenter_;
@@ -0,0 +1,502 @@
+//Loopback benchmarks for the transport, results as JSON on stdout:
+//
+//  socket    UdpSocket::SendTo to a thread spinning on UdpSocket::RecvFrom
+//  channel   UdpChatChannel::SendMessage to the receiving channel's callback
+//  inprocess the same through an InProcessChatChannel pair, no sockets
+//  backend   Reactor driven RecvBatch through each SocketBackend
+//  timers    TimerWheel against a std::priority_queue: schedule, cancel, expire
+//
+//Socket, channel and inprocess runs cover message sizes from 16B to 64KB and 1 or 4
+//senders. Every message carries its send time, so latency is send to receipt
+//(socket) or send to callback (channel). Senders keep at most Window messages
+//in flight, so the numbers measure the transport rather than the kernel
+//dropping whatever overflows the receive buffer.
+//
+//  usage: chatter_bench [--quick] > results.json
+//
+//Transport logging goes to stderr.
+#include "Chatter.h"
+#include <chrono>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <queue>
+#include <random>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+using namespace std::chrono;
+
+
+static const size_t Window = 64;
+static const auto Stall = milliseconds(100);	//window still full: what is missing was lost
+
+
+struct Result
+{
+	size_t sent;
+	size_t received;
+	double seconds;
+	LatencyHistogram::Summary latency;
+};
+
+
+//Shared by the senders and the receiving side of one run
+struct Run
+{
+	Run() : sent(0), received(0), written_off(0), last(0) {}
+
+	int64_t InFlight() const
+	{
+		return static_cast<int64_t>(sent.load(memory_order_acquire))
+			- static_cast<int64_t>(received.load(memory_order_acquire)) - written_off.load(memory_order_acquire);
+	}
+
+	void OnReceived(const char* const data)
+	{
+		int64_t stamp = 0;
+		memcpy(&stamp, data, sizeof stamp);
+		const int64_t now = ProbeClock();
+		latency.Record(static_cast<uint64_t>(now - stamp));
+		last.store(now, memory_order_relaxed);
+		received.fetch_add(1, memory_order_release);
+	}
+
+	atomic<size_t> sent;
+	atomic<size_t> received;
+	atomic<int64_t> written_off;	//given up on as lost
+	atomic<int64_t> last;
+	LatencyHistogram latency;
+};
+
+
+//Sends count messages of size bytes through send() while fewer than Window
+//messages from all senders are in flight. Returns how many were sent.
+template<class Send>
+static size_t SendAll(Run& run, const size_t count, const size_t size, Send send)
+{
+	string message(size, 'x');
+	for (size_t i = 0; i < count; ++i)
+	{
+		const auto waiting = steady_clock::now();
+		while (run.InFlight() >= static_cast<int64_t>(Window))
+		{
+			if (steady_clock::now() - waiting > Stall)
+			{
+				run.written_off += run.InFlight();
+				break;
+			}
+			this_thread::yield();
+		}
+
+		const int64_t stamp = ProbeClock();
+		memcpy(&message[0], &stamp, sizeof stamp);
+		send(message);
+		run.sent++;
+	}
+	return count;
+}
+
+
+//Waits for the last stragglers, then reports
+static Result Finish(Run& run, const size_t sent, const int64_t start)
+{
+	auto last_progress = steady_clock::now();
+	size_t seen = run.received.load();
+	while (seen < sent && steady_clock::now() - last_progress < Stall * 3)
+	{
+		this_thread::sleep_for(milliseconds(1));
+		if (run.received.load() != seen)
+		{
+			seen = run.received.load();
+			last_progress = steady_clock::now();
+		}
+	}
+
+	const int64_t end = run.last.load() > start ? run.last.load() : start + 1;
+	return Result{ sent, run.received.load(), (end - start) / 1e9, run.latency.Summarise() };
+}
+
+
+static Result BenchSocket(const size_t size, const size_t senders, const size_t count)
+{
+	SocketOptions options;
+	options.receive_buffer = 8 << 20;
+	UdpSocket receiver(2200, "127.0.0.1", options, 64, 64 << 10);
+	if (!receiver.Bind())
+		return Result{};
+
+	Run run;
+	atomic<bool> done(false);
+	thread reader([&]
+	{
+		while (!done.load(memory_order_relaxed))
+		{
+			const auto datagram = receiver.RecvFrom();
+			if (datagram.second.empty())
+				this_thread::yield();
+			else
+				run.OnReceived(datagram.second.data());
+		}
+	});
+
+	vector<unique_ptr<UdpSocket>> sockets;
+	for (size_t i = 0; i < senders; ++i)
+		sockets.push_back(make_unique<UdpSocket>());
+
+	const int64_t start = ProbeClock();
+	vector<thread> threads;
+	atomic<size_t> total(0);
+	for (auto& socket : sockets)
+	{
+		UdpSocket* const s = socket.get();
+		threads.emplace_back([&, s]
+		{
+			total += SendAll(run, count / senders, size, [&](const string& message) { s->SendTo(receiver.LocalEndpoint(), message); });
+		});
+	}
+	for (auto& t : threads)
+		t.join();
+
+	const auto result = Finish(run, total, start);
+	done = true;
+	reader.join();
+	return result;
+}
+
+
+struct BenchHandler : ChannelCallbackHandler
+{
+	explicit BenchHandler(Run& run) : run_(run) {}
+
+	void OnMessageReceived(const string& message) override { run_.OnReceived(message.data()); }
+	void OnBufferReceived(const sockaddr_in&, const BufferRef& message) override { run_.OnReceived(message.data()); }
+
+private:
+	Run& run_;
+};
+
+
+static Result BenchChannel(const size_t size, const size_t senders, const size_t count)
+{
+	vector<string> sender_endpoints;
+	for (size_t i = 0; i < senders; ++i)
+		sender_endpoints.push_back("127.0.0.1:" + to_string(2201 + i));
+
+	UdpChatChannel receiver("127.0.0.1:2200", sender_endpoints);
+	vector<unique_ptr<UdpChatChannel>> channels;
+	for (const auto& endpoint : sender_endpoints)
+		channels.push_back(make_unique<UdpChatChannel>(endpoint, "127.0.0.1:2200"));
+
+	Run run;
+	BenchHandler handler(run);
+	receiver.SetCallbackHandler(&handler);
+	if (!receiver.Initialise())
+		return Result{};
+	for (auto& channel : channels)
+	{
+		if (!channel->Initialise())
+			return Result{};
+	}
+
+	const int64_t start = ProbeClock();
+	vector<thread> threads;
+	atomic<size_t> total(0);
+	for (auto& channel : channels)
+	{
+		UdpChatChannel* const c = channel.get();
+		threads.emplace_back([&, c]
+		{
+			total += SendAll(run, count / senders, size, [c](const string& message) { c->SendMessage(message); });
+		});
+	}
+	for (auto& t : threads)
+		t.join();
+
+	return Finish(run, total, start);
+}
+
+
+//The channel run without the network, for what the channel itself costs
+static Result BenchInProcess(const size_t size, const size_t senders, const size_t count)
+{
+	Run run;
+	BenchHandler handler(run);
+	vector<unique_ptr<InProcessChatChannel>> receivers, channels;
+	for (size_t i = 0; i < senders; ++i)
+	{
+		receivers.push_back(make_unique<InProcessChatChannel>("receiver"));
+		channels.push_back(make_unique<InProcessChatChannel>("sender"));
+		InProcessChatChannel::Connect(*channels.back(), *receivers.back());
+		receivers.back()->SetCallbackHandler(&handler);
+		receivers.back()->Initialise();
+		channels.back()->Initialise();
+	}
+
+	const int64_t start = ProbeClock();
+	vector<thread> threads;
+	atomic<size_t> total(0);
+	for (auto& channel : channels)
+	{
+		InProcessChatChannel* const c = channel.get();
+		threads.emplace_back([&, c]
+		{
+			total += SendAll(run, count / senders, size, [c](const string& message) { c->SendMessage(message); });
+		});
+	}
+	for (auto& t : threads)
+		t.join();
+
+	return Finish(run, total, start);
+}
+
+
+struct BackendResult
+{
+	size_t received;
+	size_t wakeups;	//times the reactor dispatched the receive handler
+	double seconds;
+};
+
+
+//A burst of datagrams received by a Reactor driven UdpSocket
+static BackendResult BenchBackend(const SocketBackend backend, const size_t datagrams, const size_t payload)
+{
+	SocketOptions options;
+	options.receive_buffer = 8 << 20;
+	options.backend = backend;
+	UdpSocket receiver(2200, "127.0.0.1", options, 1024);
+	if (!receiver.Bind() || receiver.Backend() != backend)
+		return BackendResult{ 0, 0, 0 };
+
+	Reactor reactor;
+	DatagramBatch batch(64);
+	size_t received = 0;
+	size_t wakeups = 0;
+	steady_clock::time_point last;
+	reactor.Watch(receiver.EventHandle(), [&]
+	{
+		wakeups++;
+		while (const size_t n = receiver.RecvBatch(batch))
+		{
+			received += n;
+			last = steady_clock::now();
+		}
+		if (received >= datagrams)
+			reactor.Stop();
+	});
+	thread worker([&reactor] { reactor.Run(); });
+	this_thread::sleep_for(milliseconds(50));	//let Run() arm the receive
+
+	UdpSocket sender;
+	const string data(payload, 'x');
+	Datagram burst[32];
+	for (auto& d : burst)
+		d = Datagram{ receiver.LocalEndpoint(), data.data(), data.size(), false };
+
+	const auto start = steady_clock::now();
+	for (size_t sent = 0; sent < datagrams;)
+	{
+		const size_t n = datagrams - sent < 32 ? datagrams - sent : 32;
+		sent += sender.SendBatch(burst, n);
+	}
+
+	//whatever has not arrived by now was dropped by the kernel
+	this_thread::sleep_for(milliseconds(200));
+	reactor.Stop();
+	worker.join();
+	return BackendResult{ received, wakeups, duration<double>(last - start).count() };
+}
+
+
+//The baseline for the timers run: a binary heap that cancels by marking, the
+//usual way to cancel with std::priority_queue
+class HeapTimers
+{
+public:
+	uint64_t Schedule(const int64_t when)
+	{
+		heap_.push(Entry{ when, cancelled_.size() });
+		cancelled_.push_back(false);
+		return cancelled_.size() - 1;
+	}
+
+	bool Cancel(const uint64_t id)
+	{
+		const bool pending = !cancelled_[id];
+		cancelled_[id] = true;
+		return pending;
+	}
+
+	template<class Fn>
+	size_t Advance(const int64_t now, Fn fn)
+	{
+		size_t fired = 0;
+		while (!heap_.empty() && heap_.top().when <= now)
+		{
+			const uint64_t id = heap_.top().id;
+			heap_.pop();
+			if (cancelled_[id])
+				continue;
+			cancelled_[id] = true;
+			fn(id);
+			fired++;
+		}
+		return fired;
+	}
+
+private:
+	struct Entry
+	{
+		int64_t when;
+		uint64_t id;
+		bool operator> (const Entry& other) const { return when > other.when; }
+	};
+
+	priority_queue<Entry, vector<Entry>, greater<Entry>> heap_;
+	vector<bool> cancelled_;
+};
+
+
+struct TimerResult
+{
+	double schedule_ns;	//per timer
+	double cancel_ns;
+	double expire_ns;	//per timer fired, walking time forward 1ms at a time
+	size_t fired;
+};
+
+
+//count timers due over the next 10s, half of them cancelled, then expired
+template<class Timers, class Id>
+static TimerResult BenchTimers(Timers& timers, const size_t count, Id (Timers::*schedule)(int64_t))
+{
+	const int64_t span = 10000000000LL;
+	mt19937_64 random(1);
+	vector<int64_t> when(count);
+	for (auto& w : when)
+		w = static_cast<int64_t>(random() % span);
+	vector<Id> ids(count);
+
+	auto start = steady_clock::now();
+	for (size_t i = 0; i < count; ++i)
+		ids[i] = (timers.*schedule)(when[i]);
+	const double scheduled = duration<double, nano>(steady_clock::now() - start).count();
+
+	start = steady_clock::now();
+	for (size_t i = 0; i < count; i += 2)
+		timers.Cancel(ids[i]);
+	const double cancelled = duration<double, nano>(steady_clock::now() - start).count();
+
+	size_t fired = 0;
+	start = steady_clock::now();
+	for (int64_t now = 0; now <= span; now += 1000000)
+		fired += timers.Advance(now, [](const uint64_t&) {});
+	const double expired = duration<double, nano>(steady_clock::now() - start).count();
+
+	return TimerResult{ scheduled / count, cancelled / ((count + 1) / 2), fired ? expired / fired : 0, fired };
+}
+
+
+//Scheduling through a wrapper, so both sides are called the same way
+struct WheelTimers : TimerWheel<uint64_t>
+{
+	WheelTimers() : TimerWheel<uint64_t>(microseconds(100), 1024) {}
+	TimerId Add(const int64_t when) { return Schedule(when, 0); }
+};
+
+
+static void PrintTimers(const char* const impl, const size_t count, const TimerResult& r, const bool last)
+{
+	printf("    {\"name\": \"timers\", \"impl\": \"%s\", \"timers\": %zu, \"fired\": %zu"
+		", \"schedule_ns\": %.1f, \"cancel_ns\": %.1f, \"expire_ns\": %.1f}%s\n"
+		, impl, count, r.fired, r.schedule_ns, r.cancel_ns, r.expire_ns, last ? "" : ",");
+	fflush(stdout);
+}
+
+
+static void PrintLatency(const LatencyHistogram::Summary& latency)
+{
+	printf("\"latency_ns\": {\"p50\": %lld, \"p90\": %lld, \"p99\": %lld, \"p999\": %lld, \"max\": %lld, \"mean\": %lld}"
+		, static_cast<long long>(latency.p50.count()), static_cast<long long>(latency.p90.count())
+		, static_cast<long long>(latency.p99.count()), static_cast<long long>(latency.p999.count())
+		, static_cast<long long>(latency.max.count()), static_cast<long long>(latency.mean.count()));
+}
+
+
+static void PrintResult(const char* const name, const size_t size, const size_t senders, const Result& r, const bool last)
+{
+	const double seconds = r.seconds > 0 ? r.seconds : 1e-9;
+	printf("    {\"name\": \"%s\", \"size\": %zu, \"senders\": %zu, \"sent\": %zu, \"received\": %zu, \"loss\": %.6f, \"seconds\": %.6f"
+		", \"messages_per_second\": %.1f, \"bytes_per_second\": %.1f, "
+		, name, size, senders, r.sent, r.received, r.sent ? 1.0 - static_cast<double>(r.received) / r.sent : 0.0, r.seconds
+		, r.received / seconds, r.received * static_cast<double>(size) / seconds);
+	PrintLatency(r.latency);
+	printf("}%s\n", last ? "" : ",");
+	fflush(stdout);
+}
+
+
+int main(int argc, char* argv[])
+{
+	const bool quick = argc > 1 && string(argv[1]) == "--quick";
+	Logger::Instance().SetOutput(stderr);
+	Logger::Instance().SetLevel(LogLevel::Warning);
+
+	const size_t socket_sizes[] = { 16, 256, 1024, 8192, 65000 };	//one datagram each
+	const size_t channel_sizes[] = { 16, 256, 1024, 8192, 65536 };
+	const size_t sender_counts[] = { 1, 4 };
+
+	//Fewer messages for big sizes so every run moves a similar number of bytes
+	const auto count = [quick](const size_t size)
+	{
+		const size_t messages = quick ? 5000 : 50000;
+		const size_t bytes = quick ? (16 << 20) : (256 << 20);
+		return max<size_t>(quick ? 200 : 2000, min(messages, bytes / size));
+	};
+
+	printf("{\n  \"window\": %zu,\n  \"benchmarks\": [\n", Window);
+	for (const size_t senders : sender_counts)
+		for (const size_t size : socket_sizes)
+			PrintResult("socket", size, senders, BenchSocket(size, senders, count(size)), false);
+
+	for (const size_t senders : sender_counts)
+		for (const size_t size : channel_sizes)
+			PrintResult("channel", size, senders, BenchChannel(size, senders, count(size)), false);
+
+	for (const size_t senders : sender_counts)
+		for (const size_t size : channel_sizes)
+			PrintResult("inprocess", size, senders, BenchInProcess(size, senders, count(size)), false);
+
+	const struct { SocketBackend backend; const char* name; } backends[] =
+	{
+		{ SocketBackend::Syscall, "recvmmsg" },
+		{ SocketBackend::IoUring, "io_uring" },
+	};
+	const size_t datagrams = quick ? 20000 : 200000;
+	for (size_t i = 0; i < 2; ++i)
+	{
+		const auto r = BenchBackend(backends[i].backend, datagrams, 64);
+		const double seconds = r.seconds > 0 ? r.seconds : 1e-9;
+		printf("    {\"name\": \"backend\", \"backend\": \"%s\", \"size\": 64, \"sent\": %zu, \"received\": %zu, \"seconds\": %.6f"
+			", \"messages_per_second\": %.1f, \"per_wakeup\": %.1f},\n"
+			, backends[i].name, datagrams, r.received, r.seconds, r.received ? r.received / seconds : 0.0
+			, r.wakeups ? static_cast<double>(r.received) / r.wakeups : 0.0);
+	}
+
+	const size_t timer_counts[] = { 10000, 100000, 1000000 };
+	const size_t timer_runs = quick ? 2 : 3;
+	for (size_t i = 0; i < timer_runs; ++i)
+	{
+		WheelTimers wheel;
+		PrintTimers("wheel", timer_counts[i], BenchTimers(wheel, timer_counts[i], &WheelTimers::Add), false);
+		HeapTimers heap;
+		PrintTimers("priority_queue", timer_counts[i], BenchTimers(heap, timer_counts[i], &HeapTimers::Schedule), i + 1 == timer_runs);
+	}
+	printf("  ]\n}\n");
+	return 0;
+}
@@ -0,0 +1,355 @@
+//Headless load generator. Starts one receiving UdpChatChannel with every sender
+//as a peer, plus N sending UdpChatChannels, and replays a message rate profile
+//from each sender, then reports throughput, loss and latency per phase.
+//
+//  usage: chatter_load [options] <profile>
+//
+//    --senders N     sending channels (1)
+//    --ip IP         address every channel binds to (127.0.0.1)
+//    --port P        receiver port; senders use the ports after it (2300)
+//    --repeat N      replay the profile N times, e.g. for soak runs (1)
+//    --seed S        seeds the Poisson arrivals (1)
+//    --reliable      enable reliable delivery on every channel
+//    --verbose       transport logging at Info instead of Warning
+//
+//The profile has one phase per line, run in order; # starts a comment:
+//
+//    constant <seconds> <rate> <size>
+//    burst    <seconds> <rate> <size> <burst>
+//    poisson  <seconds> <rate> <size>
+//
+//rate is messages per second per sender and size is bytes per message. burst
+//sends <burst> messages back to back, spacing the bursts to keep the average
+//rate; poisson spaces messages by exponentially distributed gaps. Each message
+//carries its send time and phase, so latency is send to receiver callback.
+//Transport logging goes to stderr.
+#include "Chatter.h"
+#include <chrono>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <random>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+using namespace std::chrono;
+
+
+static const size_t StampSize = sizeof(int64_t) + sizeof(uint32_t);	//send time, phase
+static const auto Drain = seconds(1);	//receiving goes quiet this long: the rest was lost
+
+
+struct Phase
+{
+	enum Kind { Constant, Burst, Poisson };
+
+	Kind kind;
+	double seconds;
+	double rate;
+	size_t size;
+	size_t burst;
+	string line;	//as written in the profile, for the report
+};
+
+
+//What the senders and the receiver saw of one phase
+struct PhaseResult
+{
+	PhaseResult() : sent(0), received(0), bytes(0), started(0), last(0) {}
+
+	atomic<uint64_t> sent;
+	atomic<uint64_t> received;
+	atomic<uint64_t> bytes;
+	atomic<int64_t> started;
+	atomic<int64_t> last;	//latest receipt
+	LatencyHistogram latency;
+};
+
+
+static bool ParseProfile(istream& in, vector<Phase>& phases, string& error)
+{
+	string line;
+	for (size_t number = 1; getline(in, line); ++number)
+	{
+		const auto comment = line.find('#');
+		if (comment != string::npos)
+			line.erase(comment);
+
+		istringstream fields(line);
+		string kind;
+		if (!(fields >> kind))
+			continue;
+
+		Phase phase{ Phase::Constant, 0, 0, 0, 1, line };
+		if (kind == "burst")
+			phase.kind = Phase::Burst;
+		else if (kind == "poisson")
+			phase.kind = Phase::Poisson;
+		else if (kind != "constant")
+		{
+			error = "line " + to_string(number) + ": unknown phase '" + kind + "'";
+			return false;
+		}
+
+		if (!(fields >> phase.seconds >> phase.rate >> phase.size)
+			|| (phase.kind == Phase::Burst && !(fields >> phase.burst))
+			|| phase.seconds <= 0 || phase.rate <= 0 || phase.burst == 0)
+		{
+			error = "line " + to_string(number) + ": expected " + kind + " <seconds> <rate> <size>" + (phase.kind == Phase::Burst ? " <burst>" : "");
+			return false;
+		}
+		if (phase.size < StampSize)
+		{
+			error = "line " + to_string(number) + ": size must be at least " + to_string(StampSize);
+			return false;
+		}
+		phases.push_back(phase);
+	}
+
+	if (phases.empty())
+		error = "no phases";
+	return !phases.empty();
+}
+
+
+//Sends one phase's messages at their scheduled times. Sending runs late rather
+//than skipping messages, so a sender that cannot keep up sends back to back.
+static void Replay(UdpChatChannel& channel, const Phase& phase, const uint32_t index, PhaseResult& result, mt19937_64& random)
+{
+	string message(phase.size, 'x');
+	memcpy(&message[sizeof(int64_t)], &index, sizeof index);
+
+	const duration<double> gap(phase.burst / phase.rate);
+	exponential_distribution<double> poisson(phase.rate);
+
+	const auto start = steady_clock::now();
+	const auto end = start + duration_cast<steady_clock::duration>(duration<double>(phase.seconds));
+	for (auto next = start; next < end;)
+	{
+		this_thread::sleep_until(next);
+		for (size_t i = 0; i < phase.burst; ++i)
+		{
+			const int64_t stamp = ProbeClock();
+			memcpy(&message[0], &stamp, sizeof stamp);
+			channel.SendMessage(message);
+		}
+		result.sent += phase.burst;
+
+		next += duration_cast<steady_clock::duration>(phase.kind == Phase::Poisson ? duration<double>(poisson(random)) : gap);
+	}
+}
+
+
+struct LoadHandler : ChannelCallbackHandler
+{
+	explicit LoadHandler(vector<unique_ptr<PhaseResult>>& results) : results_(results) {}
+
+	void OnMessageReceived(const string& message) override { OnReceived(message.data(), message.size()); }
+	void OnBufferReceived(const sockaddr_in&, const BufferRef& message) override { OnReceived(message.data(), message.size()); }
+
+private:
+	void OnReceived(const char* const data, const size_t size)
+	{
+		if (size < StampSize)
+			return;
+
+		int64_t stamp = 0;
+		uint32_t index = 0;
+		memcpy(&stamp, data, sizeof stamp);
+		memcpy(&index, data + sizeof stamp, sizeof index);
+		if (index >= results_.size())
+			return;
+
+		const int64_t now = ProbeClock();
+		PhaseResult& result = *results_[index];
+		result.latency.Record(static_cast<uint64_t>(now > stamp ? now - stamp : 0));
+		result.bytes.fetch_add(size, memory_order_relaxed);
+		result.last.store(now, memory_order_relaxed);
+		result.received.fetch_add(1, memory_order_release);
+	}
+
+	vector<unique_ptr<PhaseResult>>& results_;
+};
+
+
+static uint64_t Received(const vector<unique_ptr<PhaseResult>>& results)
+{
+	uint64_t total = 0;
+	for (const auto& result : results)
+		total += result->received.load(memory_order_acquire);
+	return total;
+}
+
+
+static void PrintReport(const vector<Phase>& phases, const vector<unique_ptr<PhaseResult>>& results, const size_t senders)
+{
+	printf("%-5s %-32s %10s %10s %8s %12s %12s %10s %10s %10s %10s\n"
+		, "phase", "profile", "sent", "received", "loss%", "msgs/s", "MB/s", "p50 us", "p99 us", "p999 us", "max us");
+
+	uint64_t sent = 0;
+	uint64_t received = 0;
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const PhaseResult& r = *results[i];
+		const auto latency = r.latency.Summarise();
+		const int64_t started = r.started.load();
+		const double planned = phases[i % phases.size()].seconds;
+		const double seconds = r.last.load() > started ? max(planned, (r.last.load() - started) / 1e9) : planned;
+
+		string profile = phases[i % phases.size()].line;
+		profile.erase(0, profile.find_first_not_of(" \t"));
+		profile.erase(profile.find_last_not_of(" \t\r") + 1);
+		printf("%-5zu %-32.32s %10llu %10llu %8.3f %12.1f %12.3f %10.1f %10.1f %10.1f %10.1f\n"
+			, i, profile.c_str()
+			, static_cast<unsigned long long>(r.sent.load()), static_cast<unsigned long long>(r.received.load())
+			, r.sent ? 100.0 * (1.0 - static_cast<double>(r.received) / r.sent) : 0.0
+			, r.received / seconds, r.bytes / seconds / 1e6
+			, latency.p50.count() / 1e3, latency.p99.count() / 1e3, latency.p999.count() / 1e3, latency.max.count() / 1e3);
+		sent += r.sent;
+		received += r.received;
+	}
+	printf("total: %zu senders, %llu sent, %llu received, %.3f%% lost\n", senders
+		, static_cast<unsigned long long>(sent), static_cast<unsigned long long>(received)
+		, sent ? 100.0 * (1.0 - static_cast<double>(received) / sent) : 0.0);
+}
+
+
+static int Usage()
+{
+	fprintf(stderr, "usage: chatter_load [--senders N] [--ip IP] [--port P] [--repeat N] [--seed S] [--reliable] [--verbose] <profile>\n");
+	return 2;
+}
+
+
+int main(int argc, char* argv[])
+{
+	size_t senders = 1;
+	string ip = "127.0.0.1";
+	unsigned long port = 2300;
+	size_t repeat = 1;
+	uint64_t seed = 1;
+	bool reliable = false;
+	bool verbose = false;
+	string profile_path;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const string arg = argv[i];
+		const bool has_value = i + 1 < argc;
+		if (arg == "--senders" && has_value)
+			senders = strtoul(argv[++i], nullptr, 10);
+		else if (arg == "--ip" && has_value)
+			ip = argv[++i];
+		else if (arg == "--port" && has_value)
+			port = strtoul(argv[++i], nullptr, 10);
+		else if (arg == "--repeat" && has_value)
+			repeat = strtoul(argv[++i], nullptr, 10);
+		else if (arg == "--seed" && has_value)
+			seed = strtoull(argv[++i], nullptr, 10);
+		else if (arg == "--reliable")
+			reliable = true;
+		else if (arg == "--verbose")
+			verbose = true;
+		else if (arg[0] != '-' && profile_path.empty())
+			profile_path = arg;
+		else
+			return Usage();
+	}
+	if (profile_path.empty() || senders == 0 || repeat == 0 || port == 0 || port + senders > 65535)
+		return Usage();
+
+	ifstream file(profile_path);
+	if (!file)
+	{
+		fprintf(stderr, "chatter_load: cannot open %s\n", profile_path.c_str());
+		return 1;
+	}
+	vector<Phase> phases;
+	string error;
+	if (!ParseProfile(file, phases, error))
+	{
+		fprintf(stderr, "chatter_load: %s: %s\n", profile_path.c_str(), error.c_str());
+		return 1;
+	}
+
+	Logger::Instance().SetOutput(stderr);
+	Logger::Instance().SetLevel(verbose ? LogLevel::Info : LogLevel::Warning);
+
+	const string receiver_endpoint = ip + ":" + to_string(port);
+	vector<string> sender_endpoints;
+	for (size_t i = 0; i < senders; ++i)
+		sender_endpoints.push_back(ip + ":" + to_string(port + 1 + i));
+
+	vector<unique_ptr<PhaseResult>> results;
+	for (size_t i = 0; i < phases.size() * repeat; ++i)
+		results.push_back(make_unique<PhaseResult>());
+
+	UdpChatChannel receiver(receiver_endpoint, sender_endpoints);
+	vector<unique_ptr<UdpChatChannel>> channels;
+	for (const auto& endpoint : sender_endpoints)
+		channels.push_back(make_unique<UdpChatChannel>(endpoint, receiver_endpoint));
+
+	LoadHandler handler(results);
+	receiver.SetCallbackHandler(&handler);
+	if (reliable)
+		receiver.EnableReliableDelivery();
+	if (!receiver.Initialise())
+	{
+		fprintf(stderr, "chatter_load: cannot bind %s\n", receiver_endpoint.c_str());
+		return 1;
+	}
+	for (size_t i = 0; i < channels.size(); ++i)
+	{
+		if (reliable)
+			channels[i]->EnableReliableDelivery();
+		if (!channels[i]->Initialise())
+		{
+			fprintf(stderr, "chatter_load: cannot bind %s\n", sender_endpoints[i].c_str());
+			return 1;
+		}
+	}
+
+	//Every sender runs each phase, the phases start together
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const Phase& phase = phases[i % phases.size()];
+		PhaseResult& result = *results[i];
+		fprintf(stderr, "phase %zu: %s\n", i, phase.line.c_str());
+		result.started = ProbeClock();
+
+		vector<thread> threads;
+		for (size_t s = 0; s < channels.size(); ++s)
+		{
+			UdpChatChannel* const channel = channels[s].get();
+			threads.emplace_back([&, channel, s]
+			{
+				mt19937_64 random(seed + i * channels.size() + s);
+				Replay(*channel, phase, static_cast<uint32_t>(i), result, random);
+			});
+		}
+		for (auto& t : threads)
+			t.join();
+	}
+
+	//Let whatever is still in flight (or being retransmitted) arrive
+	uint64_t seen = Received(results);
+	auto last_progress = steady_clock::now();
+	while (steady_clock::now() - last_progress < Drain)
+	{
+		this_thread::sleep_for(milliseconds(10));
+		const uint64_t now = Received(results);
+		if (now != seen)
+		{
+			seen = now;
+			last_progress = steady_clock::now();
+		}
+	}
+
+	PrintReport(phases, results, senders);
+	return 0;
+}
@@ -0,0 +1,12 @@
+# chatter_load profile: one phase per line, run in order
+#
+#   constant <seconds> <rate> <size>
+#   burst    <seconds> <rate> <size> <burst>
+#   poisson  <seconds> <rate> <size>
+#
+# rate is messages per second per sender, size is bytes per message
+
+constant 5   1000   256
+burst    5   1000   256   100     # 100 messages every 100ms
+poisson  5   1000   256
+constant 5   200    8192          # fragmented messages
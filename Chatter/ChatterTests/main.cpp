@@ -1,6 +1,8 @@
 #include "Chatter.h"
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
+#include <numeric>
+#include <set>
 
 
 using namespace testing;
@@ -25,7 +27,7 @@ struct MockChatterView : public ChatterView
 	MOCK_METHOD1(SetStatus, void(const std::string&));
 	MOCK_CONST_METHOD0(GetMessage, std::string());
 	MOCK_CONST_METHOD0(GetMessageLength, size_t());
-	MOCK_METHOD1(AppendToChatHistory, void(const std::string&));
+	MOCK_METHOD0(ChatHistoryChanged, void());
 	MOCK_METHOD1(SetMessage, void(const std::string&));
 };
 
@@ -77,6 +79,30 @@ TEST(UdpChatChannel, Initialise_ReturnsFalseWhenChannelAlreadyInitialised)
 }
 
 
+TEST(UdpChatChannel, Initialise_CanBeRetriedAfterFailing)
+{
+	UdpChatChannel channel1("127.0.0.1:2000", "127.0.0.1:2001");
+	UdpChatChannel channel2("127.0.0.1:2001", "127.0.0.1:2000");
+	{
+		SocketOptions exclusive;
+		exclusive.reuse_address = false;
+		UdpSocket occupant(2001, "127.0.0.1", exclusive);
+		ASSERT_TRUE(occupant.Bind());
+		ASSERT_FALSE(channel2.Initialise());
+		ASSERT_FALSE(channel2.IsOpen());
+		ASSERT_EQ(0u, channel2.ReceiveShardCount());
+	}
+
+	ASSERT_TRUE(channel2.Initialise());
+	ASSERT_EQ(1u, channel2.ReceiveShardCount());
+	ASSERT_TRUE(channel1.Initialise());
+
+	channel1.SendMessage("hello");
+	while (!channel2.ReceivedMessageCount())
+		this_thread::sleep_for(1ms);
+}
+
+
 TEST(UdpChatChannel, OnMessageReceivedIsCalledWhenMessageIsReceived)
 {
 	UdpChatChannel channel1("127.0.0.1:2000", "127.0.0.1:2001");
@@ -84,21 +110,1738 @@ TEST(UdpChatChannel, OnMessageReceivedIsCalledWhenMessageIsReceived)
 	ASSERT_TRUE(channel1.Initialise());
 	ASSERT_TRUE(channel2.Initialise());
 
-	MockChannelCallbackHandler handler;
+	MockChannelCallbackHandler handler;
+	channel2.SetCallbackHandler(&handler);
+	EXPECT_CALL(handler, OnMessageReceived("hi, how are you?\n"));
+
+	channel1.SendMessage("hi, how are you?\n");
+
+	//busy wait until the message is received 
+	while (!channel2.ReceivedMessageCount())
+	{
+		using namespace chrono;
+		this_thread::sleep_for(100ms);
+	}
+}
+
+
+TEST(UdpChatChannel, ReceiveMessage_ReturnsWhatNoHandlerTook)
+{
+	UdpChatChannel channel1("127.0.0.1:2000", "127.0.0.1:2001");
+	UdpChatChannel channel2("127.0.0.1:2001", "127.0.0.1:2000");
+	string message;
+	ASSERT_FALSE(channel2.ReceiveMessage(message));
+	ASSERT_TRUE(channel1.Initialise());
+	ASSERT_TRUE(channel2.Initialise());
+
+	channel1.SendMessage("one");
+	channel1.SendMessage(string(5000, 'x'));
+	while (channel2.ReceivedMessageCount() < 2)
+		this_thread::sleep_for(1ms);
+
+	ASSERT_TRUE(channel2.ReceiveMessage(message));
+	EXPECT_EQ("one", message);
+	ASSERT_TRUE(channel2.ReceiveMessage(message));
+	EXPECT_EQ(string(5000, 'x'), message);
+	ASSERT_FALSE(channel2.ReceiveMessage(message));
+}
+
+
+TEST(UdpChatChannel, ToString_ListsAllPeers)
+{
+	UdpChatChannel channel("127.0.0.1:2000", vector<string>{ "127.0.0.1:2001", "127.0.0.1:2002" });
+
+	ASSERT_EQ(2u, channel.PeerCount());
+	ASSERT_EQ("127.0.0.1:2000 <---> 127.0.0.1:2001, 127.0.0.1:2002", channel.ToString());
+}
+
+
+TEST(UdpChatChannel, AddPeer_RejectsDuplicatesAndRemovePeerForgetsThem)
+{
+	UdpChatChannel channel("127.0.0.1:2000", "127.0.0.1:2001");
+
+	ASSERT_FALSE(channel.AddPeer("127.0.0.1:2001"));
+	ASSERT_TRUE(channel.AddPeer("127.0.0.1:2002"));
+	ASSERT_TRUE(channel.RemovePeer("127.0.0.1:2001"));
+	ASSERT_FALSE(channel.RemovePeer("127.0.0.1:2001"));
+	ASSERT_EQ("127.0.0.1", channel.GetPeerIpAddress());
+	ASSERT_EQ(2002u, channel.GetPeerPort());
+}
+
+
+TEST(UdpChatChannel, SendMessage_FansOutToAllPeers)
+{
+	UdpChatChannel hub("127.0.0.1:2010", vector<string>{ "127.0.0.1:2011", "127.0.0.1:2012" });
+	UdpChatChannel peer1("127.0.0.1:2011", "127.0.0.1:2010");
+	UdpChatChannel peer2("127.0.0.1:2012", "127.0.0.1:2010");
+	ASSERT_TRUE(hub.Initialise());
+	ASSERT_TRUE(peer1.Initialise());
+	ASSERT_TRUE(peer2.Initialise());
+
+	hub.SendMessage("hello group");
+	peer2.SendMessage("hi hub");
+
+	while (!peer1.ReceivedMessageCount() || !peer2.ReceivedMessageCount() || !hub.ReceivedMessageCount())
+		this_thread::sleep_for(1ms);
+
+	ASSERT_EQ(1u, hub.PeerReceivedMessageCount("127.0.0.1:2012"));
+	ASSERT_EQ(0u, hub.PeerReceivedMessageCount("127.0.0.1:2011"));
+}
+
+
+TEST(UdpChatChannel, DatagramsFromUnknownSendersAreDropped)
+{
+	UdpChatChannel channel("127.0.0.1:2010", "127.0.0.1:2011");
+	ASSERT_TRUE(channel.Initialise());
+	MockChannelCallbackHandler handler;
+	channel.SetCallbackHandler(&handler);
+	EXPECT_CALL(handler, OnMessageReceived(_)).Times(0);
+
+	UdpSocket stranger(2010, "127.0.0.1");
+	stranger.SendTo("127.0.0.1", string("who am I?"));
+
+	while (!channel.UnknownSenderCount())
+		this_thread::sleep_for(1ms);
+	ASSERT_EQ(0u, channel.ReceivedMessageCount());
+}
+
+
+TEST(MulticastChatChannel, ToString_ReturnsInterfaceAndGroup)
+{
+	MulticastChatChannel channel("239.255.0.1:3000", "127.0.0.1");
+
+	ASSERT_EQ("239.255.0.1", channel.GetGroupIpAddress());
+	ASSERT_EQ(3000u, channel.GetGroupPort());
+	ASSERT_EQ("127.0.0.1 <---> 239.255.0.1:3000 (multicast)", channel.ToString());
+}
+
+
+TEST(MulticastChatChannel, Initialise_ReturnsFalseWhenChannelAlreadyInitialised)
+{
+	MulticastChatChannel channel("239.255.0.1:3000", "127.0.0.1");
+	ASSERT_TRUE(channel.Initialise());
+	ASSERT_TRUE(channel.IsOpen());
+	ASSERT_FALSE(channel.Initialise());
+}
+
+
+TEST(MulticastChatChannel, OneSendReachesEveryOtherMemberButNotTheSender)
+{
+	MulticastChatChannel member1("239.255.0.1:3000", "127.0.0.1");
+	MulticastChatChannel member2("239.255.0.1:3000", "127.0.0.1");
+	MulticastChatChannel member3("239.255.0.1:3000", "127.0.0.1");
+	ASSERT_TRUE(member1.Initialise());
+	ASSERT_TRUE(member2.Initialise());
+	ASSERT_TRUE(member3.Initialise());
+
+	MockChannelCallbackHandler handler;
+	member2.SetCallbackHandler(&handler);
+	EXPECT_CALL(handler, OnMessageReceived("hello everyone\n"));
+	EXPECT_CALL(handler, OnMessageReceived("and back"));
+
+	member1.SendMessage("hello everyone\n");
+
+	while (!member2.ReceivedMessageCount() || !member3.ReceivedMessageCount())
+		this_thread::sleep_for(1ms);
+
+	member3.SendMessage("and back");
+	while (!member1.ReceivedMessageCount() || member2.ReceivedMessageCount() < 2)
+		this_thread::sleep_for(1ms);
+	ASSERT_EQ(1u, member3.ReceivedMessageCount());
+}
+
+
+TEST(MulticastChatChannel, ReceiveMessage_ReturnsWhatNoHandlerTook)
+{
+	MulticastChatChannel member1("239.255.0.1:3000", "127.0.0.1");
+	MulticastChatChannel member2("239.255.0.1:3000", "127.0.0.1");
+	string message;
+	ASSERT_TRUE(member1.Initialise());
+	ASSERT_TRUE(member2.Initialise());
+	ASSERT_FALSE(member2.ReceiveMessage(message));
+
+	member1.SendMessage("one");
+	member1.SendMessage(string(5000, 'x'));
+	while (member2.ReceivedMessageCount() < 2)
+		this_thread::sleep_for(1ms);
+
+	ASSERT_TRUE(member2.ReceiveMessage(message));
+	EXPECT_EQ("one", message);
+	ASSERT_TRUE(member2.ReceiveMessage(message));
+	EXPECT_EQ(string(5000, 'x'), message);
+	ASSERT_FALSE(member2.ReceiveMessage(message));
+	ASSERT_FALSE(member1.ReceiveMessage(message));
+}
+
+
+TEST(MulticastChatChannel, OwnMessagesAreToldApartBySenderId)
+{
+	MulticastChatChannel member1("239.255.0.1:3000", "127.0.0.1");
+	MulticastChatChannel member2("239.255.0.1:3000", "127.0.0.1");
+	ASSERT_TRUE(member1.Initialise());
+	ASSERT_TRUE(member2.Initialise());
+
+	//From another socket, but carrying member1's sender id
+	MessageEncoder encoder(member1.SenderId());
+	ASSERT_EQ(1u, encoder.Encode("echo", 4));
+	UdpSocket other(0, "127.0.0.1");
+	ASSERT_TRUE(other.Bind());
+	ASSERT_TRUE(other.SetMulticastInterface("127.0.0.1"));
+	sockaddr_in group = {};
+	group.sin_family = AF_INET;
+	group.sin_addr.s_addr = inet_addr("239.255.0.1");
+	group.sin_port = htons(3000);
+	other.SendTo(group, encoder.Frame(0));
+
+	while (!member2.ReceivedMessageCount())
+		this_thread::sleep_for(1ms);
+	member2.SendMessage("and back");
+	while (!member1.ReceivedMessageCount())
+		this_thread::sleep_for(1ms);
+	EXPECT_EQ(1u, member1.ReceivedMessageCount());
+	EXPECT_EQ(1u, member2.ReceivedMessageCount());
+}
+
+
+TEST(UdpChatChannel, MessagesLongerThan150BytesArriveIntact)
+{
+	UdpChatChannel channel1("127.0.0.1:2000", "127.0.0.1:2001");
+	UdpChatChannel channel2("127.0.0.1:2001", "127.0.0.1:2000");
+	ASSERT_TRUE(channel1.Initialise());
+	ASSERT_TRUE(channel2.Initialise());
+
+	const string message(1500, 'x');
+	MockChannelCallbackHandler handler;
+	channel2.SetCallbackHandler(&handler);
+	EXPECT_CALL(handler, OnMessageReceived(message));
+
+	channel1.SendMessage(message);
+
+	while (!channel2.ReceivedMessageCount())
+		this_thread::sleep_for(1ms);
+	ASSERT_EQ(2u, channel2.FrameStats().frames);
+	ASSERT_EQ(0u, channel2.FrameStats().lost);
+}
+
+
+TEST(UdpChatChannel, LargeMessagesAreFragmentedAndReassembled)
+{
+	UdpChatChannel channel1("127.0.0.1:2000", "127.0.0.1:2001");
+	UdpChatChannel channel2("127.0.0.1:2001", "127.0.0.1:2000");
+	ASSERT_TRUE(channel1.Initialise());
+	ASSERT_TRUE(channel2.Initialise());
+
+	string message(20000, '\0');
+	for (size_t i = 0; i < message.size(); ++i)
+		message[i] = static_cast<char>('a' + i % 26);
+	MockChannelCallbackHandler handler;
+	channel2.SetCallbackHandler(&handler);
+	EXPECT_CALL(handler, OnMessageReceived(message));
+
+	channel1.SendMessage(message);
+
+	while (!channel2.ReceivedMessageCount())
+		this_thread::sleep_for(1ms);
+	ASSERT_EQ(1u, channel2.ReassemblyStats().completed);
+	ASSERT_EQ(0u, channel2.ReassemblyStats().in_progress);
+	ASSERT_EQ(1u, channel2.PeerReceivedMessageCount("127.0.0.1:2000"));
+}
+
+
+TEST(UdpChatChannel, AbandonedReassemblyExpiresWithoutFurtherTraffic)
+{
+	UdpChatChannel channel("127.0.0.1:2001", "127.0.0.1:2000");
+	channel.SetReassemblyTimeout(milliseconds(40));
+	ASSERT_TRUE(channel.Initialise());
+
+	MessageEncoder encoder(1);
+	const string message(5000, 'x');
+	ASSERT_LT(1u, encoder.Encode(message.data(), message.size()));
+	UdpSocket peer(2000, "127.0.0.1");
+	ASSERT_TRUE(peer.Bind());
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = inet_addr("127.0.0.1");
+	address.sin_port = htons(2001);
+	peer.SendTo(address, encoder.Frame(0));	//and then goes quiet
+
+	const auto deadline = steady_clock::now() + 5s;
+	while (!channel.ReassemblyStats().expired && steady_clock::now() < deadline)
+		this_thread::sleep_for(1ms);
+	EXPECT_EQ(1u, channel.ReassemblyStats().expired);
+	EXPECT_EQ(0u, channel.ReassemblyStats().in_progress);
+	EXPECT_EQ(0u, channel.ReassemblyStats().bytes_held);
+}
+
+
+TEST(UdpChatChannel, ReliableDeliveryKeepsMessagesInOrder)
+{
+	UdpChatChannel channel1("127.0.0.1:2000", "127.0.0.1:2001");
+	UdpChatChannel channel2("127.0.0.1:2001", "127.0.0.1:2000");
+	channel1.EnableReliableDelivery();
+	channel2.EnableReliableDelivery();
+	ASSERT_TRUE(channel1.Initialise());
+	ASSERT_TRUE(channel2.Initialise());
+
+	MockChannelCallbackHandler handler;
+	channel2.SetCallbackHandler(&handler);
+	{
+		InSequence in_order;
+		for (int i = 0; i < 100; ++i)
+			EXPECT_CALL(handler, OnMessageReceived("message " + to_string(i)));
+	}
+
+	for (int i = 0; i < 100; ++i)
+		channel1.SendMessage("message " + to_string(i));
+
+	while (channel2.ReceivedMessageCount() < 100 || channel1.ReliabilityStats("127.0.0.1:2001").send.in_flight)
+		this_thread::sleep_for(1ms);
+	const auto stats = channel1.ReliabilityStats("127.0.0.1:2001");
+	EXPECT_EQ(100u, stats.send.sent);
+	EXPECT_EQ(0u, stats.send.queued);
+	EXPECT_LT(0u, stats.acks_received);
+	EXPECT_EQ(100u, channel2.ReliabilityStats("127.0.0.1:2000").receive.delivered);
+	EXPECT_EQ(100u, channel2.PeerReceivedMessageCount("127.0.0.1:2000"));
+	EXPECT_EQ(0u, channel1.PeerReceivedMessageCount("127.0.0.1:2001"));	//only acks
+}
+
+
+TEST(UdpChatChannel, ReliableChannelHoldingFramesBackIsDestroyedCleanly)
+{
+	auto channel = make_unique<UdpChatChannel>("127.0.0.1:2001", "127.0.0.1:2000");
+	channel->EnableReliableDelivery();
+	ASSERT_TRUE(channel->Initialise());
+
+	ReliableLink sender(1, ReliableOptions());
+	vector<string> wire;
+	sender.Queue("one", 3);
+	sender.Queue("two", 3);
+	sender.Queue("three", 5);
+	sender.Poll(ReliableLink::Clock::now(), [&](const string& frame) { wire.push_back(frame); });
+	ASSERT_EQ(3u, wire.size());
+
+	UdpSocket peer(2000, "127.0.0.1");
+	ASSERT_TRUE(peer.Bind());
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = inet_addr("127.0.0.1");
+	address.sin_port = htons(2001);
+	peer.SendTo(address, wire[0]);
+	peer.SendTo(address, wire[2]);	//"two" is lost, "three" waits in the window
+
+	while (!channel->ReliabilityStats("127.0.0.1:2000").receive.reordered)
+		this_thread::sleep_for(1ms);
+	EXPECT_EQ(1u, channel->ReceivedMessageCount());
+	EXPECT_LT(0u, channel->PoolStats().in_use);
+	channel.reset();
+}
+
+
+TEST(UdpChatChannel, ShardedReceiveKeepsEachSendersOrder)
+{
+	const vector<string> senders = { "127.0.0.1:2011", "127.0.0.1:2012", "127.0.0.1:2013", "127.0.0.1:2014" };
+	UdpChatChannel receiver("127.0.0.1:2010", senders);
+	receiver.SetReceiveShards(4);
+	ASSERT_TRUE(receiver.Initialise());
+	ASSERT_EQ(4u, receiver.ReceiveShardCount());
+	EXPECT_TRUE(receiver.EffectiveSocketOptions().reuse_port);
+
+	MockChannelCallbackHandler handler;
+	receiver.SetCallbackHandler(&handler);
+	Sequence sequences[4];
+	for (int i = 0; i < 50; ++i)
+		for (int s = 0; s < 4; ++s)
+			EXPECT_CALL(handler, OnMessageReceived(to_string(s) + ':' + to_string(i))).InSequence(sequences[s]);
+
+	vector<unique_ptr<UdpChatChannel>> channels;
+	for (const auto& sender : senders)
+	{
+		channels.push_back(make_unique<UdpChatChannel>(sender, "127.0.0.1:2010"));
+		ASSERT_TRUE(channels.back()->Initialise());
+	}
+
+	vector<thread> threads;
+	for (int s = 0; s < 4; ++s)
+	{
+		threads.emplace_back([&, s]
+		{
+			for (int i = 0; i < 50; ++i)
+				channels[s]->SendMessage(to_string(s) + ':' + to_string(i));
+		});
+	}
+	for (auto& t : threads)
+		t.join();
+
+	while (receiver.ReceivedMessageCount() < 200)
+		this_thread::sleep_for(1ms);
+	const auto counts = receiver.ShardReceivedMessageCounts();
+	EXPECT_EQ(200u, accumulate(counts.begin(), counts.end(), size_t(0)));
+}
+
+
+TEST(UdpChatChannel, SendRateLimitBlocksTheSender)
+{
+	UdpChatChannel channel1("127.0.0.1:2000", "127.0.0.1:2001");
+	ASSERT_TRUE(channel1.Initialise());
+	channel1.SetSendRateLimit(100000, 1000);
+
+	const auto start = steady_clock::now();
+	for (int i = 0; i < 5; ++i)
+		channel1.SendMessage(string(1000, 'x'));
+	EXPECT_LE(30ms, steady_clock::now() - start);
+}
+
+
+TEST(UdpChatChannel, PacedSenderWakesWhenTheLimitIsLifted)
+{
+	UdpChatChannel channel1("127.0.0.1:2000", "127.0.0.1:2001");
+	ASSERT_TRUE(channel1.Initialise());
+	channel1.SetSendRateLimit(2000, 1000);
+	channel1.SendMessage(string(1000, 'x'));
+	channel1.SendMessage(string(1000, 'x'));	//1000 bytes in debt: the next waits 500ms
+
+	thread sender([&] { channel1.SendMessage(string(1000, 'x')); });
+	this_thread::sleep_for(20ms);
+	const auto start = steady_clock::now();
+	channel1.SetSendRateLimit(0, 0);
+	sender.join();
+	EXPECT_GT(250ms, steady_clock::now() - start);
+}
+
+
+TEST(Reactor, Stop_UnblocksRun)
+{
+	Reactor reactor;
+	ASSERT_TRUE(reactor.IsOpen());
+
+	thread worker(&Reactor::Run, &reactor);
+	reactor.Stop();
+	worker.join();
+}
+
+
+TEST(Reactor, ReadableSocketIsDispatched)
+{
+	UdpSocket receiver(2002, "127.0.0.1");
+	ASSERT_TRUE(receiver.Bind());
+	UdpSocket sender(2002, "127.0.0.1");
+
+	Reactor reactor;
+	size_t received = 0;
+	ASSERT_TRUE(reactor.Watch(receiver.Handle(), [&]
+	{
+		while (receiver.RecvFrom<string>(64).second.size())
+			received++;
+		if (received == 3)
+			reactor.Stop();
+	}));
+
+	sender.SendTo("127.0.0.1", string("one"));
+	sender.SendTo("127.0.0.1", string("two"));
+	sender.SendTo("127.0.0.1", string("three"));
+	reactor.Run();
+
+	ASSERT_EQ(3u, received);
+}
+
+
+TEST(Reactor, TimersFireOnTheReactorThreadUnlessCancelled)
+{
+	Reactor reactor;
+	atomic<int> ticks(0);
+	atomic<bool> cancelled_fired(false);
+	thread::id fired_on;
+	const auto cancelled = reactor.After(milliseconds(5), [&] { cancelled_fired = true; });
+	reactor.After(milliseconds(20), [&]
+	{
+		fired_on = this_thread::get_id();
+		reactor.Stop();
+	});
+	ASSERT_TRUE(reactor.Every(milliseconds(2), [&] { ticks++; }));
+	ASSERT_TRUE(reactor.Cancel(cancelled));
+
+	const auto start = steady_clock::now();
+	thread worker(&Reactor::Run, &reactor);
+	const auto id = worker.get_id();
+	worker.join();
+
+	EXPECT_GE(steady_clock::now() - start, milliseconds(20));
+	EXPECT_EQ(id, fired_on);
+	EXPECT_FALSE(cancelled_fired);
+	EXPECT_LE(5, ticks.load());
+	EXPECT_FALSE(reactor.Cancel(cancelled));
+}
+
+
+TEST(UdpSocket, SendBatch_DatagramsArriveInOneRecvBatch)
+{
+	UdpSocket receiver(2002, "127.0.0.1");
+	ASSERT_TRUE(receiver.Bind());
+	UdpSocket sender;
+
+	sockaddr_in to = { 0 };
+	to.sin_family = AF_INET;
+	to.sin_port = htons(2002);
+	to.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+	const string payloads[] = { "alpha", "bravo", "charlie" };
+	Datagram out[3];
+	for (size_t i = 0; i < 3; ++i)
+		out[i] = Datagram{ to, payloads[i].data(), payloads[i].size(), false };
+	ASSERT_EQ(3u, sender.SendBatch(out, 3));
+
+	DatagramBatch batch(8);
+	ASSERT_EQ(3u, receiver.RecvBatch(batch));
+	for (size_t i = 0; i < 3; ++i)
+	{
+		EXPECT_EQ(payloads[i], string(batch[i].data, batch[i].size));
+		EXPECT_FALSE(batch[i].truncated);
+	}
+	ASSERT_EQ(0u, receiver.RecvBatch(batch));
+}
+
+
+TEST(UdpSocket, RecvBatch_FlagsTruncatedDatagrams)
+{
+	UdpSocket receiver(2002, "127.0.0.1", 4, 16);
+	ASSERT_TRUE(receiver.Bind());
+	UdpSocket sender(2002, "127.0.0.1");
+	sender.SendTo("127.0.0.1", string(100, 'x'));
+
+	DatagramBatch batch(4);
+	ASSERT_EQ(1u, receiver.RecvBatch(batch));
+	EXPECT_TRUE(batch[0].truncated);
+	EXPECT_EQ(16u, batch[0].size);
+}
+
+
+TEST(UdpSocket, GatheredPartsArriveAsOneDatagram)
+{
+	UdpSocket receiver(2002, "127.0.0.1");
+	ASSERT_TRUE(receiver.Bind());
+	UdpSocket sender;
+
+	const IoSpan parts[] = { { "head", 4 }, { "er|", 3 }, { "body", 4 } };
+	ASSERT_EQ(11, sender.SendTo(receiver.LocalEndpoint(), parts, 3));
+	const GatherDatagram batch[] = { { receiver.LocalEndpoint(), parts, 2 }, { receiver.LocalEndpoint(), parts + 2, 1 } };
+	ASSERT_EQ(2u, sender.SendBatch(batch, 2));
+
+	DatagramBatch received(8);
+	ASSERT_EQ(3u, receiver.RecvBatch(received));
+	EXPECT_EQ("header|body", string(received[0].data, received[0].size));
+	EXPECT_EQ("header|", string(received[1].data, received[1].size));
+	EXPECT_EQ("body", string(received[2].data, received[2].size));
+}
+
+
+TEST(UdpSocket, ZeroCopySendHoldsBuffersUntilTheKernelIsDone)
+{
+	UdpSocket receiver(2002, "127.0.0.1", 4, 16 << 10);
+	ASSERT_TRUE(receiver.Bind());
+	SocketOptions options;
+	options.zerocopy = true;
+	UdpSocket sender(0, nullptr, options);
+
+	auto header = sender.Pool().Acquire();
+	auto body = BufferRef::Allocate(8000);
+	header.resize(16);
+	body.resize(8000);
+	fill(header.data(), header.data() + header.size(), 'h');
+	fill(body.data(), body.data() + body.size(), 'b');
+	const BufferRef parts[] = { header, body };
+	ASSERT_EQ(8016, sender.SendZeroCopy(receiver.LocalEndpoint(), parts, 2));
+
+	DatagramBatch received(1);
+	while (!receiver.RecvBatch(received))
+		this_thread::sleep_for(1ms);
+	EXPECT_EQ(string(16, 'h') + string(8000, 'b'), string(received[0].data, received[0].size));
+
+	if (!sender.EffectiveOptions().zerocopy)
+		return;	//kernel without SO_ZEROCOPY, sent with a plain copy
+	EXPECT_EQ(1u, sender.GetZeroCopyStats().sent);
+	while (sender.GetZeroCopyStats().outstanding)
+	{
+		sender.ReapZeroCopy();
+		this_thread::sleep_for(1ms);
+	}
+	EXPECT_EQ(1u, sender.GetZeroCopyStats().completed);
+}
+
+
+TEST(UdpSocket, SegmentedSendArrivesAsSeparateDatagrams)
+{
+	SocketOptions gro;
+	gro.gro = true;
+	UdpSocket receiver(2002, "127.0.0.1", gro, 16, 64 << 10);
+	ASSERT_TRUE(receiver.Bind());
+	SocketOptions gso;
+	gso.gso = true;
+	UdpSocket sender(0, nullptr, gso);
+
+	//Segments straddle the parts; the last one is short
+	string data(10500, '\0');
+	for (size_t i = 0; i < data.size(); ++i)
+		data[i] = static_cast<char>('a' + i / 1000);
+	const IoSpan parts[] = { { data.data(), 6300 }, { data.data() + 6300, 4200 } };
+	ASSERT_EQ(11u, sender.SendSegmented(receiver.LocalEndpoint(), parts, 2, 1000));
+
+	//Whether or not the kernel coalesced them, they are handed out one by one
+	vector<string> received;
+	for (int wait = 0; received.size() < 11 && wait < 1000;)
+	{
+		auto datagram = receiver.RecvFrom();
+		if (datagram.second.empty())
+		{
+			this_thread::sleep_for(1ms);
+			wait++;
+			continue;
+		}
+		received.emplace_back(datagram.second.data(), datagram.second.size());
+	}
+	ASSERT_EQ(11u, received.size());
+	for (size_t i = 0; i < 10; ++i)
+		EXPECT_EQ(string(1000, static_cast<char>('a' + i)), received[i]);
+	EXPECT_EQ(string(500, 'k'), received[10]);
+}
+
+
+TEST(UdpSocket, OptionsAreAppliedAndReadBack)
+{
+	SocketOptions options;
+	options.receive_buffer = 256 << 10;
+	options.send_buffer = 128 << 10;
+	options.reuse_port = true;
+	options.tos = 0x10;
+	UdpSocket socket(2002, "127.0.0.1", options);
+	ASSERT_TRUE(socket.IsOpen());
+
+	const auto effective = socket.EffectiveOptions();
+	EXPECT_LE(options.receive_buffer, effective.receive_buffer);
+	EXPECT_LE(options.send_buffer, effective.send_buffer);
+	EXPECT_TRUE(effective.reuse_address);
+	EXPECT_EQ(0x10, effective.tos);
+#ifdef SO_REUSEPORT
+	EXPECT_TRUE(effective.reuse_port);
+#endif
+}
+
+
+#ifdef __linux__
+TEST(UdpSocket, IoUringBackendReceivesBatches)
+{
+	SocketOptions options;
+	options.backend = SocketBackend::IoUring;
+	UdpSocket receiver(2002, "127.0.0.1", options);
+	ASSERT_TRUE(receiver.Bind());
+	if (receiver.Backend() != SocketBackend::IoUring)
+		return;	//kernel without io_uring, the socket fell back to system calls
+	EXPECT_NE(receiver.Handle(), receiver.EventHandle());
+
+	DatagramBatch batch(8);
+	ASSERT_EQ(0u, receiver.RecvBatch(batch));	//arms the receive
+
+	UdpSocket sender;
+	sockaddr_in to = receiver.LocalEndpoint();
+	const string payloads[] = { "alpha", "bravo", "charlie" };
+	Datagram out[3];
+	for (size_t i = 0; i < 3; ++i)
+		out[i] = Datagram{ to, payloads[i].data(), payloads[i].size(), false };
+	ASSERT_EQ(3u, sender.SendBatch(out, 3));
+
+	vector<string> received;
+	while (received.size() < 3)
+	{
+		for (const auto& d : batch)
+		{
+			EXPECT_EQ(d.buffer.data(), d.data);
+			received.emplace_back(d.data, d.size);
+		}
+		if (!receiver.RecvBatch(batch))
+			this_thread::sleep_for(1ms);
+	}
+	EXPECT_EQ(vector<string>(begin(payloads), end(payloads)), received);
+}
+
+
+TEST(UdpSocket, IoUringFallsBackToSystemCallsOnAHardError)
+{
+	SocketOptions options;
+	options.backend = SocketBackend::IoUring;
+	UdpSocket receiver(2002, "127.0.0.1", options);
+	ASSERT_TRUE(receiver.Bind());
+	if (receiver.Backend() != SocketBackend::IoUring)
+		return;
+
+	DatagramBatch batch(8);
+	ASSERT_EQ(0u, receiver.RecvBatch(batch));	//arms the receive
+
+	//Nothing listens on the connected port, so the ICMP reply fails the receive with ECONNREFUSED
+	sockaddr_in closed = receiver.LocalEndpoint();
+	closed.sin_port = htons(2009);
+	ASSERT_EQ(0, connect(receiver.Handle(), reinterpret_cast<const sockaddr*>(&closed), sizeof closed));
+	ASSERT_EQ(1, send(receiver.Handle(), "x", 1, 0));
+	for (int i = 0; i < 2000 && receiver.Backend() == SocketBackend::IoUring; ++i)
+	{
+		receiver.RecvBatch(batch);
+		this_thread::sleep_for(1ms);
+	}
+	ASSERT_EQ(SocketBackend::Syscall, receiver.Backend());
+
+	sockaddr unspecified = {};
+	unspecified.sa_family = AF_UNSPEC;
+	connect(receiver.Handle(), &unspecified, sizeof unspecified);
+	receiver.RecvBatch(batch);
+
+	//The ring still signals readiness, now of the socket itself
+	UdpSocket sender;
+	ASSERT_LT(0, sender.SendTo(receiver.LocalEndpoint(), string("after")));
+	pollfd ring = { receiver.EventHandle(), POLLIN, 0 };
+	ASSERT_EQ(1, poll(&ring, 1, 2000));
+	ASSERT_EQ(1u, receiver.RecvBatch(batch));
+	EXPECT_EQ("after", string(batch[0].data, batch[0].size));
+}
+
+
+TEST(UdpChatChannel, IoUringBackendDeliversMessages)
+{
+	SocketOptions options;
+	options.receive_buffer = 1 << 20;
+	options.backend = SocketBackend::IoUring;
+	UdpChatChannel channel1("127.0.0.1:2000", "127.0.0.1:2001");
+	UdpChatChannel channel2("127.0.0.1:2001", "127.0.0.1:2000");
+	channel2.SetSocketOptions(options);
+	ASSERT_TRUE(channel1.Initialise());
+	ASSERT_TRUE(channel2.Initialise());
+
+	MockChannelCallbackHandler handler;
+	channel2.SetCallbackHandler(&handler);
+	{
+		InSequence in_order;
+		for (int i = 0; i < 500; ++i)
+			EXPECT_CALL(handler, OnMessageReceived("message " + to_string(i)));
+	}
+
+	for (int i = 0; i < 500; ++i)
+		channel1.SendMessage("message " + to_string(i));
+
+	while (channel2.ReceivedMessageCount() < 500)
+		this_thread::sleep_for(1ms);
+}
+
+
+TEST(UdpChatChannel, SegmentOffloadCarriesLargeMessages)
+{
+	SocketOptions options;
+	options.gso = true;
+	options.gro = true;
+	UdpChatChannel channel1("127.0.0.1:2000", "127.0.0.1:2001");
+	UdpChatChannel channel2("127.0.0.1:2001", "127.0.0.1:2000");
+	channel1.SetSocketOptions(options);
+	channel2.SetSocketOptions(options);
+	ASSERT_TRUE(channel1.Initialise());
+	ASSERT_TRUE(channel2.Initialise());
+
+	string message(50000, '\0');
+	for (size_t i = 0; i < message.size(); ++i)
+		message[i] = static_cast<char>('a' + i % 26);
+	MockChannelCallbackHandler handler;
+	channel2.SetCallbackHandler(&handler);
+	EXPECT_CALL(handler, OnMessageReceived(message));
+	EXPECT_CALL(handler, OnMessageReceived("after"));
+
+	channel1.SendMessage(message);
+	channel1.SendMessage("after");
+
+	while (channel2.ReceivedMessageCount() < 2)
+		this_thread::sleep_for(1ms);
+}
+#endif
+
+
+TEST(BufferPool, Acquire_ReusesReleasedBuffers)
+{
+	BufferPool pool(2, 32);
+	{
+		auto a = pool.Acquire();
+		auto b = a;
+		EXPECT_EQ(32u, a.capacity());
+		EXPECT_EQ(1u, pool.GetStats().in_use);
+	}
+	auto c = pool.Acquire();
+	auto d = pool.Acquire();
+
+	auto stats = pool.GetStats();
+	EXPECT_EQ(3u, stats.hits);
+	EXPECT_EQ(0u, stats.misses);
+	EXPECT_EQ(2u, stats.in_use);
+	EXPECT_EQ(2u, stats.high_water);
+}
+
+
+TEST(BufferPool, Acquire_FallsBackToHeapWhenExhausted)
+{
+	BufferPool pool(1, 32);
+	auto a = pool.Acquire();
+	auto b = pool.Acquire();
+
+	EXPECT_TRUE(static_cast<bool>(b));
+	EXPECT_EQ(1u, pool.GetStats().misses);
+	EXPECT_EQ(2u, pool.GetStats().high_water);
+}
+
+
+TEST(UdpSocket, RecvBatch_RecyclesPoolBuffers)
+{
+	UdpSocket receiver(2002, "127.0.0.1", 8, 64);
+	ASSERT_TRUE(receiver.Bind());
+	UdpSocket sender(2002, "127.0.0.1");
+
+	DatagramBatch batch(4);
+	for (int i = 0; i < 100; ++i)
+	{
+		sender.SendTo("127.0.0.1", string("ping"));
+		ASSERT_EQ(1u, receiver.RecvBatch(batch));
+		ASSERT_EQ("ping", batch[0].buffer.ToString());
+	}
+
+	EXPECT_EQ(0u, receiver.PoolStats().misses);
+	EXPECT_GE(8u, receiver.PoolStats().high_water);
+}
+
+
+TEST(SpscQueue, ItemsArePoppedInOrderAcrossThreads)
+{
+	SpscQueue<size_t> queue(64);
+	const size_t count = 100000;
+
+	thread producer([&]
+	{
+		for (size_t i = 0; i < count; ++i)
+			while (!queue.TryPush(size_t(i)))
+				this_thread::yield();
+	});
+
+	size_t expected = 0;
+	size_t out_of_order = 0;
+	while (expected < count)
+	{
+		if (!queue.ConsumeAll([&](size_t item) { out_of_order += item != expected++; }))
+			this_thread::yield();
+	}
+	producer.join();
+
+	ASSERT_EQ(0u, out_of_order);
+
+	size_t item;
+	ASSERT_FALSE(queue.TryPop(item));
+}
+
+
+TEST(SpscQueue, TryPush_FailsWhenFull)
+{
+	SpscQueue<int> queue(3);
+	ASSERT_EQ(4u, queue.Capacity());
+	for (int i = 0; i < 4; ++i)
+		ASSERT_TRUE(queue.TryPush(int(i)));
+	ASSERT_FALSE(queue.TryPush(4));
+
+	int item;
+	ASSERT_TRUE(queue.TryPop(item));
+	ASSERT_EQ(0, item);
+	ASSERT_TRUE(queue.TryPush(4));
+}
+
+
+static string ReadAll(FILE* const file)
+{
+	string text;
+	char chunk[256];
+	rewind(file);
+	while (const size_t n = fread(chunk, 1, sizeof chunk, file))
+		text.append(chunk, n);
+	return text;
+}
+
+
+TEST(Logger, ArgumentsAreCopiedAndFormattedLater)
+{
+	FILE* const file = tmpfile();
+	ASSERT_NE(nullptr, file);
+	{
+		Logger logger(16, file);
+		string name("peer");
+		sockaddr_in endpoint = { 0 };
+		endpoint.sin_family = AF_INET;
+		endpoint.sin_port = htons(2000);
+		endpoint.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+		logger.Write(LogLevel::Warning, "%s at %s sent %d bytes", name, endpoint, 42);
+		name = "changed";
+		logger.Write(LogLevel::Info, "no arguments");
+		logger.Flush();
+	}
+
+	const string text = ReadAll(file);
+	fclose(file);
+	EXPECT_NE(string::npos, text.find("WARN  peer at 127.0.0.1:2000 sent 42 bytes\n"));
+	EXPECT_NE(string::npos, text.find("INFO  no arguments\n"));
+}
+
+
+TEST(Logger, LongStringsAreCutShortVisibly)
+{
+	FILE* const file = tmpfile();
+	ASSERT_NE(nullptr, file);
+	{
+		Logger logger(16, file);
+		logger.Write(LogLevel::Info, "[%s]", string(Logger::LogText::Size - 1, 'a'));
+		logger.Write(LogLevel::Info, "[%s]", string(200, 'b'));
+		logger.Flush();
+	}
+
+	const string text = ReadAll(file);
+	fclose(file);
+	EXPECT_NE(string::npos, text.find("[" + string(Logger::LogText::Size - 1, 'a') + "]\n"));
+	EXPECT_NE(string::npos, text.find("[" + string(Logger::LogText::Size - 4, 'b') + "...]\n"));
+}
+
+
+TEST(Logger, FullRingDropsInsteadOfBlocking)
+{
+	FILE* const file = tmpfile();
+	ASSERT_NE(nullptr, file);
+	Logger logger(4, file);
+	ASSERT_FALSE(logger.Enabled(LogLevel::Debug));
+	logger.SetLevel(LogLevel::Debug);
+	ASSERT_TRUE(logger.Enabled(LogLevel::Debug));
+
+	const size_t count = 10000;
+	for (size_t i = 0; i < count; ++i)
+		logger.Write(LogLevel::Debug, "record %lu", static_cast<unsigned long>(i));
+	logger.Flush();
+
+	const auto stats = logger.GetStats();
+	EXPECT_EQ(count, stats.written + stats.dropped);
+	EXPECT_LT(0u, stats.written);
+	fclose(file);
+}
+
+
+TEST(LatencyHistogram, EveryValueFallsInsideItsBucket)
+{
+	for (uint64_t value = 0; value < (uint64_t(1) << 40); value = value * 3 / 2 + 1)
+	{
+		const size_t index = LatencyHistogram::Index(value);
+		EXPECT_LE(LatencyHistogram::LowestValue(index), value);
+		EXPECT_GT(LatencyHistogram::LowestValue(index + 1), value);
+	}
+}
+
+
+TEST(LatencyHistogram, PercentilesAreWithinBucketPrecision)
+{
+	LatencyHistogram histogram;
+	for (int us = 1; us <= 10000; ++us)
+		histogram.Record(microseconds(us));
+
+	const auto summary = histogram.Summarise();
+	EXPECT_EQ(10000u, summary.count);
+	EXPECT_NEAR(5000, duration_cast<microseconds>(summary.p50).count(), 5000 * 0.04);
+	EXPECT_NEAR(9900, duration_cast<microseconds>(summary.p99).count(), 9900 * 0.04);
+	EXPECT_NEAR(9990, duration_cast<microseconds>(summary.p999).count(), 9990 * 0.04);
+	EXPECT_EQ(microseconds(10000), summary.max);
+	EXPECT_NEAR(5000, duration_cast<microseconds>(summary.mean).count(), 1);
+}
+
+
+TEST(UdpChatChannel, MetricsCountTrafficBothWays)
+{
+	UdpChatChannel channel1("127.0.0.1:2000", "127.0.0.1:2001");
+	UdpChatChannel channel2("127.0.0.1:2001", "127.0.0.1:2000");
+	ASSERT_TRUE(channel1.Initialise());
+	ASSERT_TRUE(channel2.Initialise());
+
+	for (int i = 0; i < 10; ++i)
+		channel1.SendMessage("0123456789");
+	channel1.SendMessage(string(5000, 'x'));
+
+	while (channel2.ReceivedMessageCount() < 11)
+		this_thread::sleep_for(1ms);
+
+	const auto sent = channel1.Metrics();
+	EXPECT_EQ(11u, sent.tx_messages);
+	EXPECT_EQ(5100u, sent.tx_bytes);
+	EXPECT_EQ(0u, sent.send_errors);
+	EXPECT_EQ(11u, sent.send.count);
+
+	const auto received = channel2.Metrics();
+	EXPECT_EQ(11u, received.rx_messages);
+	EXPECT_EQ(5100u, received.rx_bytes);
+	EXPECT_EQ(0u, received.drops);
+	EXPECT_EQ(11u, received.delivery.count);
+	EXPECT_GE(received.delivery.max, received.delivery.p50);
+}
+
+
+TEST(LatencyTracker, ProbeAndEchoRoundTrip)
+{
+	LatencyTracker prober, responder;
+	char frame[ProbeFrameSize];
+	EncodeProbe(prober.NextProbe(1000), 7, frame);
+	ASSERT_TRUE(IsProbeFrame(frame, sizeof frame));
+
+	FrameHeader header;
+	const char* payload = nullptr;
+	Probe probe, echo;
+	ASSERT_TRUE(DecodeFrame(frame, sizeof frame, header, payload));
+	ASSERT_TRUE(DecodeProbe(payload, header.payload_length, probe));
+	EXPECT_EQ(7u, header.sender_id);
+	ASSERT_TRUE(responder.OnProbe(probe, 1400, echo));
+
+	EncodeProbe(echo, 9, frame);
+	ASSERT_TRUE(DecodeFrame(frame, sizeof frame, header, payload));
+	ASSERT_TRUE(DecodeProbe(payload, header.payload_length, probe));
+	EXPECT_EQ(Probe::Echo, probe.kind);
+	ASSERT_FALSE(prober.OnProbe(probe, 2000, echo));
+
+	const auto sent = prober.GetStats();
+	EXPECT_EQ(1u, sent.probes_sent);
+	EXPECT_EQ(1u, sent.echoes_received);
+	EXPECT_NEAR(1000, sent.round_trip.max.count(), 1000 * 0.04);
+	EXPECT_NEAR(600, sent.one_way.max.count(), 600 * 0.04);
+	EXPECT_NEAR(400, responder.GetStats().one_way.max.count(), 400 * 0.04);
+}
+
+
+TEST(UdpChatChannel, LatencyProbesAreEchoedAndNotDelivered)
+{
+	UdpChatChannel channel1("127.0.0.1:2000", "127.0.0.1:2001");
+	UdpChatChannel channel2("127.0.0.1:2001", "127.0.0.1:2000");
+	channel1.EnableLatencyProbes(milliseconds(2));
+	ASSERT_TRUE(channel1.Initialise());
+	ASSERT_TRUE(channel2.Initialise());
+
+	while (channel1.PeerLatency("127.0.0.1:2001").echoes_received < 5)
+		this_thread::sleep_for(1ms);
+
+	const auto latency = channel1.PeerLatency("127.0.0.1:2001");
+	EXPECT_LE(5u, latency.round_trip.count);
+	EXPECT_LT(0, latency.round_trip.p50.count());
+	EXPECT_LE(5u, channel2.PeerLatency("127.0.0.1:2000").one_way.count);
+	EXPECT_EQ(0u, channel2.PeerLatency("127.0.0.1:2000").probes_sent);
+	EXPECT_EQ(0u, channel1.ReceivedMessageCount());
+	EXPECT_EQ(0u, channel2.ReceivedMessageCount());
+}
+
+
+TEST(LinkModel, SameSeedGivesTheSameOutcome)
+{
+	LinkConditions conditions;
+	conditions.latency = microseconds(100);
+	conditions.jitter = microseconds(50);
+	conditions.loss = 0.25;
+	conditions.duplicate = 0.1;
+	conditions.bandwidth = 1000000;	//a 1000 byte message takes 1ms to leave
+	LinkModel first(conditions), second(conditions);
+
+	size_t lost = 0, duplicated = 0;
+	for (int i = 0; i < 1000; ++i)
+	{
+		int64_t a[2], b[2];
+		const size_t copies = first.Transmit(0, 1000, a);
+		ASSERT_EQ(copies, second.Transmit(0, 1000, b));
+		lost += copies == 0;
+		duplicated += copies == 2;
+		for (size_t c = 0; c < copies; ++c)
+		{
+			ASSERT_EQ(a[c], b[c]);
+			EXPECT_GE(a[c], (i + 1) * 1000000LL + 100000);
+			EXPECT_LE(a[c], (i + 1) * 1000000LL + 150000);
+		}
+	}
+	EXPECT_NEAR(250, static_cast<double>(lost), 50);
+	EXPECT_NEAR(75, static_cast<double>(duplicated), 25);
+}
+
+
+TEST(InProcessChatChannel, MessagesArriveWhenTheSimulatedLatencyHasPassed)
+{
+	SimulatedClock clock;
+	LinkConditions conditions;
+	conditions.latency = milliseconds(5);
+	conditions.reorder = 1;
+	conditions.reorder_delay = milliseconds(1);
+	InProcessChatChannel channel1("alice", conditions, &clock);
+	InProcessChatChannel channel2("bob", LinkConditions(), &clock);
+	InProcessChatChannel::Connect(channel1, channel2);
+	ASSERT_TRUE(channel1.Initialise());
+	ASSERT_TRUE(channel2.Initialise());
+	EXPECT_EQ("alice <---> bob (in-process)", channel1.ToString());
+
+	StrictMock<MockChannelCallbackHandler> handler;
 	channel2.SetCallbackHandler(&handler);
+	channel1.SendMessage("one");
+	clock.Advance(milliseconds(3));
+	channel1.SendMessage("two");
+
+	ASSERT_EQ(0u, channel2.Poll());
+	clock.Advance(milliseconds(2));
+	ASSERT_EQ(0u, channel2.Poll());	//every message is held back 1ms
+
+	EXPECT_CALL(handler, OnMessageReceived("one"));
+	clock.Advance(milliseconds(1));
+	ASSERT_EQ(1u, channel2.Poll());
+
+	string message;
+	ASSERT_FALSE(channel2.ReceiveMessage(message));
+	clock.Advance(milliseconds(3));
+	ASSERT_TRUE(channel2.ReceiveMessage(message));
+	EXPECT_EQ("two", message);
+	EXPECT_EQ(2u, channel2.ReceivedMessageCount());
+}
+
+
+TEST(InProcessChatChannel, DeliveryThreadCallsTheHandler)
+{
+	InProcessChatChannel channel1("alice"), channel2("bob");
+	InProcessChatChannel::Connect(channel1, channel2);
+	ASSERT_TRUE(channel1.Initialise());
+	ASSERT_TRUE(channel2.Initialise());
+	ASSERT_FALSE(channel2.Initialise());
+
+	MockChannelCallbackHandler handler;
+	channel1.SetCallbackHandler(&handler);
 	EXPECT_CALL(handler, OnMessageReceived("hi, how are you?\n"));
 
-	channel1.SendMessage("hi, how are you?\n");
+	channel2.SendMessage("hi, how are you?\n");
+	while (!channel1.ReceivedMessageCount())
+		this_thread::yield();
+	EXPECT_EQ(1u, channel2.Metrics().tx_messages);
+}
 
-	//busy wait until the message is received 
-	while (!channel2.ReceivedMessageCount())
+
+TEST(TimerWheel, TimersFireInOrderAndNeverEarly)
+{
+	TimerWheel<int> wheel(nanoseconds(10), 4);	//a level 0 turn is 640ns
+	wheel.Schedule(25, 1);
+	wheel.Schedule(2000, 3);	//filed a level up
+	wheel.Schedule(21, 2);
+	wheel.Schedule(25, 4);
+	ASSERT_EQ(4u, wheel.Size());
+
+	vector<int> fired;
+	const auto record = [&fired](int& value) { fired.push_back(value); };
+	ASSERT_EQ(0u, wheel.Advance(29, record));
+	ASSERT_EQ(3u, wheel.Advance(30, record));
+	EXPECT_EQ((vector<int>{ 1, 2, 4 }), fired);
+
+	ASSERT_EQ(0u, wheel.Advance(1999, record));
+	ASSERT_EQ(1u, wheel.Advance(2000, record));
+	EXPECT_EQ(3, fired.back());
+	EXPECT_TRUE(wheel.Empty());
+}
+
+
+TEST(TimerWheel, CancelledTimersNeverFire)
+{
+	TimerWheel<int> wheel(nanoseconds(1), 4);
+	const auto near = wheel.Schedule(10, 1);
+	const auto far = wheel.Schedule(1000000, 2);
+	wheel.Schedule(1000000, 3);
+	ASSERT_TRUE(wheel.Cancel(near));
+	ASSERT_TRUE(wheel.Cancel(far));
+	ASSERT_FALSE(wheel.Cancel(far));
+	ASSERT_EQ(1u, wheel.Size());
+
+	//The cancelled timers' nodes are reused, their ids are not
+	const auto reused = wheel.Schedule(20, 4);
+	ASSERT_FALSE(wheel.Cancel(near));
+	EXPECT_EQ(20, wheel.NextWakeup());
+
+	vector<int> fired;
+	wheel.Advance(2000000, [&fired](int& value) { fired.push_back(value); });
+	EXPECT_EQ((vector<int>{ 4, 3 }), fired);
+	EXPECT_FALSE(wheel.Cancel(reused));
+}
+
+
+//Against a sorted reference, over every level and beyond the top one
+TEST(TimerWheel, RandomTimersFireOnTheFirstAdvancePastTheirTime)
+{
+	mt19937_64 random(7);
+	TimerWheel<int64_t> wheel(nanoseconds(1), 1024);
+	multiset<int64_t> pending;
+	vector<pair<TimerWheel<int64_t>::TimerId, int64_t>> ids;
+	for (int i = 0; i < 20000; ++i)
 	{
-		using namespace chrono;
-		this_thread::sleep_for(100ms);
+		const int64_t when = 1 + static_cast<int64_t>(random() % (uint64_t(1) << (i % 40)));
+		ids.emplace_back(wheel.Schedule(when, when), when);
+		pending.insert(when);
+	}
+	for (size_t i = 0; i < ids.size(); i += 3)
+	{
+		ASSERT_TRUE(wheel.Cancel(ids[i].first));
+		pending.erase(pending.find(ids[i].second));
+	}
+
+	int64_t now = 0;
+	while (!pending.empty())
+	{
+		now += static_cast<int64_t>(random() % (uint64_t(1) << (random() % 38)));
+		wheel.Advance(now, [&](int64_t& when)
+		{
+			ASSERT_LE(when, now);
+			ASSERT_EQ(*pending.begin(), when);	//also: nothing still pending was due earlier
+			pending.erase(pending.begin());
+		});
+		ASSERT_TRUE(pending.empty() || *pending.begin() > now);
+	}
+	EXPECT_TRUE(wheel.Empty());
+}
+
+
+TEST(ImpairedChatChannel, SeededLossDuplicationAndDelay)
+{
+	SimulatedClock clock;
+	InProcessChatChannel sender("sender", LinkConditions(), &clock), receiver("receiver", LinkConditions(), &clock, 8192);
+	InProcessChatChannel::Connect(sender, receiver);
+
+	LinkConditions conditions;
+	conditions.latency = milliseconds(10);
+	conditions.jitter = milliseconds(2);
+	conditions.distribution = DelayDistribution::Normal;
+	conditions.loss = 0.2;
+	conditions.duplicate = 0.1;
+	conditions.seed = 42;
+	ImpairedChatChannel impaired(sender, conditions, LinkConditions(), &clock);
+	ASSERT_TRUE(impaired.Initialise());
+	ASSERT_TRUE(receiver.Initialise());
+
+	for (int i = 0; i < 1000; ++i)
+		impaired.SendMessage("message " + to_string(i));
+
+	const auto stats = impaired.GetStats();
+	EXPECT_NEAR(200, static_cast<double>(stats.sent_lost), 50);
+	EXPECT_NEAR(80, static_cast<double>(stats.sent_duplicated), 30);
+	ASSERT_EQ(1000 - stats.sent_lost + stats.sent_duplicated, stats.delayed);
+
+	clock.Advance(milliseconds(1));
+	ASSERT_EQ(0u, impaired.Poll());
+	clock.Advance(milliseconds(100));
+	ASSERT_EQ(stats.delayed, impaired.Poll());
+	ASSERT_EQ(stats.delayed, receiver.Poll());
+	EXPECT_EQ(0u, impaired.GetStats().delayed);
+}
+
+
+TEST(ImpairedChatChannel, HoldsManyDelayedMessagesWithoutThreads)
+{
+	const size_t count = 50000;
+	SimulatedClock clock;
+	InProcessChatChannel sender("sender", LinkConditions(), &clock, count), receiver("receiver", LinkConditions(), &clock, count);
+	InProcessChatChannel::Connect(sender, receiver);
+
+	LinkConditions conditions;
+	conditions.latency = seconds(1);
+	conditions.jitter = milliseconds(500);
+	conditions.distribution = DelayDistribution::Pareto;
+	conditions.reorder = 0.1;
+	ImpairedChatChannel impaired(receiver, LinkConditions(), conditions, &clock, count);
+	ASSERT_TRUE(sender.Initialise());
+	ASSERT_TRUE(impaired.Initialise());
+
+	struct : ChannelCallbackHandler
+	{
+		void OnMessageReceived(const string&) override { received++; }
+		size_t received = 0;
+	} handler;
+	impaired.SetCallbackHandler(&handler);
+
+	for (size_t i = 0; i < count; ++i)
+		sender.SendMessage("hello");
+	ASSERT_EQ(count, receiver.Poll());
+	ASSERT_EQ(count, impaired.GetStats().delayed);
+
+	//Pareto has a long tail
+	size_t delivered = 0;
+	for (int s = 0; s < 600 && delivered < count; ++s)
+	{
+		clock.Advance(seconds(1));
+		delivered += impaired.Poll();
+	}
+	EXPECT_EQ(count, delivered);
+	EXPECT_EQ(count, handler.received);
+}
+
+
+TEST(ImpairedChatChannel, MessagesLargerThanSmallBuffersAreCopiedWithoutAllocating)
+{
+	SimulatedClock clock;
+	InProcessChatChannel sender("sender", LinkConditions(), &clock), receiver("receiver", LinkConditions(), &clock);
+	InProcessChatChannel::Connect(sender, receiver);
+
+	LinkConditions conditions;
+	conditions.latency = milliseconds(10);
+	ImpairedChatChannel impaired(sender, conditions, LinkConditions(), &clock, 256);
+	ASSERT_TRUE(impaired.Initialise());
+	ASSERT_TRUE(receiver.Initialise());
+
+	for (size_t size : { 257, 1400, 9000, 65000 })
+		impaired.SendMessage(string(size, 'x'));
+	ASSERT_EQ(4u, impaired.GetStats().delayed);
+	EXPECT_EQ(0u, impaired.GetStats().misses);
+	impaired.SendMessage(string(70000, 'x'));
+	EXPECT_EQ(1u, impaired.GetStats().misses);
+
+	clock.Advance(milliseconds(20));
+	ASSERT_EQ(5u, impaired.Poll());
+	ASSERT_EQ(5u, receiver.Poll());
+}
+
+
+//Half of each direction's copies are held back, the rest go straight through
+TEST(ImpairedChatChannel, DelayedAndImmediateCopiesLeaveFromOneThread)
+{
+	const int count = 2000;
+	InProcessChatChannel sender("sender"), receiver("receiver", LinkConditions(), nullptr, count);
+	InProcessChatChannel::Connect(sender, receiver);
+
+	LinkConditions conditions;
+	conditions.reorder = 0.5;
+	conditions.reorder_delay = microseconds(500);
+	ImpairedChatChannel outbound(sender, conditions);
+	conditions.seed = 2;
+	ImpairedChatChannel inbound(receiver, LinkConditions(), conditions);
+
+	struct : ChannelCallbackHandler
+	{
+		void OnMessageReceived(const string&) override
+		{
+			lock_guard<std::mutex> lock(guard);
+			threads.insert(this_thread::get_id());
+			received++;
+		}
+		std::mutex guard;
+		set<thread::id> threads;
+		int received = 0;
+	} handler;
+	inbound.SetCallbackHandler(&handler);
+	ASSERT_TRUE(outbound.Initialise());
+	ASSERT_TRUE(inbound.Initialise());
+
+	for (int i = 0; i < count; ++i)
+		outbound.SendMessage("message " + to_string(i));
+
+	const auto deadline = steady_clock::now() + 10s;
+	for (;;)
+	{
+		{
+			lock_guard<mutex> lock(handler.guard);
+			if (handler.received == count || steady_clock::now() > deadline)
+				break;
+		}
+		this_thread::sleep_for(1ms);
+	}
+
+	lock_guard<mutex> lock(handler.guard);
+	EXPECT_EQ(count, handler.received);
+	EXPECT_EQ(1u, handler.threads.size());
+}
+
+
+TEST(ChatHistory, Add_OverwritesOldestWhenFull)
+{
+	ChatHistory history(3);
+	const auto now = system_clock::now();
+	for (int i = 0; i < 5; ++i)
+		history.Add(now, "peer", to_string(i));
+
+	ASSERT_EQ(3u, history.Size());
+	ASSERT_EQ(5u, history.TotalAdded());
+	EXPECT_EQ("2", history[0].payload);
+	EXPECT_EQ("3", history[1].payload);
+	EXPECT_EQ("4", history[2].payload);
+}
+
+
+TEST(FrameThrottle, FlushDueOnlyWhenSomethingIsPending)
+{
+	FrameThrottle throttle(milliseconds(33), milliseconds(100));
+	const auto t0 = FrameThrottle::Clock::now();
+
+	ASSERT_FALSE(throttle.FlushDue(t0));
+	throttle.Notify(t0);
+	ASSERT_TRUE(throttle.FlushDue(t0));
+	throttle.Flushed(t0);
+	throttle.Notify(t0 + milliseconds(1));
+	ASSERT_FALSE(throttle.FlushDue(t0 + milliseconds(10)));
+	ASSERT_TRUE(throttle.FlushDue(t0 + milliseconds(33)));
+}
+
+
+TEST(BufferRef, Slice_SharesTheBufferAndClampsToItsSize)
+{
+	BufferPool pool(1, 32);
+	auto buffer = pool.Acquire();
+	const string text = "header:payload";
+	copy(text.begin(), text.end(), buffer.data());
+	buffer.resize(text.size());
+
+	auto payload = buffer.Slice(7, 100);
+	EXPECT_EQ("payload", payload.ToString());
+	EXPECT_EQ("load", payload.Slice(3, 4).ToString());
+	EXPECT_TRUE(buffer.Slice(50, 1).empty());
+	EXPECT_EQ(1u, pool.GetStats().in_use);
+}
+
+
+TEST(Frame, EncodeThenDecodeRoundTrips)
+{
+	FrameSender sender(0xDEADBEEF);
+	string frame;
+	sender.Encode("hello", 5, frame);
+	sender.Encode("again", 5, frame);
+
+	FrameHeader header;
+	const char* payload = nullptr;
+	ASSERT_TRUE(DecodeFrame(frame.data(), frame.size(), header, payload));
+	EXPECT_EQ(0xDEADBEEFu, header.sender_id);
+	EXPECT_EQ(1u, header.sequence);
+	EXPECT_EQ("again", string(payload, header.payload_length));
+	EXPECT_EQ(frame.data() + FrameHeaderSize, payload);
+}
+
+
+TEST(Frame, DecodeRejectsForeignAndTruncatedDatagrams)
+{
+	FrameSender sender(1);
+	string frame;
+	sender.Encode("hello", 5, frame);
+
+	FrameHeader header;
+	const char* payload = nullptr;
+	EXPECT_FALSE(DecodeFrame(frame.data(), frame.size() - 1, header, payload));
+	EXPECT_FALSE(DecodeFrame("hi, how are you?\n", 17, header, payload));
+	EXPECT_FALSE(DecodeFrame(frame.data(), 4, header, payload));
+}
+
+
+TEST(FrameReceiver, CountsGapsDuplicatesAndReordering)
+{
+	FrameReceiver receiver;
+	FrameHeader header = { FrameVersion, 0, 7, 0, 0 };
+	char frame[FrameHeaderSize];
+	const char* payload = nullptr;
+
+	auto accept = [&](uint32_t sequence)
+	{
+		header.sequence = sequence;
+		EncodeFrameHeader(header, frame);
+		FrameHeader decoded;
+		return receiver.Accept(frame, sizeof frame, false, decoded, payload);
+	};
+
+	EXPECT_TRUE(accept(0));
+	EXPECT_TRUE(accept(1));
+	EXPECT_TRUE(accept(4));		//2 and 3 missing
+	EXPECT_FALSE(accept(4));	//duplicate
+	EXPECT_TRUE(accept(2));		//late
+	EXPECT_FALSE(accept(2));
+
+	const auto stats = receiver.GetStats();
+	EXPECT_EQ(4u, stats.frames);
+	EXPECT_EQ(2u, stats.duplicates);
+	EXPECT_EQ(1u, stats.reordered);
+	EXPECT_EQ(1u, stats.lost);
+	EXPECT_FALSE(receiver.Accept(frame, sizeof frame, true, header, payload));
+	EXPECT_EQ(1u, receiver.GetStats().truncated);
+}
+
+
+TEST(RttEstimator, TimeoutFollowsSamplesAndBacksOff)
+{
+	RttEstimator rtt(200ms, 10ms, 2s);
+	EXPECT_EQ(200ms, rtt.Rto());
+
+	rtt.Sample(100ms);
+	EXPECT_EQ(100ms, rtt.Srtt());
+	EXPECT_EQ(300ms, rtt.Rto());	//srtt + 4 * rtt / 2
+
+	rtt.Backoff();
+	EXPECT_EQ(600ms, rtt.Rto());
+	rtt.Backoff();
+	rtt.Backoff();
+	EXPECT_EQ(2s, rtt.Rto());
+}
+
+
+//Hands a frame to a link as if it had arrived from the network
+static void Receive(ReliableLink& link, const string& frame, vector<Datagram>& ready, const ReliableLink::Clock::time_point now)
+{
+	Datagram datagram = {};
+	datagram.buffer = BufferRef::Allocate(frame.size());
+	datagram.buffer.resize(frame.size());
+	copy(frame.begin(), frame.end(), datagram.buffer.data());
+	datagram.data = datagram.buffer.data();
+	datagram.size = frame.size();
+
+	FrameHeader header;
+	const char* payload = nullptr;
+	ASSERT_TRUE(DecodeFrame(datagram.data, datagram.size, header, payload));
+	link.OnFrame(header, payload, datagram, ready, now);
+}
+
+
+static string Payload(const Datagram& datagram)
+{
+	return string(datagram.data + FrameHeaderSize, datagram.size - FrameHeaderSize);
+}
+
+
+TEST(ReliableLink, OnlyTheMissingFrameIsRetransmittedAndOrderIsRestored)
+{
+	ReliableLink sender(1, ReliableOptions()), receiver(2, ReliableOptions());
+	const auto now = ReliableLink::Clock::now();
+	vector<string> wire;
+	auto transmit = [&](const string& frame) { wire.push_back(frame); };
+
+	sender.Queue("one", 3);
+	sender.Queue("two", 3);
+	sender.Queue("three", 5);
+	sender.Poll(now, transmit);
+	ASSERT_EQ(3u, wire.size());
+
+	vector<Datagram> ready;
+	Receive(receiver, wire[0], ready, now);
+	Receive(receiver, wire[2], ready, now);	//"two" is lost
+	ASSERT_EQ(1u, ready.size());
+	EXPECT_EQ("one", Payload(ready[0]));
+
+	Receive(sender, *receiver.TakeAck(), ready, now + 1ms);
+	EXPECT_EQ(1u, sender.GetStats().send.in_flight);
+
+	wire.clear();
+	sender.Poll(now + 1ms, transmit);
+	EXPECT_TRUE(wire.empty());
+	sender.Poll(now + 1s, transmit);
+	ASSERT_EQ(1u, wire.size());
+
+	ready.clear();
+	Receive(receiver, wire[0], ready, now + 1s);
+	ASSERT_EQ(2u, ready.size());
+	EXPECT_EQ("two", Payload(ready[0]));
+	EXPECT_EQ("three", Payload(ready[1]));
+
+	Receive(sender, *receiver.TakeAck(), ready, now + 1s);
+	const auto stats = sender.GetStats();
+	EXPECT_EQ(0u, stats.send.in_flight);
+	EXPECT_EQ(3u, stats.send.sent);
+	EXPECT_EQ(1u, stats.send.retransmits);
+	EXPECT_EQ(1u, stats.send.timeouts);
+	EXPECT_EQ(1u, receiver.GetStats().receive.reordered);
+}
+
+
+TEST(ReliableLink, ReceiverSkipsFramesTheSenderAbandoned)
+{
+	ReliableOptions options;
+	options.max_transmissions = 2;
+	ReliableLink sender(1, options), receiver(2, options);
+	const auto now = ReliableLink::Clock::now();
+	vector<string> wire;
+	auto transmit = [&](const string& frame) { wire.push_back(frame); };
+
+	sender.Queue("lost", 4);
+	sender.Queue("kept", 4);
+	sender.Poll(now, transmit);
+
+	vector<Datagram> ready;
+	Receive(receiver, wire[1], ready, now);
+	EXPECT_TRUE(ready.empty());
+	Receive(sender, *receiver.TakeAck(), ready, now);
+
+	sender.Poll(now + 1s, transmit);
+	sender.Poll(now + 5s, transmit);
+	EXPECT_EQ(1u, sender.GetStats().send.abandoned);
+
+	wire.clear();
+	sender.Queue("next", 4);
+	sender.Poll(now + 5s, transmit);
+	Receive(receiver, wire.back(), ready, now + 5s);
+	ASSERT_EQ(2u, ready.size());
+	EXPECT_EQ("kept", Payload(ready[0]));
+	EXPECT_EQ("next", Payload(ready[1]));
+	EXPECT_EQ(1u, receiver.GetStats().receive.skipped);
+}
+
+
+TEST(TokenBucket, AdmitsUntilInDebtThenRefillsAtRate)
+{
+	TokenBucket bucket(1000, 500);
+	const auto start = TokenBucket::Clock::now();
+	EXPECT_TRUE(bucket.TryConsume(400, start));
+	EXPECT_TRUE(bucket.TryConsume(400, start));	//overdraws to -300
+	EXPECT_FALSE(bucket.TryConsume(1, start));
+	EXPECT_NEAR(300, duration_cast<milliseconds>(bucket.Delay(start)).count(), 1);
+
+	EXPECT_FALSE(bucket.TryConsume(1, start + 298ms));
+	EXPECT_TRUE(bucket.TryConsume(1, start + 301ms));
+	EXPECT_TRUE(TokenBucket().TryConsume(1 << 30));
+}
+
+
+TEST(AimdWindow, GrowsAdditivelyAndHalvesOnLoss)
+{
+	const auto now = AimdWindow::Clock::now();
+	AimdWindow window(4, 1, 64);
+	window.OnAcked(4);	//slow start
+	EXPECT_EQ(8u, window.Window());
+
+	window.OnLoss(now, 10ms);
+	EXPECT_EQ(4u, window.Window());
+	window.OnLoss(now + 5ms, 10ms);	//same round trip
+	EXPECT_EQ(4u, window.Window());
+
+	window.OnAcked(3);
+	EXPECT_EQ(4u, window.Window());
+	window.OnAcked(1);	//one full window acknowledged
+	EXPECT_EQ(5u, window.Window());
+
+	window.OnTimeout();
+	EXPECT_EQ(1u, window.Window());
+	EXPECT_EQ(1u, window.GetStats().decreases);
+	EXPECT_EQ(1u, window.GetStats().collapses);
+}
+
+
+TEST(ReliableLink, CongestionWindowLimitsFramesInFlight)
+{
+	ReliableOptions options;
+	options.initial_cwnd = 2;
+	ReliableLink sender(1, options), receiver(2, options);
+	const auto now = ReliableLink::Clock::now();
+	vector<string> wire;
+	auto transmit = [&](const string& frame) { wire.push_back(frame); };
+
+	for (int i = 0; i < 10; ++i)
+		sender.Queue("x", 1);
+	sender.Poll(now, transmit);
+	EXPECT_EQ(2u, wire.size());
+
+	vector<Datagram> ready;
+	for (const auto& frame : wire)
+		Receive(receiver, frame, ready, now);
+	Receive(sender, *receiver.TakeAck(), ready, now + 1ms);
+	EXPECT_EQ(4u, sender.GetStats().send.congestion.cwnd);
+	EXPECT_LT(0.0, sender.GetStats().send.pacing_rate);
+
+	wire.clear();
+	sender.Poll(now + 1ms, transmit);
+	EXPECT_EQ(4u, wire.size());
+
+	sender.Poll(now + 1s, transmit);	//nothing acknowledged
+	EXPECT_EQ(1u, sender.GetStats().send.congestion.cwnd);
+	EXPECT_EQ(4u, sender.GetStats().send.in_flight);
+}
+
+
+//Fragment payloads (fragment header + chunk) of the frames a Fragmenter produced
+static vector<string> FragmentPayloads(const vector<string>& frames, const size_t count)
+{
+	vector<string> payloads;
+	for (size_t i = 0; i < count; ++i)
+	{
+		FrameHeader header;
+		const char* payload = nullptr;
+		EXPECT_TRUE(DecodeFrame(frames[i].data(), frames[i].size(), header, payload));
+		EXPECT_EQ(FrameFlagFragment, header.flags);
+		payloads.emplace_back(payload, header.payload_length);
+	}
+	return payloads;
+}
+
+
+TEST(Reassembler, OutOfOrderAndDuplicateFragmentsYieldTheOriginalMessage)
+{
+	FrameSender sender(7);
+	Fragmenter fragmenter(200);
+	string message(1000, '\0');
+	for (size_t i = 0; i < message.size(); ++i)
+		message[i] = static_cast<char>(i);
+
+	vector<string> frames;
+	const size_t count = fragmenter.Encode(sender, message.data(), message.size(), frames);
+	ASSERT_EQ(6u, count);
+	for (size_t i = 0; i < count; ++i)
+		EXPECT_LE(frames[i].size(), 200u);
+
+	auto payloads = FragmentPayloads(frames, count);
+	Reassembler reassembler;
+	BufferRef assembled;
+	for (size_t i : { 5, 2, 0, 2, 4, 1 })
+		EXPECT_FALSE(reassembler.Add(7, payloads[i].data(), payloads[i].size(), assembled));
+	EXPECT_EQ(1u, reassembler.GetStats().in_progress);
+
+	ASSERT_TRUE(reassembler.Add(7, payloads[3].data(), payloads[3].size(), assembled));
+	EXPECT_EQ(message, assembled.ToString());
+	EXPECT_EQ(1u, reassembler.GetStats().completed);
+	EXPECT_EQ(0u, reassembler.GetStats().bytes_held);
+}
+
+
+TEST(MessageEncoder, GatheredFramesMatchCopiedFrames)
+{
+	MessageEncoder copied(7, 200);
+	MessageEncoder gathered(7, 200);
+	string message(1000, '\0');
+	for (size_t i = 0; i < message.size(); ++i)
+		message[i] = static_cast<char>(i);
+
+	for (const size_t length : { size_t(10), message.size() })
+	{
+		const size_t count = copied.Encode(message.data(), length);
+		ASSERT_EQ(count, gathered.EncodeGather(message.data(), length));
+		for (size_t i = 0; i < count; ++i)
+		{
+			const auto& frame = gathered.Gathered(i);
+			EXPECT_GE(frame.body, message.data());
+			EXPECT_LE(frame.body + frame.body_size, message.data() + length);
+			EXPECT_EQ(copied.Frame(i), string(frame.header, frame.header_size) + string(frame.body, frame.body_size));
+		}
 	}
 }
 
 
+TEST(Reassembler, IncompleteMessagesExpireAndMemoryIsCapped)
+{
+	using Clock = Reassembler::Clock;
+	FrameSender sender(7);
+	Fragmenter fragmenter(200);
+	const string message(1000, 'x');
+	vector<string> frames;
+	const size_t count = fragmenter.Encode(sender, message.data(), message.size(), frames);
+	auto first = FragmentPayloads(frames, count);
+	fragmenter.Encode(sender, message.data(), message.size(), frames);
+	auto second = FragmentPayloads(frames, count);
+
+	Reassembler reassembler(1000ms, 1500);
+	BufferRef assembled;
+	const auto start = Clock::now();
+	EXPECT_FALSE(reassembler.Add(7, first[0].data(), first[0].size(), assembled, start));
+	EXPECT_FALSE(reassembler.Add(7, second[0].data(), second[0].size(), assembled, start));
+	EXPECT_EQ(1u, reassembler.GetStats().rejected);	//second message would exceed the cap
+	EXPECT_EQ(1000u, reassembler.GetStats().bytes_held);
+
+	reassembler.Expire(start + 1000ms);
+	EXPECT_EQ(1u, reassembler.GetStats().expired);
+	EXPECT_EQ(0u, reassembler.GetStats().bytes_held);
+
+	for (const auto& payload : second)
+		reassembler.Add(7, payload.data(), payload.size(), assembled, start + 1001ms);
+	EXPECT_EQ(message, assembled.ToString());
+}
+
+
 TEST(ChatterPresenter, Initialise_ChannelIsInitialised)
 {
 	UdpChatChannel channel("127.0.0.1:2000", "127.0.0.1:2001");
@@ -167,11 +1910,13 @@ TEST(ChatterPresenter, OnSendMessage_MessageIsAppendedToChatHistory)
 	EXPECT_CALL(view, GetMessage()).WillOnce(Return("hi, how are you?"));
 
 	//expectations
-	EXPECT_CALL(view, AppendToChatHistory("hi, how are you?\n"));
+	EXPECT_CALL(view, ChatHistoryChanged());
 	EXPECT_CALL(view, SetMessage(""));
 
 	presenter.Initialise();
 	presenter.OnSendCommand();
+	ASSERT_EQ(1u, presenter.History().Size());
+	EXPECT_EQ("hi, how are you?\n", presenter.History()[0].payload);
 }
 
 
@@ -185,7 +1930,7 @@ TEST(ChatterPresenter, OnSendMessage_MessageIsSent)
 	EXPECT_CALL(view, GetMessage()).WillOnce(Return("hi, how are you?"));
 
 	//expectations
-	EXPECT_CALL(view, AppendToChatHistory("hi, how are you?\n"));
+	EXPECT_CALL(view, ChatHistoryChanged());
 	EXPECT_CALL(view, SetMessage(""));
 	EXPECT_CALL(channel, SendMessage("hi, how are you?\n"));
 
@@ -196,8 +1941,10 @@ TEST(ChatterPresenter, OnSendMessage_MessageIsSent)
 
 TEST(ChatterPresenter, ReceivedMessageIAppendedToChatHistory)
 {
-	UdpChatChannel channel1("127.0.0.1:2000", "127.0.0.1:2001");
-	UdpChatChannel channel2("127.0.0.1:2001", "127.0.0.1:2000");	
+	SimulatedClock clock;
+	InProcessChatChannel channel1("channel1", LinkConditions(), &clock);
+	InProcessChatChannel channel2("channel2", LinkConditions(), &clock);
+	InProcessChatChannel::Connect(channel1, channel2);
 	ChatterPresenter presenter2(channel2);
 	NiceMock<MockChatterView> view2(presenter2);
 
@@ -207,16 +1954,63 @@ TEST(ChatterPresenter, ReceivedMessageIAppendedToChatHistory)
 	//We send message from channel1 to channel2 through the presenter
 	//we expect that the message should appear in view2's chat history
 	//when it is received
-	EXPECT_CALL(view2, AppendToChatHistory("hi from channel1!\n"));
+	EXPECT_CALL(view2, ChatHistoryChanged());
 
 	channel1.SendMessage("hi from channel1!");
+	ASSERT_EQ(1u, channel2.Poll());
+	ASSERT_EQ(1u, presenter2.ProcessReceivedMessages());
+	ASSERT_EQ(1u, presenter2.History().Size());
+	EXPECT_EQ("hi from channel1!", presenter2.History()[0].payload);
+}
 
-	//busy wait until the message is received 
-	while (!channel2.ReceivedMessageCount())
-	{
-		using namespace chrono;
-		this_thread::sleep_for(100ms);
-	}
+
+TEST(ChatterPresenter, ReceivedMessagesAreAppendedToChatHistoryInOneBatch)
+{
+	NiceMock<MockChatChannel> channel;
+	ChatterPresenter presenter(channel);
+	NiceMock<MockChatterView> view(presenter);
+
+	EXPECT_CALL(view, ChatHistoryChanged()).Times(1);
+
+	presenter.OnMessageReceived("one");
+	presenter.OnMessageReceived("two");
+	presenter.OnMessageReceived("three");
+	ASSERT_EQ(3u, presenter.ProcessReceivedMessages());
+	ASSERT_EQ(0u, presenter.ProcessReceivedMessages());
+}
+
+
+TEST(ChatterPresenter, SentAndReceivedMessagesAreRecordedInHistory)
+{
+	NiceMock<MockChatChannel> channel;
+	ChatterPresenter presenter(channel, 16, 2);
+	NiceMock<MockChatterView> view(presenter);
+	EXPECT_CALL(view, GetMessage()).WillRepeatedly(Return("hello"));
+
+	presenter.OnSendCommand();
+	presenter.OnMessageReceived("hi");
+	presenter.OnMessageReceived("bye");
+	presenter.ProcessReceivedMessages();
+
+	const auto& history = presenter.History();
+	ASSERT_EQ(2u, history.Size());
+	EXPECT_EQ("hi", history[0].payload);
+	EXPECT_EQ("bye", history[1].payload);
+}
+
+
+TEST(ChatterPresenter, ReceivedMessagesAreDroppedWhenQueueIsFull)
+{
+	NiceMock<MockChatChannel> channel;
+	ChatterPresenter presenter(channel, 2);
+	NiceMock<MockChatterView> view(presenter);
+
+	presenter.OnMessageReceived("one");
+	presenter.OnMessageReceived("two");
+	presenter.OnMessageReceived("three");
+
+	ASSERT_EQ(1u, presenter.DroppedMessageCount());
+	ASSERT_EQ(2u, presenter.ProcessReceivedMessages());
 }
 
 
@@ -1,5 +1,5 @@
 #! /bin/bash
 
+#CHATTER_PROBE_MS=10 ./run_two_chatters.sh logs round trip and one-way latency percentiles every second
 ./chatter_app 127.0.0.1:2000 127.0.0.1:2001 &
 ./chatter_app 127.0.0.1:2001 127.0.0.1:2000 &
-